@@ -18,7 +18,9 @@ struct cache_entry {
     char data[CACHE_BLKSZ]; // actual data from the block
     int valid; // if entry contains data and in use
     int dirty; // whether we wrote to this block or not
+    int prefetched; // loaded by cache_prefetch and not used since
     struct cache_entry *next; // link to next entry
+    struct ioreq req; // write-back request used by cache_flush
 };
 
 struct cache {
@@ -26,8 +28,86 @@ struct cache {
     struct cache_entry *head; // head of the linked list
     struct lock cache_lock;
     int size; // size of cache, number of entries
+    uint64_t *trace; // if set, block numbers of misses and prefetch hits are recorded here
+    int trace_cnt; // number of recorded block numbers
+    int trace_max; // capacity of trace
+    int unsynced; // device writes since the last device flush
 };
 
+// Entries come and go with every miss and eviction, so they have their own slab cache.
+static struct kmem_cache entry_cache =
+    KMEM_CACHE_INIT("cache_entry", sizeof(struct cache_entry));
+
+// Inputs:  struct cache *cache - cache to make room in (cache_lock held)
+// Outputs: int - Returns 0 on success, or a negative failure
+// Description: If the cache is full, removes the entry at the head of the list, writing
+// it back first if it is dirty.
+// Side Effects: May write a block to the backing device and frees the victim entry
+static int cache_evict(struct cache *cache) {
+    if (cache->size < CACHE_CAPACITY)
+        return 0;
+
+    struct cache_entry *victim = cache->head; //removing head
+    cache->head = victim->next;
+    cache->size--;
+
+    if (victim->valid && victim->dirty) {
+        int ret = iowriteat(cache->bdev, victim->blocknum * CACHE_BLKSZ, victim->data, CACHE_BLKSZ); //write at the block
+        if (ret < 0) //if fail,
+            return ret; //return
+        cache->unsynced++;
+    }
+
+    kmem_cache_free(&entry_cache, victim); //free victim memory on heap
+    return 0;
+}
+
+// Inputs:  struct cache *cache - cache being traced (cache_lock held)
+//          uint64_t blocknum - block number to record
+// Outputs: None
+// Description: Records a block in the trace, if tracing and the block is not there yet.
+// Side Effects: Modifies the trace
+static void cache_trace_add(struct cache *cache, uint64_t blocknum) {
+    if (cache->trace && cache->trace_cnt < cache->trace_max) {
+        for (int i = 0; i < cache->trace_cnt; i++)
+            if (cache->trace[i] == blocknum)
+                return;
+        cache->trace[cache->trace_cnt++] = blocknum;
+    }
+}
+
+// Inputs:  struct cache *cache - cache to insert into (cache_lock held)
+//          struct cache_entry *new_entry - entry to append
+// Outputs: None
+// Description: Appends an entry at the tail of the list.
+// Side Effects: Modifies the cache list
+static void cache_insert(struct cache *cache, struct cache_entry *new_entry) {
+    // append to list (inserting at tail)
+    if (!cache->head) {
+        cache->head = new_entry;
+    } else {
+        struct cache_entry *iter = cache->head; // head
+        while (iter->next) iter = iter->next;
+        iter->next = new_entry;
+    }
+    cache->size++;//increasing size
+}
+
+// Inputs:  struct cache *cache - cache to search (cache_lock held)
+//          uint64_t blocknum - block number to look up
+// Outputs: struct cache_entry * - matching entry, or NULL
+// Description: Linear search of the cache list
+// Side Effects: None
+static struct cache_entry *cache_find(struct cache *cache, uint64_t blocknum) {
+    struct cache_entry *curr = cache->head;
+    while (curr) {
+        if (curr->valid && curr->blocknum == blocknum)
+            return curr;
+        curr = curr->next; //next
+    }
+    return NULL;
+}
+
 // Inputs:  struct io * bkgio- Backing I/O device used for reading and writing block
 //struct cache **cptr - pointer to where create structure will be stored
 // Outputs:  int - Returns 0 on success, or a negative failure  
@@ -73,45 +153,37 @@ int cache_get_block(struct cache * cache, unsigned long long pos, void ** pptr)
     uint64_t blocknum = pos / CACHE_BLKSZ; //caclulating block number
 
     // Search for cache hit through linked list
-    // struct cache_entry *prev = NULL;
-    struct cache_entry *curr = cache->head;
-    while (curr) {
-        if (curr->valid && curr->blocknum == blocknum) {
-            *pptr = curr->data;
-            lock_release(&cache->cache_lock);
-            return 0;
+    struct cache_entry *curr = cache_find(cache, blocknum);
+    if (curr) {
+        // a prefetched block counts as missed the first time it is used, so the trace
+        // keeps the blocks that prefetching saved a read of
+        if (curr->prefetched) {
+            curr->prefetched = 0;
+            cache_trace_add(cache, blocknum);
         }
-        // prev = curr;
-        curr = curr->next; //next
+        *pptr = curr->data;
+        lock_release(&cache->cache_lock);
+        return 0;
     }
 
     // if full, evict least-recently-used (head of linked list)
-    if (cache->size >= CACHE_CAPACITY) { //if size is greater than 64 entries,
-        struct cache_entry *victim = cache->head; //removing head
-        cache->head = victim->next; 
-        cache->size--;
-
-        if (victim->valid && victim->dirty) {
-            int ret = iowriteat(cache->bdev, victim->blocknum * CACHE_BLKSZ, victim->data, CACHE_BLKSZ); //write at the block
-            if (ret < 0) { //if fail,
-                lock_release(&cache->cache_lock);
-                return ret; //return
-            }
-        }
-
-        kfree(victim); //free victim memory on heap
+    int ret = cache_evict(cache);
+    if (ret < 0) {
+        lock_release(&cache->cache_lock);
+        return ret;
     }
 
     // sllocate new entry
-    struct cache_entry *new_entry = kcalloc(1, sizeof(struct cache_entry));
+    struct cache_entry *new_entry = kmem_cache_alloc(&entry_cache);
     if (!new_entry) { //validation
         lock_release(&cache->cache_lock);
         return -ENOMEM;
     }
+    memset(new_entry, 0, sizeof(struct cache_entry));
 
-    int ret = ioreadat(cache->bdev, pos, new_entry->data, CACHE_BLKSZ);
+    ret = ioreadat(cache->bdev, pos, new_entry->data, CACHE_BLKSZ);
     if (ret != CACHE_BLKSZ) { //validating
-        kfree(new_entry);
+        kmem_cache_free(&entry_cache, new_entry);
         lock_release(&cache->cache_lock);
         return -EIO;
     }
@@ -120,17 +192,9 @@ int cache_get_block(struct cache * cache, unsigned long long pos, void ** pptr)
     new_entry->dirty = CACHE_CLEAN;
     new_entry->blocknum = blocknum;
     new_entry->next = NULL;
+    cache_insert(cache, new_entry);
+    cache_trace_add(cache, blocknum);
 
-    // append to list (inserting at tail)
-    if (!cache->head) {
-        cache->head = new_entry;
-    } else {
-        struct cache_entry *iter = cache->head; // head
-        while (iter->next) iter = iter->next;
-        iter->next = new_entry;
-    }
-
-    cache->size++;//increasing size
     *pptr = new_entry->data;
     lock_release(&cache->cache_lock);
     return 0;
@@ -164,7 +228,8 @@ void cache_release_block(struct cache * cache, void * pblk, int dirty) {
 // Inputs:  struct cache *cache - it will point to the cache structure to be flushed
 // Outputs: int - Returns 0 on success, or a negative failure
 // Description: It will iterates through all the vaild entries in the cache and write back to any dirty block
-// to the backing device. After a sucessful wirte, it clear the dirty flag.
+// to the backing device. All write-backs are submitted before waiting for any of them, so
+// the device can work on several at once. Blocks are marked clean only once written.
 // Side Effects: It will write operation to the backing device and modifies to the cache states by clearing dirty bits.
 //It would also acquires and release the cache lock.
 
@@ -174,19 +239,244 @@ int cache_flush(struct cache * cache) {
 
     //getting lock
     lock_acquire(&cache->cache_lock);
-    struct cache_entry *entry = cache->head;
-    while (entry) { //while there is an entry
+    int ret = 0;
+    struct cache_entry *entry;
+
+    // submit every dirty block
+    for (entry = cache->head; entry; entry = entry->next) {
+        entry->req.op = -1; // not submitted
         if (entry->valid && entry->dirty) { //if its valid and somemthing is actually written to the block
-            int ret = iowriteat(cache->bdev, entry->blocknum * CACHE_BLKSZ, entry->data, CACHE_BLKSZ); //perform write to device
-            if (ret != CACHE_BLKSZ) { //validation
-                lock_release(&cache->cache_lock);
-                return -EIO;
+            ioreq_init(&entry->req, IOREQ_WRITE, entry->blocknum * CACHE_BLKSZ, entry->data, CACHE_BLKSZ);
+            if (iosubmit(cache->bdev, &entry->req) < 0) {
+                entry->req.op = -1;
+                ret = -EIO;
             }
+        }
+    }
+
+    // then wait for all of them
+    for (entry = cache->head; entry; entry = entry->next) {
+        if (entry->req.op != IOREQ_WRITE)
+            continue;
+        if (iowait(&entry->req) != CACHE_BLKSZ) //validation
+            ret = -EIO;
+        else {
             entry->dirty = CACHE_CLEAN; //update to mark clean
+            cache->unsynced++;
         }
-        entry = entry->next; //update list
+        entry->req.op = -1;
     }
+
     lock_release(&cache->cache_lock); //release lock
-    return 0;
+    return ret;
+}
+// Inputs:  struct cache *cache - it will point to the cache structure
+// Outputs: int - Returns 0 on success, or a negative failure
+// Description: Writes back every dirty block, then, if anything has been written to the
+// device since the last time, asks the device to make it durable (IOCTL_FLUSH).
+// Side Effects: Writes to the backing device
+int cache_sync(struct cache * cache) {
+    int ret = cache_flush(cache);
+    if (ret < 0)
+        return ret;
+
+    lock_acquire(&cache->cache_lock);
+    if (cache->unsynced > 0) {
+        ret = ioctl(cache->bdev, IOCTL_FLUSH, NULL);
+        if (ret == -ENOTSUP)
+            ret = 0; // nothing to flush below us
+        if (ret == 0)
+            cache->unsynced = 0;
+    }
+    lock_release(&cache->cache_lock);
+    return ret;
+}
+
+// Inputs:  struct cache *cache - it will point to the cache structure (cache_lock held)
+//          uint64_t blocknum - first block, unsigned long cnt - number of blocks
+// Outputs: None
+// Description: Drops cached copies of the blocks without writing them back.
+// Side Effects: Frees cache entries
+static void cache_drop(struct cache *cache, uint64_t blocknum, unsigned long cnt) {
+    struct cache_entry **pp = &cache->head;
+    while (*pp) {
+        struct cache_entry *entry = *pp;
+        if (entry->blocknum >= blocknum && entry->blocknum - blocknum < cnt) {
+            *pp = entry->next;
+            cache->size--;
+            kmem_cache_free(&entry_cache, entry);
+        } else
+            pp = &entry->next;
+    }
+}
+
+// Inputs:  struct cache *cache - it will point to the cache structure
+//          unsigned long long pos - byte offset of the first block
+//          unsigned long cnt - number of consecutive blocks
+// Outputs: int - Returns 0 on success, or a negative failure
+// Description: Makes the blocks read as zeros. The device zeroes them itself if it can
+// (IOCTL_WRITEZEROES); otherwise zeros are written from one shared zero block, several
+// blocks per request. Cached copies are dropped: they would be stale.
+// Side Effects: Writes to the backing device, frees cache entries
+int cache_zero(struct cache * cache, unsigned long long pos, unsigned long cnt) {
+    static const char zero_block[CACHE_BLKSZ];
+    struct ioseg segs[CACHE_PREFETCH_BATCH];
+    unsigned long long ext[2] = { pos, cnt * CACHE_BLKSZ };
+    struct ioreq req;
+    unsigned long n, i;
+    int ret;
+
+    if (!cache || pos % CACHE_BLKSZ != 0)
+        return -EINVAL;
+    if (cnt == 0)
+        return 0;
+
+    lock_acquire(&cache->cache_lock);
+    cache_drop(cache, pos / CACHE_BLKSZ, cnt);
+
+    ret = ioctl(cache->bdev, IOCTL_WRITEZEROES, ext);
+    if (ret == -ENOTSUP) {
+        for (i = 0; i < CACHE_PREFETCH_BATCH; i++) {
+            segs[i].buf = (void *)zero_block;
+            segs[i].len = CACHE_BLKSZ;
+        }
+        ret = 0;
+        while (cnt > 0 && ret == 0) {
+            n = (cnt < CACHE_PREFETCH_BATCH) ? cnt : CACHE_PREFETCH_BATCH;
+            ioreq_init_segs(&req, IOREQ_WRITE, pos, segs, n);
+            ret = iosubmit(cache->bdev, &req);
+            if (ret == 0 && iowait(&req) != (long)(n * CACHE_BLKSZ))
+                ret = -EIO;
+            pos += n * CACHE_BLKSZ;
+            cnt -= n;
+        }
+    }
+
+    if (ret == 0)
+        cache->unsynced++;
+    lock_release(&cache->cache_lock);
+    return ret;
+}
+
+// Inputs:  struct cache *cache - it will point to the cache structure
+//          unsigned long long pos - byte offset of the first block
+//          unsigned long cnt - number of consecutive blocks
+// Outputs: int - Returns 0 on success, or a negative failure
+// Description: Tells the device the blocks are no longer in use (IOCTL_DISCARD), if it
+// cares. Cached copies are dropped without being written back.
+// Side Effects: Frees cache entries, may discard blocks on the device
+int cache_discard(struct cache * cache, unsigned long long pos, unsigned long cnt) {
+    unsigned long long ext[2] = { pos, cnt * CACHE_BLKSZ };
+    int ret;
+
+    if (!cache || pos % CACHE_BLKSZ != 0)
+        return -EINVAL;
+    if (cnt == 0)
+        return 0;
+
+    lock_acquire(&cache->cache_lock);
+    cache_drop(cache, pos / CACHE_BLKSZ, cnt);
+    ret = ioctl(cache->bdev, IOCTL_DISCARD, ext);
+    if (ret == -ENOTSUP)
+        ret = 0; // only a hint
+    else if (ret == 0)
+        cache->unsynced++;
+    lock_release(&cache->cache_lock);
+    return ret;
+}
+
+// Inputs:  struct cache *cache - it will point to the cache structure
+//          unsigned long long pos - byte offset of the first block to load
+//          unsigned long cnt - number of consecutive blocks to load
+// Outputs: int - Returns 0 on success, or a negative failure
+// Description: Loads a run of consecutive blocks into the cache with as few device reads
+// as possible. Each run of uncached blocks (up to CACHE_PREFETCH_BATCH) is read with one
+// scatter-gather request straight into new cache entries; blocks that are already cached
+// are left alone. At most CACHE_CAPACITY blocks are loaded.
+// Side Effects: Reads from the backing device, may evict (and write back) other entries
+int cache_prefetch(struct cache * cache, unsigned long long pos, unsigned long cnt) {
+    struct cache_entry *batch[CACHE_PREFETCH_BATCH];
+    struct ioseg segs[CACHE_PREFETCH_BATCH];
+    struct ioreq req;
+    uint64_t blocknum = pos / CACHE_BLKSZ;
+    unsigned long n, i;
+    int ret = 0;
+
+    if (!cache || pos % CACHE_BLKSZ != 0)
+        return -EINVAL;
+    if (cnt > CACHE_CAPACITY)
+        cnt = CACHE_CAPACITY;
+
+    lock_acquire(&cache->cache_lock);
+    while (cnt > 0 && ret == 0) {
+        if (cache_find(cache, blocknum)) {
+            blocknum++; // cached copy may be dirty, keep it
+            cnt--;
+            continue;
+        }
+
+        // gather the run of uncached blocks starting here
+        for (n = 0; n < cnt && n < CACHE_PREFETCH_BATCH; n++) {
+            if (n > 0 && cache_find(cache, blocknum + n))
+                break;
+            batch[n] = kmem_cache_alloc(&entry_cache);
+            if (!batch[n]) {
+                ret = -ENOMEM;
+                break;
+            }
+            memset(batch[n], 0, sizeof(struct cache_entry));
+            segs[n].buf = batch[n]->data;
+            segs[n].len = CACHE_BLKSZ;
+        }
+
+        if (ret == 0) {
+            ioreq_init_segs(&req, IOREQ_READ, blocknum * CACHE_BLKSZ, segs, n);
+            ret = iosubmit(cache->bdev, &req);
+            if (ret == 0 && iowait(&req) != (long)(n * CACHE_BLKSZ))
+                ret = -EIO;
+        }
+
+        for (i = 0; i < n; i++) {
+            if (ret == 0)
+                ret = cache_evict(cache);
+            if (ret < 0) {
+                kmem_cache_free(&entry_cache, batch[i]);
+                continue;
+            }
+            batch[i]->valid = CACHE_VALID;
+            batch[i]->dirty = CACHE_CLEAN;
+            batch[i]->prefetched = 1;
+            batch[i]->blocknum = blocknum + i;
+            cache_insert(cache, batch[i]);
+        }
+        blocknum += n;
+        cnt -= n;
+    }
+    lock_release(&cache->cache_lock);
+
+    return ret;
 }
 
+// Inputs:  struct cache *cache - it will point to the cache structure
+//          uint64_t *log - array that receives block numbers, or NULL to stop tracing
+//          int max - capacity of log
+// Outputs: None
+// Description: Starts (or stops) recording the block number of every distinct cache miss.
+// The first use of a block loaded by cache_prefetch is recorded as a miss too.
+// Side Effects: Modifies the cache trace state
+void cache_trace(struct cache * cache, uint64_t * log, int max) {
+    if (!cache) return;
+    lock_acquire(&cache->cache_lock);
+    cache->trace = log;
+    cache->trace_cnt = 0;
+    cache->trace_max = log ? max : 0;
+    lock_release(&cache->cache_lock);
+}
+
+// Inputs:  struct cache *cache - it will point to the cache structure
+// Outputs: int - number of block numbers recorded since cache_trace was called
+// Description: Returns the trace fill level
+// Side Effects: None
+int cache_trace_count(struct cache * cache) {
+    return cache ? cache->trace_cnt : 0;
+}
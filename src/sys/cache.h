@@ -16,6 +16,9 @@
 #define CACHE_VALID 1
 
 #define CACHE_CAPACITY 64
+#define CACHE_PREFETCH_BATCH 16 // most blocks read by one prefetch request
+
+#include <stdint.h>
 
 struct io; // extern decl.
 struct cache; // opaque decl.
@@ -24,5 +27,11 @@ extern int create_cache(struct io * bkgio, struct cache ** cptr);
 extern int cache_get_block(struct cache * cache, unsigned long long pos, void ** pptr);
 extern void cache_release_block(struct cache * cache, void * pblk, int dirty);
 extern int cache_flush(struct cache * cache);
+extern int cache_sync(struct cache * cache);
+extern int cache_zero(struct cache * cache, unsigned long long pos, unsigned long cnt);
+extern int cache_discard(struct cache * cache, unsigned long long pos, unsigned long cnt);
+extern int cache_prefetch(struct cache * cache, unsigned long long pos, unsigned long cnt);
+extern void cache_trace(struct cache * cache, uint64_t * log, int max);
+extern int cache_trace_count(struct cache * cache);
 
 #endif // _CACHE_H_
\ No newline at end of file
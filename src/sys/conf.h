@@ -116,3 +116,7 @@
 #if 1 // support for passing command-line arguments to exec'd process
 #define WITH_ARGV
 #endif
+
+#if 0 // record blocks read after mount and prefetch them on the next boot
+#define WITH_KTFS_PREFETCH
+#endif
@@ -44,6 +44,7 @@
 #include "console.h"
 #include "string.h"
 #include "heap.h"
+#include "memory.h"
 
 #include "error.h"
 
@@ -148,7 +149,7 @@ int rtc_cntl(struct io * io, int cmd, void * arg) {
 //  void *buf - The pointer to the buffer to the real time value that would be stored.
 //long bufsz - This is the size of the buffer 
 // Outputs: return the success which the number of byte read. It also return the bufz to zero
-// and return `-EINVAL` if it smaller of the 64 bit  
+// and return `-EINVAL` if it smaller of the 64 bit, `-EFAULT` if buf cannot be stored to
 // Description/ide Effects: This function reads the real-time value from the device by checking if the buffer size is valid.
 // It also reads the current time from the device registers, copies the value to the provided buffer,
 // and returns the number of bytes read.
@@ -168,7 +169,10 @@ long rtc_read(struct io * io, void * buf, long bufsz) {
 
     uint64_t temp; 
     temp = read_real_time((struct rtc_regs *)rtc->regs); //this will read the real time value from the regsiter 
-    memcpy(buf, &temp, sizeof(uint64_t)); //this will copy value to the buffer 
+    if (memcpy_nofault(buf, &temp, sizeof(uint64_t)) < 0) //this will copy value to the buffer 
+    {
+        return -EFAULT; // buf could not be stored to
+    }
 
     return sizeof(uint64_t); // this will retunr the number of byte read 
 }
@@ -22,6 +22,7 @@
 #include "device.h"
 #include "intr.h"
 #include "heap.h"
+#include "memory.h"
 
 
 #include "ioimpl.h"
@@ -267,7 +268,7 @@ void uart_close(struct io * io) {
 // struct io *io - The pointer to the io structure with urat device
 // void *buf - it will pointer to the buffer where it will store the data
 //long bufsz -The maximum number of bytes read from the receive buffer
-// Outputs: The counter would be the number of bytes sucessfully read from the Uart buffer
+// Outputs: The counter would be the number of bytes sucessfully read from the Uart buffer, or -EFAULT if buf could not be stored to
 // Description/Side Effects: This function reads data from the UART device by retrieving characters from the receive buffer.
 // The data is read until the requested number of bytes is reached or the buffer is empty,
 // re enabling the data ready interrupt afterward, and returning the number of bytes successfully read.
@@ -297,18 +298,31 @@ long uart_read(struct io * io, void * buf, long bufsz)
 
     char *chacter_buf = buf; // make a pointer to the chacter_buf
     long counter = 0; //counter for bytes read
+    int fault = 0; //set if buf could not be stored to
+    char c;
     while (counter < bufsz && !rbuf_empty(&uart->rxbuf)) //check if the recevice buffer have data
     {
-        chacter_buf[counter++] = rbuf_getc(&uart->rxbuf);//the will get from recivce buffer
+        c = uart->rxbuf.data[uart->rxbuf.hpos % UART_RBUFSZ]; //peek so a bad buf loses nothing
+        if (memcpy_nofault(chacter_buf + counter, &c, 1) < 0)
+        {
+            fault = 1;
+            break;
+        }
+        rbuf_getc(&uart->rxbuf);//the will get from recivce buffer
+        counter++;
     }
     uart->regs->ier = uart->regs->ier | IER_DRIE; //this will reenable the data ready interrupt  
+    if (counter == 0 && fault)
+    {
+        return -EFAULT;
+    }
     return counter;  //the number of byte that have sucessfully read
 }
 // Inputs:
 //struct io *io -The pointer to the io structure with urat device
 // const void *buf - The pointer to the buffer will have the data to be trnsmitted.
 //long len - The number of byes to the write to the Uart buffer.
-// Outputs: The number of bytes which are successfuly written from the uart buffer
+// Outputs: The number of bytes which are successfuly written from the uart buffer, or -EFAULT if buf could not be read
 // Description/Side Effects: This function writes data to the UART device by placing characters from the provided buffer into the transmit buffer until the specified length
 // is reached or the buffer is full, enabling the transmit register empty interrupt, and returning the number of bytes successfully written.
 // The side effect is the write to the Uart trsamit buffer and enable the data interrupt.
@@ -334,9 +348,15 @@ long uart_write(struct io * io, const void * buf, long len)
     condition_wait(&uart->rxtuf_not_empty);
     }
     restore_interrupts(pie);
+    char c;
     while (counter < len && !rbuf_full(&uart->txbuf)) // this will write data when the buffer have space
     {
-    rbuf_putc(&uart->txbuf, chacter_buf[counter++]); //the data will go in the tramsit buffer
+    if (memcpy_nofault(&c, chacter_buf + counter, 1) < 0) //buf may be an unmapped user page
+    {
+        return (counter > 0) ? counter : -EFAULT;
+    }
+    counter++;
+    rbuf_putc(&uart->txbuf, c); //the data will go in the tramsit buffer
     uart->regs->ier = uart->regs->ier | IER_THREIE; //this will enable the trasmit resiger empty for interrupt
 
 
@@ -25,6 +25,8 @@
 #include "ioimpl.h"
 #include "io.h"
 #include "conf.h"
+#include "memory.h"
+#include "riscv.h"
 
 #include <limits.h>
 
@@ -39,6 +41,38 @@
 #define VIOBLK_NAME "vioblk"
 #endif
 
+// Read-only device with a text report of each vioblk's statistics (IOCTL_GETSTATS)
+
+#ifndef VIOBLK_STAT_NAME
+#define VIOBLK_STAT_NAME "blkstat"
+#endif
+
+// Upper bound on the virtqueue length. The actual length is the smaller of this and
+// the device's queue_num_max (see virtq_init).
+
+#ifndef VIOBLK_QLEN_MAX
+#define VIOBLK_QLEN_MAX 128
+#endif
+
+// Most data segments carried by one device request. The virtqueue's indirect tables
+// have room for this many plus the header and status descriptors.
+
+#ifndef VIOBLK_SEG_MAX
+#define VIOBLK_SEG_MAX 32
+#endif
+
+// Synchronous requests of at most VIOBLK_POLL_MAX bytes spin for up to VIOBLK_POLL_US
+// microseconds, with device interrupts suppressed, before sleeping. Small reads and
+// writes usually finish within that, saving the interrupt and the context switch.
+
+#ifndef VIOBLK_POLL_MAX
+#define VIOBLK_POLL_MAX 4096
+#endif
+
+#ifndef VIOBLK_POLL_US
+#define VIOBLK_POLL_US 50
+#endif
+
 // INTERNAL CONSTANT DEFINITIONS
 //
 
@@ -70,9 +104,17 @@
 #define GETBLKSZ  0 //?????
 #define GETEND    2
 
+// Request kinds besides IOREQ_READ and IOREQ_WRITE, issued by vioblk_cntl
+
+#define VIOBLK_OP_FLUSH         2
+#define VIOBLK_OP_DISCARD       3
+#define VIOBLK_OP_WRITEZEROES   4
+
 // INTERNAL TYPE DEFINITIONS
 //
 
+struct vioblk_req; // in-flight request, below
+
 // ADDED THIS VIOBLK DEVICE STRUCT MYSELF
 struct vioblk_device {
     volatile struct virtio_mmio_regs * regs;
@@ -80,29 +122,38 @@ struct vioblk_device {
     int instno;
     struct io io;
 
-    struct {
-        uint16_t last_used_idx;
-
-        union {
-            struct virtq_avail avail;
-            char _avail_filler[VIRTQ_AVAIL_SIZE(3)];
-        };
-
-        union {
-            volatile struct virtq_used used;
-            char _used_filler[VIRTQ_USED_SIZE(3)];
-        };
-
-        // The first descriptor is a regular descriptor and is the one used in
-        // the avail and used rings.
-
-        struct virtq_desc desc[3];
-    } vq;
+    struct virtq vq;    // see virtio.c
+    int polling;        // a thread is polling; interrupts suppressed
 
     uint32_t blksz;   // Block size 
-    struct condition data_cond; // for threads
+    uint32_t max_xfer; // largest data segment per request (bytes, multiple of blksz)
+    uint32_t seg_max;  // max data segments per request (at most VIOBLK_SEG_MAX)
     uint64_t capacity;
-    struct lock virtq_lock; // lock
+    int flush_ok;           // VIRTIO_BLK_F_FLUSH: the device may cache writes
+    uint32_t max_discard;   // sectors per discard request (0 if not supported)
+    uint32_t max_wzero;     // sectors per write-zeroes request (0 if not supported)
+
+    struct blkstats stats;  // updated with interrupts disabled
+
+    // device requests, one per virtqueue id, allocated at attach
+    struct vioblk_req * reqs;
+
+    // ioreqs waiting for descriptors, started by the ISR as requests complete. The
+    // first may be partly started: the cursor says how far.
+    struct ioreq * pending;
+    struct ioreq ** pending_tail;
+    int pend_seg;       // segment of pending to continue with
+    unsigned long pend_off; // offset in that segment
+    long pend_done;     // bytes of pending started
+};
+
+// An open VIOBLK_STAT_NAME device: the report as it was at open, read in order
+
+struct vioblk_stat_file {
+    struct io io;
+    char * text;    // report, one page
+    long len;       // length of the report
+    long pos;       // next byte to read
 };
 
 struct virtio_blk_req {
@@ -111,6 +162,31 @@ struct virtio_blk_req {
     uint64_t sector;
 };
 
+// Data of a discard or write-zeroes request
+
+struct virtio_blk_range {
+    uint64_t sector;
+    uint32_t num_sectors;
+    uint32_t flags;
+};
+
+// One device request: a chain of header, one or more data segments and status byte,
+// which the virtqueue puts in an indirect table so it takes a single ring descriptor.
+// The header and status byte are read and written by the device; the rest is driver
+// bookkeeping. Requests live in dev->reqs, indexed by the id of the virtqueue entry
+// they occupy, so starting one never allocates. An ioreq with more segments than fit
+// in one chain, or with segments larger than the device's maximum, takes several.
+
+struct vioblk_req {
+    struct virtq_buf bufs[VIOBLK_SEG_MAX + 2];   // the chain
+    struct virtio_blk_req hdr;
+    struct virtio_blk_range range;  // discard and write-zeroes only
+    volatile uint8_t status;
+    struct ioreq * ioreq;           // request this is part of
+    int nsegs;                      // data segments in bufs[1..nsegs]
+    uint32_t len;                   // data bytes
+};
+
 // INTERNAL FUNCTION DECLARATIONS
 //
 
@@ -132,8 +208,27 @@ static long vioblk_writeat (
 static int vioblk_cntl (
     struct io * io, int cmd, void * arg);
 
+static long vioblk_user_rw (
+    struct io * io, int op, unsigned long long pos, void * ubuf, long len);
+
 static void vioblk_isr(int srcno, void * aux);
 
+static int vioblk_stat_open(struct io ** ioptr, void * aux);
+static void vioblk_stat_close(struct io * io);
+static long vioblk_stat_read(struct io * io, void * buf, long bufsz);
+static long vioblk_stat_report(struct vioblk_device * dev, char * buf, size_t bufsz);
+static void vioblk_account(struct vioblk_device * dev, struct ioreq * ioreq, long result);
+
+static int vioblk_submit(struct io * io, struct ioreq * ioreq);
+
+static void vioblk_build_req(struct vioblk_device * dev, struct vioblk_req * req);
+static void vioblk_kick(struct vioblk_device * dev);
+static void vioblk_req_done(struct vioblk_device * dev, struct vioblk_req * req);
+static int vioblk_harvest(struct vioblk_device * dev);
+static long vioblk_wait(struct vioblk_device * dev, struct ioreq * ioreq);
+static int vioblk_sync_op (
+    struct vioblk_device * dev, int op, unsigned long long pos, unsigned long long len);
+
 // EXPORTED FUNCTION DEFINITIONS
 //
 
@@ -155,19 +250,33 @@ void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
 
     assert(regs->device_id == VIRTIO_ID_BLOCK); // making sure id is correct
 
-    // Negotiate features. We need:
-    //  - VIRTIO_F_RING_RESET and
-    //  - VIRTIO_F_INDIRECT_DESC
-    // We want:
-    //  - VIRTIO_BLK_F_BLK_SIZE and
-    //  - VIRTIO_BLK_F_TOPOLOGY.
+    // Negotiate features. We need:
+    //  - VIRTIO_F_RING_RESET and
+    //  - VIRTIO_F_INDIRECT_DESC
+    // We want (in addition to the needed ones):
+    //  - VIRTIO_F_EVENT_IDX,
+    //  - VIRTIO_BLK_F_BLK_SIZE,
+    //  - VIRTIO_BLK_F_TOPOLOGY,
+    //  - VIRTIO_BLK_F_SIZE_MAX,
+    //  - VIRTIO_BLK_F_SEG_MAX,
+    //  - VIRTIO_BLK_F_FLUSH,
+    //  - VIRTIO_BLK_F_DISCARD and
+    //  - VIRTIO_BLK_F_WRITE_ZEROES.
 
     virtio_featset_init(needed_features);
     virtio_featset_add(needed_features, VIRTIO_F_RING_RESET);
     virtio_featset_add(needed_features, VIRTIO_F_INDIRECT_DESC);
     virtio_featset_init(wanted_features);
+    virtio_featset_add(wanted_features, VIRTIO_F_RING_RESET);
+    virtio_featset_add(wanted_features, VIRTIO_F_INDIRECT_DESC);
+    virtio_featset_add(wanted_features, VIRTIO_F_EVENT_IDX);
     virtio_featset_add(wanted_features, VIRTIO_BLK_F_BLK_SIZE);
     virtio_featset_add(wanted_features, VIRTIO_BLK_F_TOPOLOGY);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_SIZE_MAX);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_SEG_MAX);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_FLUSH);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_DISCARD);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_WRITE_ZEROES);
     result = virtio_negotiate_features(regs,
         enabled_features, wanted_features, needed_features);
 
@@ -195,25 +304,60 @@ void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
 
     dev->capacity = regs->config.blk.capacity; // in blocks
 
+    // Largest single data segment the device accepts. Without SIZE_MAX the only
+    // limit is the 32-bit descriptor length; keep transfers block-aligned.
+    if (virtio_featset_test(enabled_features, VIRTIO_BLK_F_SIZE_MAX) &&
+        regs->config.blk.size_max >= blksz)
+        dev->max_xfer = regs->config.blk.size_max & ~(blksz - 1);
+    else
+        dev->max_xfer = UINT32_MAX & ~(blksz - 1);
+
+    if (virtio_featset_test(enabled_features, VIRTIO_BLK_F_SEG_MAX) &&
+        regs->config.blk.seg_max != 0)
+        dev->seg_max = regs->config.blk.seg_max;
+    else
+        dev->seg_max = 1;
+    if (dev->seg_max > VIOBLK_SEG_MAX)
+        dev->seg_max = VIOBLK_SEG_MAX;
+
+    // Without FLUSH the device writes through and there is nothing to flush
+    dev->flush_ok = virtio_featset_test(enabled_features, VIRTIO_BLK_F_FLUSH);
+    if (virtio_featset_test(enabled_features, VIRTIO_BLK_F_DISCARD))
+        dev->max_discard = regs->config.blk.max_discard_sectors;
+    if (virtio_featset_test(enabled_features, VIRTIO_BLK_F_WRITE_ZEROES))
+        dev->max_wzero = regs->config.blk.max_write_zeroes_sectors;
+
     // define the I/O ops for this device
     static const struct iointf blk_iointf = {
         .close = &vioblk_close,    // vioblk_close
         .readat  = &vioblk_readat,     // vioblk_readat
         .writeat = &vioblk_writeat, // vioblk_writeat
         .cntl = &vioblk_cntl, // vioblk_cntl
+        .submit = &vioblk_submit, // vioblk_submit
     };
     dev->io.intf = &blk_iointf;
     
-    // set up virtqueue 
-    memset(&dev->vq, 0, sizeof(dev->vq));  // zeroing out the virtqueue struct
+    // set up virtqueue 0 in whichever layout was negotiated
+    result = virtq_init(&dev->vq, regs, 0, VIOBLK_QLEN_MAX, dev->seg_max + 2,
+        enabled_features);
+    if (result != 0) {
+        kprintf("%p: virtqueue setup failed\n", regs);
+        kfree(dev);
+        return;
+    }
+
+    // one request per virtqueue id, in whole pages (too big for the heap)
+    unsigned long req_pages = (dev->vq.len * sizeof(struct vioblk_req) + PAGE_SIZE - 1) / PAGE_SIZE;
+    dev->reqs = alloc_phys_pages(req_pages);
+    if (dev->reqs == NULL) {
+        kprintf("%p: vioblk request pool allocation failed\n", regs);
+        kfree(dev);
+        return;
+    }
+    memset(dev->reqs, 0, req_pages * PAGE_SIZE);
 
-    virtio_attach_virtq(regs, 
-        0, // 0 is the qid for virtioblk
-        3, // 3 descriptors
-        (uint64_t)(uintptr_t)(&dev->vq.desc[0]), // address of first descriptor
-        (uint64_t)(uintptr_t)(&dev->vq.used), // address of used ring
-        (uint64_t)(uintptr_t)(&dev->vq.avail) // address of available ring
-    );
+    dev->pending = NULL;
+    dev->pending_tail = &dev->pending;
 
     virtio_enable_virtq(regs, 0); // enabling virtqueue for this device
     __sync_synchronize();
@@ -225,8 +369,10 @@ void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
     //register the device
     dev->instno = register_device(VIOBLK_NAME, vioblk_open, dev);
 
-    condition_init(&dev->data_cond, "vioblk_data_cond"); //initializing data condition
-    lock_init(&dev->virtq_lock); //initializing lock
+    // and its statistics
+    dev->stats.since = rdtime();
+    register_device(VIOBLK_STAT_NAME, vioblk_stat_open, dev);
+
 
     // Mark the driver as ready 
     regs->status |= VIRTIO_STAT_DRIVER_OK;
@@ -236,8 +382,8 @@ void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
 // static int vioblk_open(struct io ** ioptr, void * aux)
 // Inputs: Double pointer to io interface, auxiliary data (vioblk_device *)
 // Outputs: int - 0 on success, error code on failure
-// Description: Initializes virtqueue state and assigns the io pointer for the opened block device.
-// Side Effects: Modifies virtqueue state, increments io refcount
+// Description: Assigns the io pointer for the opened block device.
+// Side Effects: Increments io refcount
 static int vioblk_open(struct io ** ioptr, void * aux) {
 
     if (!ioptr || !aux)
@@ -246,12 +392,6 @@ static int vioblk_open(struct io ** ioptr, void * aux) {
     // retreiving device from aux argument
     struct vioblk_device * dev = (struct vioblk_device *)aux;
 
-    // // reinitialize virtqueue indicies so they are 'available' for use
-    // dev->vq.avail.idx       = 0;
-    // dev->vq.used.idx        = 0;
-    // dev->vq.last_used_idx   = 0;
-    memset(&dev->vq.desc[0], 0, sizeof(dev->vq.desc));
-
     // bump refcount and return the io pointer
     ioaddref(&dev->io);  
     *ioptr = &dev->io;
@@ -282,95 +422,313 @@ static void vioblk_close(struct io * io) {
     debug("Device successfully closed in vioblk_close \n");
 }
 
-// static long vioblk_readat(struct io * io, unsigned long long pos, void * buf, long bufsz)
-// Inputs: Pointer to io interface, position to read from, buffer to read into, number of bytes
-// Outputs: long - number of bytes read or error code
-// Description: Reads data from the block device at a specific position into the buffer.
-// Side Effects: Blocks current thread until the read is complete, modifies virtqueue
-static long vioblk_readat(struct io * io, unsigned long long pos, void * buf, long bufsz) {
-    // sanity checks
-    assert(io != NULL && buf != NULL && bufsz > 0);
+// static void vioblk_build_req(struct vioblk_device * dev, struct vioblk_req * req)
+// Inputs: Device (interrupts disabled, pending list not empty), free device request
+// Outputs: None
+// Description: Fills the request with the next part of the first pending ioreq:
+// header, up to seg_max data segments of at most max_xfer bytes each (a range for
+// discard and write-zeroes, nothing for flush), status byte. Removes the ioreq from
+// the pending list once all of it has been started.
+// Side Effects: Advances the pending cursor
+static void vioblk_build_req(struct vioblk_device * dev, struct vioblk_req * req) {
+    struct ioreq * ioreq = dev->pending;
+    uint8_t * segbuf;
+    unsigned long seglen;
+    uint32_t chunk;
+    int last;
+
+    req->ioreq = ioreq;
+    req->nsegs = 0;
+    req->len = 0;
+    req->status = 0xff;
+    req->hdr.reserved = 0;
+    req->hdr.sector = (ioreq->pos + dev->pend_done) / 512; // virtio sectors are always 512 bytes
+
+    switch (ioreq->op) {
+    case IOREQ_WRITE:
+        req->hdr.type = VIRTIO_BLK_T_OUT;
+        break;
+    case VIOBLK_OP_FLUSH:
+        req->hdr.type = VIRTIO_BLK_T_FLUSH;
+        req->hdr.sector = 0;
+        break;
+    case VIOBLK_OP_DISCARD:
+        req->hdr.type = VIRTIO_BLK_T_DISCARD;
+        break;
+    case VIOBLK_OP_WRITEZEROES:
+        req->hdr.type = VIRTIO_BLK_T_WRITE_ZEROES;
+        break;
+    default:
+        req->hdr.type = VIRTIO_BLK_T_IN;
+        break;
+    }
 
-    // recover the device pointer from the io struct
-    struct vioblk_device * dev = (struct vioblk_device *)((char*)io - offsetof(struct vioblk_device, io));
+    // First: request header
+    req->bufs[0].addr = (uint64_t)(uintptr_t)&req->hdr;
+    req->bufs[0].len = sizeof(req->hdr);
+    req->bufs[0].flags = 0;
+
+    // Discard and write-zeroes carry one range of at most the device's limit
+    if (ioreq->op == VIOBLK_OP_DISCARD || ioreq->op == VIOBLK_OP_WRITEZEROES) {
+        uint64_t nsect = (ioreq->len - dev->pend_done) / 512;
+        uint32_t max = (ioreq->op == VIOBLK_OP_DISCARD) ? dev->max_discard : dev->max_wzero;
+        if (nsect > max)
+            nsect = max;
+
+        req->range.sector = req->hdr.sector;
+        req->range.num_sectors = nsect;
+        req->range.flags = 0;
+        req->nsegs = 1;
+        req->bufs[1].addr = (uint64_t)(uintptr_t)&req->range;
+        req->bufs[1].len = sizeof(req->range);
+        req->bufs[1].flags = 0;
+        req->len = nsect * 512;
+        dev->pend_done += nsect * 512;
+    }
 
-    // enforce block alignment 
-    if (pos % dev->blksz != 0 || bufsz % dev->blksz != 0) return -EINVAL;
-    if ((pos + bufsz) > (dev->capacity * dev->blksz)) return -EIO;
+    // Then the data (device-writable for reads)
+    while ((ioreq->op == IOREQ_READ || ioreq->op == IOREQ_WRITE) &&
+        req->nsegs < dev->seg_max && dev->pend_done < ioreq->len)
+    {
+        if (ioreq->nsegs == 0) {
+            segbuf = ioreq->buf;
+            seglen = ioreq->len;
+        } else {
+            segbuf = ioreq->segs[dev->pend_seg].buf;
+            seglen = ioreq->segs[dev->pend_seg].len;
+        }
 
-    // getting lock to synchronize access to the virtqueue
-    lock_acquire(&dev->virtq_lock);
+        if (dev->pend_off == seglen) {
+            dev->pend_seg++;
+            dev->pend_off = 0;
+            continue;
+        }
 
-    long bytes_read = 0;
-    uint8_t *buf_ptr = (uint8_t *)buf;
-    unsigned long long cur_pos = pos;
+        chunk = (seglen - dev->pend_off > dev->max_xfer) ?
+            dev->max_xfer : (uint32_t)(seglen - dev->pend_off);
 
-    // read in block-sized chunks
-    while (bytes_read < bufsz) {
-        struct virtio_blk_req *req = kcalloc(1, sizeof(struct virtio_blk_req));
-        if (!req) {
-            lock_release(&dev->virtq_lock);
-            return -ENOMEM;
-        }
+        req->nsegs++;
+        req->bufs[req->nsegs].addr = (uint64_t)(uintptr_t)(segbuf + dev->pend_off);
+        req->bufs[req->nsegs].len = chunk;
+        req->bufs[req->nsegs].flags =
+            (ioreq->op == IOREQ_READ) ? VIRTQ_DESC_F_WRITE : 0;
+        req->len += chunk;
+
+        dev->pend_off += chunk;
+        dev->pend_done += chunk;
+    }
 
-        // Set up the request
-        req->type = VIRTIO_BLK_T_IN;
-        req->reserved = 0;
-        req->sector = cur_pos / dev->blksz;
-
-        uint8_t status = 0;
-
-        // Descriptor 0: request header
-        dev->vq.desc[0].addr = (uint64_t)(uintptr_t)req;
-        dev->vq.desc[0].flags = VIRTQ_DESC_F_NEXT;
-        dev->vq.desc[0].len = sizeof(*req);
-        dev->vq.desc[0].next = 1;
-
-        // Descriptor 1: data buffer to fill (marked writable)
-        dev->vq.desc[1].addr = (uint64_t)(uintptr_t)(buf_ptr + bytes_read);
-        dev->vq.desc[1].flags = VIRTQ_DESC_F_WRITE | VIRTQ_DESC_F_NEXT;
-        dev->vq.desc[1].len = dev->blksz;
-        dev->vq.desc[1].next = 2;
-
-        // Descriptor 2: status byte (writable by device)
-        dev->vq.desc[2].addr = (uint64_t)(uintptr_t)&status;
-        dev->vq.desc[2].flags = VIRTQ_DESC_F_WRITE;
-        dev->vq.desc[2].len = 1;
-        dev->vq.desc[2].next = -1;
-
-        // adding descriptor chain to available ring
-        dev->vq.avail.ring[dev->vq.avail.idx % 3] = 0;
-        __sync_synchronize();
-        dev->vq.avail.idx++;
-        __sync_synchronize();
-
-        // Notify the device
-        virtio_notify_avail(dev->regs, 0);
-
-        // wait for device to update
-        int pie = disable_interrupts();
-        while (dev->vq.used.idx != dev->vq.avail.idx) {
-            condition_wait(&dev->data_cond);
+    // Last: status byte (writable by device)
+    last = req->nsegs + 1;
+    req->bufs[last].addr = (uint64_t)(uintptr_t)&req->status;
+    req->bufs[last].len = 1;
+    req->bufs[last].flags = VIRTQ_DESC_F_WRITE;
+
+    ioreq->parts++;
+
+    if (dev->pend_done == ioreq->len) {
+        dev->pending = ioreq->next;
+        if (dev->pending == NULL)
+            dev->pending_tail = &dev->pending;
+        dev->pend_seg = 0;
+        dev->pend_off = 0;
+        dev->pend_done = 0;
+        ioreq->parts--; // drop the reference held while parts were being started
+    }
+}
+
+// static void vioblk_kick(struct vioblk_device * dev)
+// Inputs: Device (interrupts disabled)
+// Outputs: None
+// Description: Starts parts of pending ioreqs while the virtqueue has room, each in
+// the device request for the id it will occupy, then notifies the device once if it
+// wants to be told.
+// Side Effects: Modifies virtqueue and pending list, notifies device
+static void vioblk_kick(struct vioblk_device * dev) {
+    struct vioblk_req * req;
+    int id;
+
+    while (dev->pending != NULL && virtq_can_add(&dev->vq, dev->seg_max + 2)) {
+        id = virtq_next_id(&dev->vq);
+        req = &dev->reqs[id];
+        vioblk_build_req(dev, req);
+        id = virtq_add(&dev->vq, req->bufs, req->nsegs + 2, req);
+        assert (req == &dev->reqs[id]);
+    }
+
+    virtq_kick(&dev->vq);
+}
+
+// static int vioblk_harvest(struct vioblk_device * dev)
+// Inputs: Device (interrupts disabled)
+// Outputs: int - number of requests harvested
+// Description: Completes every request the device has returned. Then, unless a thread
+// is polling, asks for an interrupt at the next completion and looks again, since the
+// device may have returned one before seeing that.
+// Side Effects: Frees descriptors, completes requests
+static int vioblk_harvest(struct vioblk_device * dev) {
+    struct vioblk_req * req;
+    int cnt = 0;
+
+    do {
+        while ((req = virtq_get_used(&dev->vq, NULL)) != NULL) {
+            vioblk_req_done(dev, req);
+            cnt++;
         }
+    } while (!dev->polling && virtq_enable_intr(&dev->vq));
+
+    return cnt;
+}
+
+// static long vioblk_wait(struct vioblk_device * dev, struct ioreq * ioreq)
+// Inputs: Device, submitted request
+// Outputs: long - result of the request
+// Description: Waits for a request submitted by readat or writeat. Small requests are
+// first polled for VIOBLK_POLL_US with interrupts from the device suppressed; anything
+// still outstanding after that is waited for with iowait.
+// Side Effects: May complete other requests while polling
+static long vioblk_wait(struct vioblk_device * dev, struct ioreq * ioreq) {
+    unsigned long long until;
+    int pie;
+
+    if (ioreq->len <= VIOBLK_POLL_MAX && !ioreq->done) {
+        until = rdtime() + VIOBLK_POLL_US * (TIMER_FREQ / 1000 / 1000);
+
+        pie = disable_interrupts();
+        dev->polling = 1;
+        virtq_disable_intr(&dev->vq);
         restore_interrupts(pie);
 
-        // check status
-        if (status != 0) {
-            kfree(req); //freeing request from memory
-            lock_release(&dev->virtq_lock); //releasing lock
-            return -EIO;
+        while (!ioreq->done && rdtime() < until) {
+            pie = disable_interrupts();
+            if (vioblk_harvest(dev) > 0)
+                vioblk_kick(dev);
+            restore_interrupts(pie);
         }
 
-        kfree(req);
-        memset(&dev->vq.desc[0], 0, sizeof(dev->vq.desc[0]) * 3); //resetting descriptors after completion
+        // re-enable interrupts, then pick up anything that finished while they were off
+        pie = disable_interrupts();
+        dev->polling = 0;
+        if (vioblk_harvest(dev) > 0)
+            vioblk_kick(dev);
+        restore_interrupts(pie);
+    }
 
-        // Update counters for next block
-        bytes_read += dev->blksz; //next position caculation for large reads
-        cur_pos += dev->blksz;
+    return iowait(ioreq);
+}
+
+// static void vioblk_req_done(struct vioblk_device * dev, struct vioblk_req * req)
+// Inputs: Device, finished device request
+// Outputs: None
+// Description: Folds the result of one device request into the ioreq it belongs to and
+// completes the ioreq when its last part finishes.
+// Side Effects: May complete an ioreq (runs its callback)
+static void vioblk_req_done(struct vioblk_device * dev, struct vioblk_req * req) {
+    struct ioreq * ioreq = req->ioreq;
+
+    if (req->status != 0)
+        ioreq->result = -EIO;
+    req->ioreq = NULL;
+
+    if (--ioreq->parts == 0) {
+        vioblk_account(dev, ioreq, ioreq->result);
+        ioreq_complete(ioreq, (ioreq->result < 0) ? ioreq->result : ioreq->len);
+    }
+}
+
+// static void vioblk_account(struct vioblk_device * dev, struct ioreq * ioreq, long result)
+// Inputs: Device (interrupts disabled), ioreq about to complete, its result
+// Outputs: None
+// Description: Adds a finished ioreq to the device statistics: latency since it was
+// submitted, bytes and merges for reads and writes, and the queue depth.
+// Side Effects: Modifies dev->stats
+static void vioblk_account(struct vioblk_device * dev, struct ioreq * ioreq, long result) {
+    struct blkstats * st = &dev->stats;
+    unsigned long long ticks = rdtime() - ioreq->stamp;
+    unsigned long long us = ticks / (TIMER_FREQ / 1000 / 1000);
+    int b = 0;
+
+    st->depth--;
+
+    if (ioreq->op != IOREQ_READ && ioreq->op != IOREQ_WRITE) {
+        st->other++;
+        return;
+    }
+
+    while (us != 0 && b < BLKSTATS_HIST - 1) {
+        us >>= 1;
+        b++;
+    }
+
+    st->ops[ioreq->op]++;
+    if (result >= 0)
+        st->bytes[ioreq->op] += ioreq->len;
+    st->merged[ioreq->op] += ioreq->merged;
+    st->ticks[ioreq->op] += ticks;
+    st->hist[ioreq->op][b]++;
+}
+
+// static int vioblk_submit(struct io * io, struct ioreq * ioreq)
+// Inputs: Pointer to io interface, request to start
+// Outputs: int - 0 if the request was accepted, error code otherwise
+// Description: Native asynchronous I/O. Queues the request; vioblk_kick maps its
+// buffers (one, or its segment list) onto as few device requests as the device allows,
+// so scattered buffers need no bounce copy. Never blocks and never allocates: parts
+// that do not fit in the virtqueue are started by the ISR as requests complete. The
+// ioreq completes when every part has.
+// Side Effects: Modifies virtqueue, notifies device
+static int vioblk_submit(struct io * io, struct ioreq * ioreq) {
+    struct vioblk_device * dev = (struct vioblk_device *)((char*)io - offsetof(struct vioblk_device, io));
+    int pie;
+    int i;
+
+    // enforce block alignment and bounds; every segment must be whole blocks so that
+    // parts split between segments start on a sector
+    if (ioreq->pos % dev->blksz != 0 || ioreq->len % dev->blksz != 0) return -EINVAL;
+    for (i = 0; i < ioreq->nsegs; i++)
+        if (ioreq->segs[i].len % dev->blksz != 0) return -EINVAL;
+    if ((ioreq->pos + ioreq->len) > (dev->capacity * dev->blksz)) return -EIO;
+
+    if (ioreq->len == 0 && ioreq->op != VIOBLK_OP_FLUSH) {
+        ioreq_complete(ioreq, 0);
+        return 0;
     }
 
-    lock_release(&dev->virtq_lock);
-    return bytes_read;
+    ioreq->parts = 1; // held until every part has been started
+    ioreq->result = 0;
+    ioreq->next = NULL;
+
+    pie = disable_interrupts();
+    ioreq->stamp = rdtime();
+    if (++dev->stats.depth > dev->stats.max_depth)
+        dev->stats.max_depth = dev->stats.depth;
+    *dev->pending_tail = ioreq;
+    dev->pending_tail = &ioreq->next;
+    vioblk_kick(dev);
+    restore_interrupts(pie);
+    return 0;
+}
+
+// static long vioblk_readat(struct io * io, unsigned long long pos, void * buf, long bufsz)
+// Inputs: Pointer to io interface, position to read from, buffer to read into, number of bytes
+// Outputs: long - number of bytes read or error code
+// Description: Reads data from the block device at a specific position into the buffer.
+// Side Effects: Blocks current thread until the read is complete, modifies virtqueue
+static long vioblk_readat(struct io * io, unsigned long long pos, void * buf, long bufsz) {
+    struct ioreq req;
+    int result;
+
+    // sanity checks
+    assert(io != NULL && buf != NULL && bufsz > 0);
+
+    if (user_range(buf, bufsz))
+        return vioblk_user_rw(io, IOREQ_READ, pos, buf, bufsz);
+
+    ioreq_init(&req, IOREQ_READ, pos, buf, bufsz);
+    result = vioblk_submit(io, &req);
+    if (result < 0)
+        return result;
+    return vioblk_wait((struct vioblk_device *)((char*)io - offsetof(struct vioblk_device, io)), &req);
 }
 
 // static long vioblk_writeat(struct io * io, unsigned long long pos, const void * buf, long len)
@@ -379,92 +737,89 @@ static long vioblk_readat(struct io * io, unsigned long long pos, void * buf, lo
 // Description: Writes data to the block device from the buffer at a specific position.
 // Side Effects: Blocks current thread until the write is complete, modifies virtqueue
 static long vioblk_writeat (struct io * io, unsigned long long pos, const void * buf, long len) {
+    struct ioreq req;
+    int result;
+
     //sainty checks
     assert(io != NULL && buf != NULL && len > 0);
 
-    //retrieving device from io pointer
-    struct vioblk_device * dev = (struct vioblk_device *)((char*)io - offsetof(struct vioblk_device, io));
-
-    // enforce alignment and bounds
-    if (pos % dev->blksz != 0 || len % dev->blksz != 0) return -EINVAL;
-    if ((pos + len) > (dev->capacity * dev->blksz)) return -EIO;
-
-    //acquire lock
-    lock_acquire(&dev->virtq_lock);
+    if (user_range(buf, len))
+        return vioblk_user_rw(io, IOREQ_WRITE, pos, (void *)buf, len);
 
-    long bytes_written = 0;
-    uint8_t *buf_ptr = (uint8_t *)buf;
-    unsigned long long cur_pos = pos;
-
-    // write in block-sized chunks
-    while (bytes_written < len) {
-        struct virtio_blk_req *req = kcalloc(1, sizeof(struct virtio_blk_req));
-        if (!req) { //no request
-            lock_release(&dev->virtq_lock); //release lock
-            return -ENOMEM;
-        }
+    ioreq_init(&req, IOREQ_WRITE, pos, (void *)buf, len);
+    result = vioblk_submit(io, &req);
+    if (result < 0)
+        return result;
+    return vioblk_wait((struct vioblk_device *)((char*)io - offsetof(struct vioblk_device, io)), &req);
+}
 
-        req->type = VIRTIO_BLK_T_OUT; //we want to write out of the buffer
-        req->reserved = 0;
-        req->sector = cur_pos / dev->blksz;
-
-        uint8_t status = 0;
-
-        // Descriptor 0: request header
-        dev->vq.desc[0].addr = (uint64_t)(uintptr_t)req;
-        dev->vq.desc[0].flags = VIRTQ_DESC_F_NEXT;
-        dev->vq.desc[0].len = sizeof(*req);
-        dev->vq.desc[0].next = 1;
-
-        // Descriptor 1: data buffer to write from
-        dev->vq.desc[1].addr = (uint64_t)(uintptr_t)(buf_ptr + bytes_written);
-        dev->vq.desc[1].flags = VIRTQ_DESC_F_NEXT;
-        dev->vq.desc[1].len = dev->blksz;
-        dev->vq.desc[1].next = 2;
-
-        // Descriptor 2: status byte
-        dev->vq.desc[2].addr = (uint64_t)(uintptr_t)&status;
-        dev->vq.desc[2].flags = VIRTQ_DESC_F_WRITE;
-        dev->vq.desc[2].len = 1;
-        dev->vq.desc[2].next = -1;
-
-        // adding descriptor chain to available ring
-        dev->vq.avail.ring[dev->vq.avail.idx % 3] = 0;
-        __sync_synchronize();
-        dev->vq.avail.idx++;
-        __sync_synchronize();
-
-        // notify the device
-        virtio_notify_avail(dev->regs, 0);
-
-        // wait for write to complete
-        int pie = disable_interrupts();
-        while (dev->vq.used.idx != dev->vq.avail.idx) {
-            condition_wait(&dev->data_cond);
+// static long vioblk_user_rw(struct io * io, int op, unsigned long long pos, void * ubuf, long len)
+// Inputs: Pointer to io interface, IOREQ_READ or IOREQ_WRITE, position, user buffer,
+//         number of bytes
+// Outputs: long - number of bytes transferred, or error code if none were
+// Description: Reads or writes through a kernel page for a user buffer (the raw device
+// opened by a process). The device is given physical addresses, which a user virtual
+// address is not, so the data is copied a page at a time.
+// Side Effects: Blocks current thread until each request is complete
+static long vioblk_user_rw (
+    struct io * io, int op, unsigned long long pos, void * ubuf, long len)
+{
+    struct vioblk_device * dev = (struct vioblk_device *)((char*)io - offsetof(struct vioblk_device, io));
+    char * kbuf = alloc_phys_page();
+    struct ioreq req;
+    long done = 0;
+    long rc = 0;
+    long n;
+
+    while (done < len) {
+        n = (len - done < PAGE_SIZE) ? len - done : PAGE_SIZE;
+        if (op == IOREQ_WRITE && memcpy_nofault(kbuf, (char *)ubuf + done, n) < 0) {
+            rc = -EFAULT;
+            break;
         }
-        restore_interrupts(pie);
-
-        if (status != 0) {
-            kfree(req);//freeing request from memory
-            lock_release(&dev->virtq_lock);
-            return -EIO;
+        ioreq_init(&req, op, pos + done, kbuf, n);
+        rc = vioblk_submit(io, &req);
+        if (rc == 0)
+            rc = vioblk_wait(dev, &req);
+        if (rc <= 0)
+            break;
+        if (op == IOREQ_READ && memcpy_nofault((char *)ubuf + done, kbuf, rc) < 0) {
+            rc = -EFAULT;
+            break;
         }
-
-        kfree(req); //freeing request from memory
-        memset(&dev->vq.desc[0], 0, sizeof(dev->vq.desc[0]) * 3); //resetting descriptors after completion
-
-        bytes_written += dev->blksz; //next position caculation for large reads
-        cur_pos += dev->blksz;
+        done += rc;
+        if (rc < n)
+            break;
     }
 
-    lock_release(&dev->virtq_lock); //releasing lock
-    return bytes_written; 
+    free_phys_page(kbuf);
+    return (done > 0) ? done : rc;
+}
+
+// static int vioblk_sync_op(struct vioblk_device * dev, int op, unsigned long long pos, unsigned long long len)
+// Inputs: Device, VIOBLK_OP_*, byte range (ignored for flush)
+// Outputs: int - 0 on success, error code on failure
+// Description: Issues a flush, discard or write-zeroes request and waits for it
+// Side Effects: Blocks current thread until the request is complete
+static int vioblk_sync_op (
+    struct vioblk_device * dev, int op, unsigned long long pos, unsigned long long len)
+{
+    struct ioreq req;
+    long result;
+
+    ioreq_init(&req, op, pos, NULL, len);
+    result = vioblk_submit(&dev->io, &req);
+    if (result < 0)
+        return result;
+    result = iowait(&req);
+    return (result < 0) ? result : 0;
 }
 
 // static int vioblk_cntl(struct io * io, int cmd, void * arg)
 // Inputs: Pointer to io interface, command integer, pointer to output argument
 // Outputs: int - 0 on success, error code on failure
-// Description: Handles block device control commands, including GETBLKSZ and GETEND.
+// Description: Handles block device control commands: GETBLKSZ, GETEND, FLUSH,
+// DISCARD, WRITEZEROES and GETSTATS.
 // Side Effects: Writes to memory pointed to by arg
 static int vioblk_cntl (struct io * io, int cmd, void * arg) {
     
@@ -488,6 +843,36 @@ static int vioblk_cntl (struct io * io, int cmd, void * arg) {
             return 0;
         }
 
+        // write back the device's cache, if it has one
+        case IOCTL_FLUSH:
+            if (!dev->flush_ok)
+                return 0;
+            return vioblk_sync_op(dev, VIOBLK_OP_FLUSH, 0, 0);
+
+        // arg is {pos, len}, both block-aligned
+        case IOCTL_DISCARD:
+        case IOCTL_WRITEZEROES: {
+            const unsigned long long * ext = arg;
+            if (!arg)
+                return -EINVAL;
+            if ((cmd == IOCTL_DISCARD ? dev->max_discard : dev->max_wzero) == 0)
+                return -ENOTSUP;
+            return vioblk_sync_op(dev,
+                (cmd == IOCTL_DISCARD) ? VIOBLK_OP_DISCARD : VIOBLK_OP_WRITEZEROES,
+                ext[0], ext[1]);
+        }
+
+        // snapshot of the statistics, consistent with respect to the ISR
+        case IOCTL_GETSTATS: {
+            int pie;
+            if (!arg)
+                return -EINVAL;
+            pie = disable_interrupts();
+            *(struct blkstats *)arg = dev->stats;
+            restore_interrupts(pie);
+            return 0;
+        }
+
         // command is not supported, error
         default:
             return -ENOTSUP;
@@ -497,8 +882,10 @@ static int vioblk_cntl (struct io * io, int cmd, void * arg) {
 // static void vioblk_isr(int srcno, void * aux)
 // Inputs: Interrupt source number, auxiliary data (vioblk_device *)
 // Outputs: None
-// Description: Interrupt service routine for handling completed I/O requests.
-// Side Effects: Acknowledges device interrupt, wakes waiting threads
+// Description: Interrupt service routine for handling completed I/O requests. Harvests
+// every new used ring entry, returns its descriptors to the free list, completes the
+// request it belongs to, and starts pending requests.
+// Side Effects: Acknowledges device interrupt, frees descriptors, wakes waiting threads
 static void vioblk_isr(int srcno, void * aux) {
     int pie = disable_interrupts();
     debug("ISR called\n");
@@ -515,12 +902,11 @@ static void vioblk_isr(int srcno, void * aux) {
     // acknowledge the interrupt at the device level
     dev->regs->interrupt_ack = isr_status;
 
-    // process completed requests (advance used index)
-    if (dev->vq.last_used_idx != dev->vq.used.idx) {
-        debug("condition broadcasted\n");
-        dev->vq.last_used_idx = dev->vq.used.idx;
-        condition_broadcast(&dev->data_cond);
-    }
+    // harvest completed requests
+    vioblk_harvest(dev);
+
+    // start requests that were waiting for descriptors
+    vioblk_kick(dev);
 
     // // read interrupt status
     // uint32_t isr_status = dev->regs->interrupt_status;
@@ -530,4 +916,122 @@ static void vioblk_isr(int srcno, void * aux) {
     // wake up the thread waiting on the request
     restore_interrupts(pie);
     debug("ISR end\n");
-}
\ No newline at end of file
+}
+
+// static int vioblk_stat_open(struct io ** ioptr, void * aux)
+// Inputs: Double pointer to io interface, auxiliary data (vioblk_device *)
+// Outputs: int - 0 on success
+// Description: Opens the statistics device of a vioblk. The report is taken now, so
+// it stays consistent however it is read; open the device again for a new one.
+// Side Effects: Allocates the open file and a page for the report
+static int vioblk_stat_open(struct io ** ioptr, void * aux) {
+    static const struct iointf stat_iointf = {
+        .close = &vioblk_stat_close,
+        .read = &vioblk_stat_read
+    };
+    struct vioblk_device * dev = aux;
+    struct vioblk_stat_file * f;
+
+    f = kmalloc(sizeof(struct vioblk_stat_file));
+    f->text = alloc_phys_page();
+    f->len = vioblk_stat_report(dev, f->text, PAGE_SIZE);
+    f->pos = 0;
+
+    *ioptr = ioinit1(&f->io, &stat_iointf);
+    return 0;
+}
+
+// static void vioblk_stat_close(struct io * io)
+// Inputs: Pointer to the statistics io
+// Outputs: None
+// Description: Frees the open file and its report.
+// Side Effects: Frees memory
+static void vioblk_stat_close(struct io * io) {
+    struct vioblk_stat_file * const f =
+        (void*)io - offsetof(struct vioblk_stat_file, io);
+
+    free_phys_page(f->text);
+    kfree(f);
+}
+
+// static long vioblk_stat_read(struct io * io, void * buf, long bufsz)
+// Inputs: Pointer to the statistics io, buffer, its size
+// Outputs: long - number of bytes read, 0 at the end of the report, -EFAULT if buf
+//          could not be stored to
+// Description: Reads the next part of the report taken at open.
+// Side Effects: Advances the read position
+static long vioblk_stat_read(struct io * io, void * buf, long bufsz) {
+    struct vioblk_stat_file * const f =
+        (void*)io - offsetof(struct vioblk_stat_file, io);
+
+    if (bufsz < 0)
+        return -EINVAL;
+
+    if (bufsz > f->len - f->pos)
+        bufsz = f->len - f->pos;
+
+    if (memcpy_nofault(buf, f->text + f->pos, bufsz) < 0)
+        return -EFAULT;
+    f->pos += bufsz;
+    return bufsz;
+}
+
+// static long vioblk_stat_report(struct vioblk_device * dev, char * buf, size_t bufsz)
+// Inputs: Pointer to the device, buffer, its size
+// Outputs: long - length of the report (truncated to fit buf with its NUL)
+// Description: Formats the statistics as text: queue depth, then per direction the
+// request and byte counts, merges, mean latency, throughput since attach and the
+// latency histogram.
+// Side Effects: None
+static long vioblk_stat_report(struct vioblk_device * dev, char * buf, size_t bufsz) {
+    static const char * const dirname[2] = { "read", "write" };
+    const unsigned long tpus = TIMER_FREQ / 1000 / 1000; // ticks per microsecond
+    struct blkstats st;
+    unsigned long long elapsed_ms;
+    char * p = buf;
+    size_t rem;
+    size_t n;
+    int pie;
+    int d, b;
+
+    rem = bufsz;
+
+    pie = disable_interrupts();
+    st = dev->stats;
+    restore_interrupts(pie);
+
+    elapsed_ms = (rdtime() - st.since) / (TIMER_FREQ / 1000);
+    if (elapsed_ms == 0)
+        elapsed_ms = 1;
+
+// append to the report, stopping at the end of buf
+#define STAT_PRINT(...) do {                        \
+        n = snprintf(p, rem, __VA_ARGS__);          \
+        if (n >= rem) n = rem - 1;                  \
+        p += n;                                     \
+        rem -= n;                                   \
+    } while (0)
+
+    STAT_PRINT("depth %u max %u other %llu\n", st.depth, st.max_depth, st.other);
+
+    for (d = 0; d < 2; d++) {
+        STAT_PRINT("%s: ops %llu bytes %llu merged %llu avg %lluus %lluKB/s\n",
+            dirname[d], st.ops[d], st.bytes[d], st.merged[d],
+            st.ops[d] ? st.ticks[d] / st.ops[d] / tpus : 0ULL,
+            st.bytes[d] / elapsed_ms * 1000 / 1024);
+
+        STAT_PRINT("%s us:", dirname[d]);
+        for (b = 0; b < BLKSTATS_HIST; b++)
+            if (st.hist[d][b] != 0) {
+                if (b < BLKSTATS_HIST - 1)
+                    STAT_PRINT(" <%lu:%llu", 1UL << b, st.hist[d][b]);
+                else
+                    STAT_PRINT(" >=%lu:%llu", 1UL << (b - 1), st.hist[d][b]);
+            }
+        STAT_PRINT("\n");
+    }
+
+#undef STAT_PRINT
+
+    return p - buf;
+}
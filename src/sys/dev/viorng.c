@@ -16,6 +16,8 @@
 #include "conf.h"
 #include "console.h"
 #include "thread.h"
+#include "riscv.h"
+#include "memory.h"
 
 #include <stdint.h>
 
@@ -31,6 +33,13 @@
 #define VIORNG_IRQ_PRIO 1
 #endif
 
+// A read spins this long for the device to fill the buffer, with its interrupt
+// suppressed, before sleeping until the interrupt.
+
+#ifndef VIORNG_POLL_US
+#define VIORNG_POLL_US 50
+#endif
+
 struct viorng_device {
     volatile struct virtio_mmio_regs * regs;
     int irqno;
@@ -38,18 +47,7 @@ struct viorng_device {
 
     struct io io;
 
-    struct {
-        uint16_t last_used_idx;
-        union {
-            struct virtq_avail avail;
-            char _avail_filler[VIRTQ_AVAIL_SIZE(1)];
-        };
-        union {
-            volatile struct virtq_used used;
-            char _used_filler[VIRTQ_USED_SIZE(1)];
-        };
-        struct virtq_desc desc[1];
-    } vq;
+    struct virtq vq;    // one entry: one request at a time
 
     unsigned int bufcnt;
     char buf[VIORNG_BUFSZ];
@@ -71,7 +69,6 @@ void viorng_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
     struct viorng_device *dev;
     virtio_featset_t enabled_features, wanted_features, needed_features;
     int result;
-    uint16_t queue_size;
 
     assert(regs->device_id == VIRTIO_ID_RNG);
 
@@ -87,17 +84,6 @@ void viorng_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
         return;
     }
 
-    regs->queue_sel = 0;
-    __sync_synchronize();
-
-    queue_size = regs->queue_num_max;
-    if (queue_size == 0) {
-        kprintf("viorng: Queue not available\n");
-        return;
-    }
-    regs->queue_num = queue_size;
-    __sync_synchronize();
-
     dev = kcalloc(1, sizeof(*dev));
     if (!dev) {
         kprintf("viorng: allocation failed\n");
@@ -109,14 +95,12 @@ void viorng_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
 
     ioinit0(&dev->io, &viorng_iointf);
 
-    dev->vq.desc[0].addr  = (uint64_t)(uintptr_t)dev->buf;
-    dev->vq.desc[0].len   = VIORNG_BUFSZ;
-    dev->vq.desc[0].flags = VIRTQ_DESC_F_WRITE;
-
-    virtio_attach_virtq(regs, 0, 1,
-        (uint64_t)(uintptr_t)dev->vq.desc,
-        (uint64_t)(uintptr_t)&dev->vq.used,
-        (uint64_t)(uintptr_t)&dev->vq.avail);
+    result = virtq_init(&dev->vq, regs, 0, 1, 0, enabled_features);
+    if (result != 0) {
+        kprintf("viorng: Queue not available\n");
+        kfree(dev);
+        return;
+    }
 
     if (register_device(VIORNG_NAME, viorng_open, dev) != 0) {
         kprintf("viorng: Failed to register device\n");
@@ -139,10 +123,6 @@ int viorng_open(struct io ** ioptr, void * aux) {
         return -ENODEV;
 
     lock_acquire(&dev->lock);
-    dev->vq.avail.idx      = 0;
-    dev->vq.used.idx       = 0;
-    dev->vq.last_used_idx  = 0;
-
     virtio_enable_virtq(dev->regs, 0);
     enable_intr_source(dev->irqno, VIORNG_IRQ_PRIO, viorng_isr, dev);
     dev->io.refcnt++;
@@ -159,10 +139,6 @@ void viorng_close(struct io * io) {
         return;
 
     lock_acquire(&dev->lock);
-    dev->vq.avail.idx      = 0;
-    dev->vq.used.idx       = 0;
-    dev->vq.last_used_idx  = 0;
-
     disable_intr_source(dev->irqno);
     if (dev->io.refcnt > 0)
         dev->io.refcnt--;
@@ -175,30 +151,54 @@ long viorng_read(struct io * io, void * buf, long bufsz) {
     char *output_buffer = buf;
     long byte_count = 0;
     long size;
+    struct virtq_buf vbuf;
+    unsigned long long until;
+    uint32_t len;
+    int pie;
 
     if (bufsz == 0)
         return 0;
 
     lock_acquire(&dev->lock);
 
-    // request randomness
-    dev->vq.desc[0].addr  = (uint64_t)(uintptr_t)dev->buf;
-    dev->vq.desc[0].len   = VIORNG_BUFSZ;
-    dev->vq.desc[0].flags = VIRTQ_DESC_F_WRITE;
-
-    dev->vq.avail.ring[dev->vq.avail.idx % 1] = 0;
-    __sync_synchronize();
-    dev->vq.avail.idx++;
-    __sync_synchronize();
-    virtio_notify_avail(dev->regs, 0);
-
+    // request randomness, polling for it first
+    vbuf.addr = (uint64_t)(uintptr_t)dev->buf;
+    vbuf.len = VIORNG_BUFSZ;
+    vbuf.flags = VIRTQ_DESC_F_WRITE;
+
+    pie = disable_interrupts();
+    dev->bufcnt = 0; // the queue holds one request; its buffer is refilled
+    virtq_disable_intr(&dev->vq);
+    virtq_add(&dev->vq, &vbuf, 1, dev);
+    virtq_kick(&dev->vq);
+    restore_interrupts(pie);
+
+    until = rdtime() + VIORNG_POLL_US * (TIMER_FREQ / 1000 / 1000);
+    do {
+        pie = disable_interrupts();
+        if (virtq_get_used(&dev->vq, &len) != NULL)
+            dev->bufcnt = len;
+        restore_interrupts(pie);
+    } while (dev->bufcnt == 0 && rdtime() < until);
+
+    // otherwise re-enable the interrupt and sleep; the ISR harvests the same way
+    pie = disable_interrupts();
+    if (dev->bufcnt == 0 && virtq_enable_intr(&dev->vq) &&
+        virtq_get_used(&dev->vq, &len) != NULL)
+        dev->bufcnt = len;
     while (dev->bufcnt == 0) {
         condition_wait(&dev->entropy_ready);
     }
+    restore_interrupts(pie);
 
     while (byte_count < bufsz && byte_count < VIORNG_BUFSZ && dev->bufcnt > 0) {
         size = (dev->bufcnt < (bufsz - byte_count)) ? dev->bufcnt : (bufsz - byte_count);
-        memcpy(output_buffer + byte_count, dev->buf + (VIORNG_BUFSZ - dev->bufcnt), size);
+        if (memcpy_nofault(output_buffer + byte_count,
+            dev->buf + (VIORNG_BUFSZ - dev->bufcnt), size) < 0)
+        {
+            lock_release(&dev->lock);
+            return (byte_count > 0) ? byte_count : -EFAULT;
+        }
         dev->bufcnt -= size;
         byte_count += size;
     }
@@ -210,15 +210,17 @@ long viorng_read(struct io * io, void * buf, long bufsz) {
 void viorng_isr(int irqno, void * aux) {
     struct viorng_device *dev = aux;
     uint32_t status = dev->regs->interrupt_status;
+    uint32_t len;
+    int pie;
+
     dev->regs->interrupt_ack = status;
 
     if (status & 0x1) {
-        lock_acquire(&dev->lock);
-        if (dev->vq.used.idx != dev->vq.last_used_idx) {
-            dev->bufcnt = dev->vq.used.ring[0].len;
+        pie = disable_interrupts();
+        if (virtq_get_used(&dev->vq, &len) != NULL) {
+            dev->bufcnt = len;
             condition_broadcast(&dev->entropy_ready);
         }
-        dev->vq.last_used_idx = dev->vq.used.idx;
-        lock_release(&dev->lock);
+        restore_interrupts(pie);
     }
 }
@@ -8,11 +8,22 @@
 #include "assert.h"
 #include "console.h"
 #include "error.h"
+#include "heap.h"
+#include "memory.h"
+#include "string.h"
 
 #include <stddef.h>
 
 #define VIRTIO_MAGIC 0x74726976
 
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static unsigned long virtq_ring_size(uint_fast16_t len);
+static int virtq_add_split (
+    struct virtq * vq, const struct virtq_buf * bufs, int n, void * token);
+static int virtq_has_used(struct virtq * vq);
+
 // EXPORTED FUNCTION DEFINITIONS
 //
 
@@ -124,6 +135,199 @@ void virtio_attach_virtq (
     __sync_synchronize(); // fence o,o
 }
 
+int virtq_init (
+    struct virtq * vq, volatile struct virtio_mmio_regs * regs, int qid,
+    uint_fast16_t maxlen, uint_fast16_t indirect_max,
+    virtio_featset_t enabled_features)
+{
+    unsigned long npages;
+    uint_fast16_t len;
+    char * page;
+    int i;
+
+    memset(vq, 0, sizeof(*vq));
+    vq->regs = regs;
+    vq->qid = qid;
+    vq->event_idx = virtio_featset_test(enabled_features, VIRTIO_F_EVENT_IDX);
+
+    regs->queue_sel = qid;
+    __sync_synchronize(); // fence o,i
+    len = regs->queue_num_max;
+    if (maxlen < len)
+        len = maxlen;
+    if (len == 0)
+        return -ENODEV;
+
+    // largest power of two that fits, with all ring parts in one page
+    while ((len & (len - 1)) != 0)
+        len &= len - 1;
+    while (virtq_ring_size(len) > PAGE_SIZE)
+        len /= 2;
+    vq->len = len;
+
+    page = alloc_phys_page();
+    if (page == NULL)
+        return -ENOMEM;
+    memset(page, 0, PAGE_SIZE);
+
+    vq->slots = kcalloc(len, sizeof(struct virtq_slot));
+    if (vq->slots == NULL) {
+        free_phys_page(page);
+        return -ENOMEM;
+    }
+
+    vq->num_free = len;
+
+    // Indirect tables for every id. Without them (or if they cannot be had), chains
+    // are built directly in the ring.
+    if (indirect_max > 1 &&
+        virtio_featset_test(enabled_features, VIRTIO_F_INDIRECT_DESC))
+    {
+        npages = (len * indirect_max * sizeof(struct virtq_desc) + PAGE_SIZE - 1) / PAGE_SIZE;
+        vq->indirect = alloc_phys_pages(npages);
+        if (vq->indirect != NULL)
+            vq->indirect_max = indirect_max;
+    }
+
+    vq->split.desc = (void *)page;
+    vq->split.avail = (void *)(page + len * sizeof(struct virtq_desc));
+    vq->split.used = (void *)(page + ((len * sizeof(struct virtq_desc) +
+        VIRTQ_AVAIL_SIZE(len) + 3) & ~3UL));
+    for (i = 0; i < len; i++)
+        vq->split.desc[i].next = (i + 1 < len) ? i + 1 : -1;
+    vq->split.free_head = 0;
+
+    virtio_attach_virtq(regs, qid, len,
+        (uint64_t)(uintptr_t)vq->split.desc,
+        (uint64_t)(uintptr_t)vq->split.used,
+        (uint64_t)(uintptr_t)vq->split.avail);
+
+    return 0;
+}
+
+int virtq_add (
+    struct virtq * vq, const struct virtq_buf * bufs, int n, void * token)
+{
+    struct virtq_desc * table;
+    struct virtq_buf ind;
+    uint16_t id;
+    int i;
+
+    if (n < 1)
+        return -EINVAL;
+    if (!virtq_can_add(vq, n))
+        return -EBUSY;
+
+    if (n == 1 || n > vq->indirect_max)
+        return virtq_add_split(vq, bufs, n, token);
+
+    // Write the chain into the table of the id it will get
+
+    id = vq->split.free_head;
+    table = vq->indirect + id * vq->indirect_max;
+
+    for (i = 0; i < n; i++) {
+        table[i].addr = bufs[i].addr;
+        table[i].len = bufs[i].len;
+        table[i].flags = bufs[i].flags & VIRTQ_DESC_F_WRITE;
+        if (i + 1 < n)
+            table[i].flags |= VIRTQ_DESC_F_NEXT;
+        table[i].next = i + 1;
+    }
+
+    // The ring descriptor itself must not have WRITE set
+    ind.addr = (uint64_t)(uintptr_t)table;
+    ind.len = n * sizeof(struct virtq_desc);
+    ind.flags = VIRTQ_DESC_F_INDIRECT;
+    return virtq_add_split(vq, &ind, 1, token);
+}
+
+int virtq_can_add(const struct virtq * vq, int n) {
+    if (n > 1 && n <= vq->indirect_max)
+        return (vq->num_free > 0);
+    else
+        return (vq->num_free >= n);
+}
+
+int virtq_next_id(const struct virtq * vq) {
+    if (vq->num_free == 0)
+        return -1;
+    return vq->split.free_head;
+}
+
+void virtq_kick(struct virtq * vq) {
+    uint16_t new_idx, old_idx;
+    int notify;
+
+    if (vq->added == 0)
+        return;
+
+    __sync_synchronize(); // publish the ring before reading the device's wishes
+
+    new_idx = vq->split.avail->idx;
+    old_idx = new_idx - vq->added;
+    if (vq->event_idx)
+        notify = virtq_need_event(VIRTQ_AVAIL_EVENT(vq->split.used, vq->len),
+            new_idx, old_idx);
+    else
+        notify = !(vq->split.used->flags & VIRTQ_USED_F_NO_NOTIFY);
+
+    vq->added = 0;
+    if (notify)
+        virtio_notify_avail(vq->regs, vq->qid);
+}
+
+void * virtq_get_used(struct virtq * vq, uint32_t * lenp) {
+    uint16_t i, id, slot;
+    void * token;
+    uint32_t len;
+    int more;
+
+    if (!virtq_has_used(vq))
+        return NULL;
+    __sync_synchronize(); // read flags or idx before the entry
+
+    slot = vq->split.last_used_idx % vq->len;
+    id = vq->split.used->ring[slot].id;
+    len = vq->split.used->ring[slot].len;
+    vq->split.last_used_idx++;
+
+    // return the chain to the free list
+    i = id;
+    do {
+        more = vq->split.desc[i].flags & VIRTQ_DESC_F_NEXT;
+        int16_t next = vq->split.desc[i].next;
+        vq->split.desc[i].flags = 0;
+        vq->split.desc[i].next = vq->split.free_head;
+        vq->split.free_head = i;
+        vq->num_free++;
+        i = next;
+    } while (more);
+
+    token = vq->slots[id].token;
+    vq->slots[id].token = NULL;
+    if (lenp != NULL)
+        *lenp = len;
+    return token;
+}
+
+void virtq_disable_intr(struct virtq * vq) {
+    if (vq->event_idx) // an index the device will not reach for a while
+        VIRTQ_USED_EVENT(vq->split.avail, vq->len) = vq->split.last_used_idx - 1;
+    else
+        vq->split.avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+    __sync_synchronize();
+}
+
+int virtq_enable_intr(struct virtq * vq) {
+    if (vq->event_idx)
+        VIRTQ_USED_EVENT(vq->split.avail, vq->len) = vq->split.last_used_idx;
+    else
+        vq->split.avail->flags = 0;
+    __sync_synchronize(); // the device may have used a chain before seeing this
+    return virtq_has_used(vq);
+}
+
 // The following provide weak no-op attach functions that are overridden if the
 // appropriate device driver is linked in.
 
@@ -149,4 +353,51 @@ void __attribute__ ((weak)) viogpu_attach (
     volatile struct virtio_mmio_regs * regs, int irqno)
 {
     // nothing
-}
\ No newline at end of file
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+// Bytes of ring memory for a queue of /len/ descriptors
+
+static unsigned long virtq_ring_size(uint_fast16_t len) {
+    return ((len * sizeof(struct virtq_desc) + VIRTQ_AVAIL_SIZE(len) + 3) & ~3UL) +
+        VIRTQ_USED_SIZE(len);
+}
+
+// Builds the chain from the free list, whose links become the chain's links, and
+// publishes its head on the avail ring.
+
+static int virtq_add_split (
+    struct virtq * vq, const struct virtq_buf * bufs, int n, void * token)
+{
+    uint16_t head = vq->split.free_head;
+    uint16_t i = head;
+    int k;
+
+    for (k = 0; k < n; k++) {
+        vq->split.desc[i].addr = bufs[k].addr;
+        vq->split.desc[i].len = bufs[k].len;
+        vq->split.desc[i].flags = bufs[k].flags;
+        if (k + 1 < n) {
+            vq->split.desc[i].flags |= VIRTQ_DESC_F_NEXT;
+            i = vq->split.desc[i].next;
+        }
+    }
+
+    vq->split.free_head = vq->split.desc[i].next;
+    vq->num_free -= n;
+    vq->slots[head].token = token;
+
+    vq->split.avail->ring[vq->split.avail->idx % vq->len] = head;
+    __sync_synchronize(); // fence w,w
+    vq->split.avail->idx++;
+    vq->added++;
+    return head;
+}
+
+// A chain has been used when the device's used index has moved past ours.
+
+static int virtq_has_used(struct virtq * vq) {
+    return (vq->split.last_used_idx != vq->split.used->idx);
+}
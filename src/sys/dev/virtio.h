@@ -135,11 +135,11 @@ struct virtq_avail {
 };
 
 // VIRTQ_AVAIL_SIZE(n)
-// Evaluates to a compile-time constant giving the size of a virtq avail ring
-// sized for /n/ elements.
+// Evaluates to a compile-time constant giving the size of a virtq avail ring
+// sized for /n/ elements, including the trailing used_event field.
 
 #define VIRTQ_AVAIL_SIZE(n) \
-    (sizeof(struct virtq_avail)+(n)*sizeof(uint16_t))
+    (sizeof(struct virtq_avail)+((n)+1)*sizeof(uint16_t))
 
 struct virtq_used_elem {
     uint32_t id; // Index of start of used descriptor chain
@@ -153,14 +153,62 @@ struct virtq_used {
 };
 
 // VIRTQ_USED_SIZE(n)
-// Evaluates to a compile-time constant giving the size of a virtq used ring
-// sized for /n/ elements.
+// Evaluates to a compile-time constant giving the size of a virtq used ring
+// sized for /n/ elements, including the trailing avail_event field.
 
 #define VIRTQ_USED_SIZE(n) \
-    (sizeof(struct virtq_used)+(n)*sizeof(struct virtq_used_elem))
+    (sizeof(struct virtq_used)+(n)*sizeof(struct virtq_used_elem)+sizeof(uint16_t))
+
+// With VIRTIO_F_EVENT_IDX, the driver writes used_event (after the avail ring) to
+// say which used index it next wants an interrupt for, and the device writes
+// avail_event (after the used ring) to say which avail index it next wants a
+// notification for. /n/ is the queue length.
+
+#define VIRTQ_USED_EVENT(avail, n) \
+    (*(volatile uint16_t *)&(avail)->ring[n])
+#define VIRTQ_AVAIL_EVENT(used, n) \
+    (*(volatile uint16_t *)&(used)->ring[n])
+
+
+// A split virtqueue, shared by all virtio drivers.
+// Buffers are added with virtq_add() and come back, in completion order, from
+// virtq_get_used() along with the token they were added with. Each added chain is
+// identified by an id in [0,len), the index of its head descriptor. When VIRTIO_F_INDIRECT_DESC is negotiated, the queue owns one
+// indirect table per id and multi-buffer chains take a single ring descriptor. All
+// functions must be called with interrupts disabled if the queue is also used from
+// an ISR.
+
+struct virtq_buf {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags; // VIRTQ_DESC_F_WRITE if the device writes the buffer
+};
 
+struct virtq {
+    volatile struct virtio_mmio_regs * regs;
+    int qid;
+    uint16_t len;           // number of descriptors
+    uint16_t num_free;      // descriptors free for virtq_add
+    uint16_t added;         // descriptors added since the last virtq_kick
+    int event_idx;          // VIRTIO_F_EVENT_IDX negotiated
+
+    struct virtq_slot {
+        void * token;       // caller's token for an in-flight id
+    } * slots;
+
+    struct virtq_desc * indirect;   // indirect_max descriptors per id, or NULL
+    uint16_t indirect_max;
+
+    struct {
+        struct virtq_desc * desc;
+        struct virtq_avail * avail;
+        volatile struct virtq_used * used;
+        int16_t free_head;      // free descriptors, chained via next (-1 if none)
+        uint16_t last_used_idx; // next used ring entry to harvest
+    } split;
+};
 
-// EXPORTED FUNCTION DEFINITIONS
+// EXPORTED FUNCTION DEFINITIONS
 //
 
 extern void virtio_attach(void * mmio_base, int irqno);
@@ -184,9 +232,52 @@ extern void virtio_attach_virtq (
 static inline void virtio_enable_virtq (
     volatile struct virtio_mmio_regs * regs, int qid);
 
+// virtq_init() sets up queue /qid/ with at most /maxlen/ descriptors (fewer if the
+// device or a page limits it; always a power of two) and attaches it. Chains of up to /indirect_max/ buffers use
+// indirect tables if the feature was negotiated. The caller then enables the queue.
+
+extern int virtq_init (
+    struct virtq * vq, volatile struct virtio_mmio_regs * regs, int qid,
+    uint_fast16_t maxlen, uint_fast16_t indirect_max,
+    virtio_featset_t enabled_features);
+
+// virtq_add() makes a chain of /n/ buffers available and returns its id, or -EBUSY
+// if there is no room for it (see virtq_can_add()). It does not notify the device.
+
+extern int virtq_add (
+    struct virtq * vq, const struct virtq_buf * bufs, int n, void * token);
+
+extern int virtq_can_add(const struct virtq * vq, int n);
+
+// virtq_next_id() returns the id the next virtq_add() will return, or -1 if no id is
+// free. Drivers use it to keep per-request state in an array indexed by id.
+
+extern int virtq_next_id(const struct virtq * vq);
+
+// virtq_kick() notifies the device of added chains, unless it has said it does not
+// need to be told.
+
+extern void virtq_kick(struct virtq * vq);
+
+// virtq_get_used() returns the token of the next used chain and frees its
+// descriptors, or NULL if there is none. If /lenp/ is not NULL, it receives the
+// number of bytes the device wrote.
+
+extern void * virtq_get_used(struct virtq * vq, uint32_t * lenp);
+
+// virtq_disable_intr() asks the device not to interrupt for used chains.
+// virtq_enable_intr() asks for an interrupt at the next used chain and returns true
+// if one is already waiting (which might not interrupt).
+
+extern void virtq_disable_intr(struct virtq * vq);
+extern int virtq_enable_intr(struct virtq * vq);
+
 static inline void virtio_reset_virtq (
     volatile struct virtio_mmio_regs * regs, int qid);
 
+static inline int virtq_need_event (
+    uint16_t event_idx, uint16_t new_idx, uint16_t old_idx);
+
 static inline void virtio_featset_init(virtio_featset_t fts);
 static inline void virtio_featset_add(virtio_featset_t fts, uint_fast16_t k);
 static inline int virtio_featset_test(virtio_featset_t fts, uint_fast16_t k);
@@ -253,6 +344,15 @@ static inline int virtio_check_feature (
     return ((regs->device_features >> (k%32)) & 1);
 }
 
+// Returns true if moving an index from /old_idx/ to /new_idx/ passed /event_idx/,
+// i.e. the other side asked to be told about one of the new entries.
+
+static inline int virtq_need_event (
+    uint16_t event_idx, uint16_t new_idx, uint16_t old_idx)
+{
+    return (uint16_t)(new_idx - event_idx - 1) < (uint16_t)(new_idx - old_idx);
+}
+
 static void virtio_notify_avail (
     volatile struct virtio_mmio_regs * regs, int qid)
 {
@@ -0,0 +1,427 @@
+// elevator.c - Block I/O scheduler
+//
+// Copyright (c) 2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+// The elevator sits between the block cache and a block device. Requests from above
+// are merged with queued requests that are adjacent on disk (gathering their buffers
+// into one scatter-gather request if they are not adjacent in memory), kept in two
+// queues (reads, which a thread is usually waiting on, and write-back), ordered by a
+// pluggable policy, and dispatched to the device asynchronously with a depth limit per
+// queue. Reads go first unless writes have been passed over too many times.
+//
+
+#ifdef ELEVATOR_TRACE
+#define TRACE
+#endif
+
+#ifdef ELEVATOR_DEBUG
+#define DEBUG
+#endif
+
+#include "elevator.h"
+#include "ioimpl.h"
+#include "heap.h"
+#include "error.h"
+#include "intr.h"
+#include "assert.h"
+#include "console.h"
+
+#include <stddef.h>
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+struct elevator {
+    struct io io;
+    struct io * bdev;                   // device being scheduled
+    const struct elevator_ops * ops;    // queue ordering policy
+    struct elv_queue sync;              // reads
+    struct elv_queue async;             // write-back
+    unsigned long long head_pos;        // end of last dispatched request
+    int starve;                         // reads dispatched while writes waited
+    int dispatching;                    // elv_dispatch is running
+    struct elv_req * free;              // unused scheduler requests
+    struct ioreq * overflow;            // waiting for a free scheduler request
+    struct ioreq ** overflow_tail;
+};
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void elevator_close(struct io * io);
+static int elevator_cntl(struct io * io, int cmd, void * arg);
+static long elevator_readat(struct io * io, unsigned long long pos, void * buf, long bufsz);
+static long elevator_writeat(struct io * io, unsigned long long pos, const void * buf, long len);
+static int elevator_submit(struct io * io, struct ioreq * req);
+
+static void elv_add(struct elevator * e, struct ioreq * req);
+static void elv_dispatch(struct elevator * e);
+static void elv_complete(struct ioreq * dreq);
+
+static void noop_add(struct elv_queue * q, struct elv_req * rq);
+static struct elv_req * noop_next(struct elv_queue * q, unsigned long long head_pos);
+static void clook_add(struct elv_queue * q, struct elv_req * rq);
+static struct elv_req * clook_next(struct elv_queue * q, unsigned long long head_pos);
+
+// EXPORTED GLOBAL VARIABLES
+//
+
+const struct elevator_ops elevator_noop = {
+    .name = "noop",
+    .add = &noop_add,
+    .next = &noop_next
+};
+
+const struct elevator_ops elevator_clook = {
+    .name = "clook",
+    .add = &clook_add,
+    .next = &clook_next
+};
+
+// INTERNAL GLOBAL CONSTANTS
+//
+
+static const struct iointf elevator_iointf = {
+    .close = &elevator_close,
+    .cntl = &elevator_cntl,
+    .readat = &elevator_readat,
+    .writeat = &elevator_writeat,
+    .submit = &elevator_submit
+};
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+// Inputs:  struct io *bdev - block device to schedule requests to
+//          const struct elevator_ops *ops - queue ordering policy
+//          struct io **eioptr - receives the elevator endpoint
+// Outputs: int - Returns 0 on success, or a negative failure
+// Description: Allocates an elevator and its pool of scheduler requests
+// Side Effects: Allocates memory, takes a reference to bdev
+int create_elevator (
+    struct io * bdev,
+    const struct elevator_ops * ops,
+    struct io ** eioptr)
+{
+    struct elevator * e;
+    int i;
+
+    if (!bdev || !ops || !eioptr)
+        return -EINVAL;
+
+    e = kcalloc(1, sizeof(struct elevator));
+    if (!e)
+        return -ENOMEM;
+
+    e->bdev = ioaddref(bdev);
+    e->ops = ops;
+    e->sync.depth = ELEVATOR_SYNC_DEPTH;
+    e->async.depth = ELEVATOR_ASYNC_DEPTH;
+    e->overflow_tail = &e->overflow;
+
+    // preallocated so completion (often in an ISR) never allocates
+    for (i = 0; i < ELEVATOR_NREQ; i++) {
+        struct elv_req * rq = kcalloc(1, sizeof(struct elv_req));
+        if (!rq)
+            break;
+        rq->elv = e;
+        rq->next = e->free;
+        e->free = rq;
+    }
+
+    if (e->free == NULL) {
+        ioclose(e->bdev);
+        kfree(e);
+        return -ENOMEM;
+    }
+
+    debug("elevator: %s policy on %p", ops->name, bdev);
+    *eioptr = ioinit1(&e->io, &elevator_iointf);
+    return 0;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+// Inputs:  struct io *io - elevator endpoint
+// Outputs: None
+// Description: Drops the elevator's reference to the device
+// Side Effects: May close the device
+static void elevator_close(struct io * io) {
+    struct elevator * e = (void *)io - offsetof(struct elevator, io);
+    ioclose(e->bdev);
+}
+
+// Inputs:  struct io *io - elevator endpoint, int cmd, void *arg
+// Outputs: int - result of the device's ioctl
+// Description: Control requests go straight to the device
+// Side Effects: Depends on the command
+static int elevator_cntl(struct io * io, int cmd, void * arg) {
+    struct elevator * e = (void *)io - offsetof(struct elevator, io);
+    return ioctl(e->bdev, cmd, arg);
+}
+
+// Inputs:  struct io *io - elevator endpoint, struct ioreq *req - request to schedule
+// Outputs: int - Returns 0 (the request is accepted and will complete), or -EINVAL
+// Description: Queues a request, merging it with a queued neighbour if possible, then
+// dispatches whatever the depth limits allow.
+// Side Effects: May submit requests to the device
+static int elevator_submit(struct io * io, struct ioreq * req) {
+    struct elevator * e = (void *)io - offsetof(struct elevator, io);
+    int pie;
+
+    if (req->len == 0) {
+        ioreq_complete(req, 0);
+        return 0;
+    }
+
+    pie = disable_interrupts();
+    elv_add(e, req);
+    elv_dispatch(e);
+    restore_interrupts(pie);
+    return 0;
+}
+
+// Inputs:  struct io *io - elevator endpoint, position, buffer, length
+// Outputs: long - bytes read, or a negative failure
+// Description: Synchronous read through the scheduler
+// Side Effects: Blocks until the read completes
+static long elevator_readat(struct io * io, unsigned long long pos, void * buf, long bufsz) {
+    struct ioreq req;
+    ioreq_init(&req, IOREQ_READ, pos, buf, bufsz);
+    elevator_submit(io, &req);
+    return iowait(&req);
+}
+
+// Inputs:  struct io *io - elevator endpoint, position, buffer, length
+// Outputs: long - bytes written, or a negative failure
+// Description: Synchronous write through the scheduler
+// Side Effects: Blocks until the write completes
+static long elevator_writeat(struct io * io, unsigned long long pos, const void * buf, long len) {
+    struct ioreq req;
+    ioreq_init(&req, IOREQ_WRITE, pos, (void *)buf, len);
+    elevator_submit(io, &req);
+    return iowait(&req);
+}
+
+// Inputs:  struct elevator *e (interrupts disabled), struct ioreq *req - new request
+// Outputs: None
+// Description: Merges the request into a queued request of the same direction that it
+// directly precedes or follows on disk. If the buffers also touch in memory the segment
+// grows, otherwise the request becomes a new segment. Requests that are already
+// scattered are not merged. Otherwise wraps the request in a new scheduler request and
+// hands it to the policy. If no scheduler request is free, the request waits on the
+// overflow list.
+// Side Effects: Modifies queues
+static void elv_add(struct elevator * e, struct ioreq * req) {
+    struct elv_queue * q = (req->op == IOREQ_READ) ? &e->sync : &e->async;
+    struct elv_req * rq;
+    struct ioseg * seg;
+
+    req->next = NULL;
+
+    for (rq = q->head; rq != NULL && req->nsegs == 0; rq = rq->next) {
+        if (rq->dev.segs != rq->segs)
+            continue; // a member's own segment list
+        if (rq->dev.len + req->len > ELEVATOR_MERGE_MAX)
+            continue;
+
+        // back merge: req follows rq
+        if (rq->dev.pos + rq->dev.len == req->pos) {
+            seg = &rq->segs[rq->dev.nsegs - 1];
+            if ((char *)seg->buf + seg->len == (char *)req->buf)
+                seg->len += req->len;
+            else if (rq->dev.nsegs < ELEVATOR_SEG_MAX) {
+                seg++;
+                seg->buf = req->buf;
+                seg->len = req->len;
+                rq->dev.nsegs++;
+            } else
+                continue;
+
+            rq->dev.len += req->len;
+            rq->last->next = req;
+            rq->last = req;
+            rq->dev.merged++;
+            return;
+        }
+
+        // front merge: req precedes rq
+        if (req->pos + req->len == rq->dev.pos) {
+            seg = &rq->segs[0];
+            if ((char *)req->buf + req->len == (char *)seg->buf) {
+                seg->buf = req->buf;
+                seg->len += req->len;
+            } else if (rq->dev.nsegs < ELEVATOR_SEG_MAX) {
+                for (int i = rq->dev.nsegs; i > 0; i--)
+                    rq->segs[i] = rq->segs[i - 1];
+                seg->buf = req->buf;
+                seg->len = req->len;
+                rq->dev.nsegs++;
+            } else
+                continue;
+
+            rq->dev.pos = req->pos;
+            rq->dev.len += req->len;
+            req->next = rq->members;
+            rq->members = req;
+            rq->dev.merged++;
+            return;
+        }
+    }
+
+    rq = e->free;
+    if (rq == NULL) {
+        *e->overflow_tail = req;
+        e->overflow_tail = &req->next;
+        return;
+    }
+    e->free = rq->next;
+
+    if (req->nsegs == 0) {
+        rq->segs[0].buf = req->buf;
+        rq->segs[0].len = req->len;
+        ioreq_init_segs(&rq->dev, req->op, req->pos, rq->segs, 1);
+    } else
+        ioreq_init_segs(&rq->dev, req->op, req->pos, req->segs, req->nsegs);
+
+    rq->dev.callback = &elv_complete;
+    rq->dev.aux = rq;
+    rq->members = req;
+    rq->last = req;
+    rq->next = NULL;
+
+    e->ops->add(q, rq);
+    q->queued++;
+}
+
+// Inputs:  struct elevator *e (interrupts disabled)
+// Outputs: None
+// Description: Issues queued requests to the device until both queues are empty or at
+// their depth limit. Reads are preferred; writes go first once ELEVATOR_WRITE_STARVE
+// reads have been dispatched while writes were waiting.
+// Side Effects: Submits requests to the device
+static void elv_dispatch(struct elevator * e) {
+    struct elv_queue * q;
+    struct elv_req * rq;
+    int reads_ok, writes_ok;
+
+    if (e->dispatching)
+        return; // called from a completion inside iosubmit below
+    e->dispatching = 1;
+
+    for (;;) {
+        reads_ok = (e->sync.queued > 0 && e->sync.inflight < e->sync.depth);
+        writes_ok = (e->async.queued > 0 && e->async.inflight < e->async.depth);
+
+        if (reads_ok && !(writes_ok && e->starve >= ELEVATOR_WRITE_STARVE)) {
+            q = &e->sync;
+            if (e->async.queued > 0)
+                e->starve++;
+        } else if (writes_ok) {
+            q = &e->async;
+            e->starve = 0;
+        } else
+            break;
+
+        rq = e->ops->next(q, e->head_pos);
+        q->queued--;
+        q->inflight++;
+        e->head_pos = rq->dev.pos + rq->dev.len;
+
+        if (iosubmit(e->bdev, &rq->dev) < 0)
+            ioreq_complete(&rq->dev, -EIO); // completes members via elv_complete
+    }
+
+    e->dispatching = 0;
+}
+
+// Inputs:  struct ioreq *dreq - completed device request (interrupts disabled)
+// Outputs: None
+// Description: Completion callback of a device request. Completes every merged request
+// with its share of the result, recycles the scheduler request, admits overflow requests
+// and dispatches more work.
+// Side Effects: Completes requests, may submit requests to the device
+static void elv_complete(struct ioreq * dreq) {
+    struct elv_req * rq = dreq->aux;
+    struct elevator * e = rq->elv;
+    struct elv_queue * q = (dreq->op == IOREQ_READ) ? &e->sync : &e->async;
+    struct ioreq * m;
+    struct ioreq * next;
+
+    q->inflight--;
+
+    for (m = rq->members; m != NULL; m = next) {
+        next = m->next;
+        ioreq_complete(m, (dreq->result < 0) ? dreq->result : m->len);
+    }
+
+    rq->members = NULL;
+    rq->next = e->free;
+    e->free = rq;
+
+    while (e->overflow != NULL && e->free != NULL) {
+        m = e->overflow;
+        e->overflow = m->next;
+        if (e->overflow == NULL)
+            e->overflow_tail = &e->overflow;
+        elv_add(e, m);
+    }
+
+    elv_dispatch(e);
+}
+
+// Inputs:  struct elv_queue *q, struct elv_req *rq
+// Outputs: None
+// Description: FIFO policy: append
+// Side Effects: Modifies queue
+static void noop_add(struct elv_queue * q, struct elv_req * rq) {
+    struct elv_req ** pp = &q->head;
+    while (*pp != NULL)
+        pp = &(*pp)->next;
+    *pp = rq;
+}
+
+// Inputs:  struct elv_queue *q, unsigned long long head_pos (unused)
+// Outputs: struct elv_req * - oldest request
+// Description: FIFO policy: take from the front
+// Side Effects: Modifies queue
+static struct elv_req * noop_next(struct elv_queue * q, unsigned long long head_pos) {
+    struct elv_req * rq = q->head;
+    q->head = rq->next;
+    rq->next = NULL;
+    return rq;
+}
+
+// Inputs:  struct elv_queue *q, struct elv_req *rq
+// Outputs: None
+// Description: C-LOOK policy: keep the queue sorted by position
+// Side Effects: Modifies queue
+static void clook_add(struct elv_queue * q, struct elv_req * rq) {
+    struct elv_req ** pp = &q->head;
+    while (*pp != NULL && (*pp)->dev.pos <= rq->dev.pos)
+        pp = &(*pp)->next;
+    rq->next = *pp;
+    *pp = rq;
+}
+
+// Inputs:  struct elv_queue *q, unsigned long long head_pos - end of last dispatch
+// Outputs: struct elv_req * - next request in the sweep
+// Description: C-LOOK policy: the first request at or after the head position, or the
+// lowest one if the sweep has passed them all
+// Side Effects: Modifies queue
+static struct elv_req * clook_next(struct elv_queue * q, unsigned long long head_pos) {
+    struct elv_req ** pp = &q->head;
+    struct elv_req * rq;
+
+    while (*pp != NULL && (*pp)->dev.pos < head_pos)
+        pp = &(*pp)->next;
+    if (*pp == NULL)
+        pp = &q->head; // wrap around
+
+    rq = *pp;
+    *pp = rq->next;
+    rq->next = NULL;
+    return rq;
+}
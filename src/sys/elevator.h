@@ -0,0 +1,98 @@
+// elevator.h - Block I/O scheduler
+//
+// Copyright (c) 2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+#ifndef _ELEVATOR_H_
+#define _ELEVATOR_H_
+
+#include "io.h"
+
+// COMPILE-TIME PARAMETERS
+//
+
+// Number of requests the elevator may have outstanding at the device, per queue.
+// Reads (synchronous) get more slots than write-back (asynchronous).
+
+#ifndef ELEVATOR_SYNC_DEPTH
+#define ELEVATOR_SYNC_DEPTH 8
+#endif
+
+#ifndef ELEVATOR_ASYNC_DEPTH
+#define ELEVATOR_ASYNC_DEPTH 4
+#endif
+
+// Queued writes are dispatched ahead of waiting reads after this many reads have
+// been dispatched past them, so write-back cannot starve.
+
+#ifndef ELEVATOR_WRITE_STARVE
+#define ELEVATOR_WRITE_STARVE 4
+#endif
+
+// Largest request the elevator will build by merging (bytes)
+
+#ifndef ELEVATOR_MERGE_MAX
+#define ELEVATOR_MERGE_MAX 65536
+#endif
+
+// Most buffers a merged request may gather. Requests that are adjacent on disk but
+// not in memory are merged as separate segments of one device request.
+
+#ifndef ELEVATOR_SEG_MAX
+#define ELEVATOR_SEG_MAX 16
+#endif
+
+// Number of scheduler requests preallocated per elevator
+
+#ifndef ELEVATOR_NREQ
+#define ELEVATOR_NREQ 64
+#endif
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+// A scheduler request: one request sent to the device, standing for one or more
+// merged requests from above.
+
+struct elv_req {
+    struct ioreq dev;           // request issued to the backing device
+    struct ioseg segs[ELEVATOR_SEG_MAX]; // buffers of dev, unless a member brought its own
+    struct ioreq * members;     // merged requests, in position order
+    struct ioreq * last;        // last member
+    struct elv_req * next;      // queue link
+    struct elevator * elv;      // owning elevator
+};
+
+struct elv_queue {
+    struct elv_req * head;      // queued requests, order is up to the policy
+    int queued;                 // number of queued requests
+    int inflight;               // number issued to the device and not complete
+    int depth;                  // limit on inflight
+};
+
+// A scheduling policy decides the order of a queue. add() inserts a request and
+// next() removes the one to dispatch. /head_pos/ is the position just past the last
+// request dispatched, for policies that sweep across the disk.
+
+struct elevator_ops {
+    const char * name;
+    void (*add)(struct elv_queue * q, struct elv_req * rq);
+    struct elv_req * (*next)(struct elv_queue * q, unsigned long long head_pos);
+};
+
+extern const struct elevator_ops elevator_noop;    // FIFO
+extern const struct elevator_ops elevator_clook;   // sorted, one-way sweep
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// Creates an I/O endpoint that schedules requests to _bdev_ using policy _ops_.
+// The returned endpoint supports readat, writeat, submit and cntl (passed through).
+
+extern int create_elevator (
+    struct io * bdev,
+    const struct elevator_ops * ops,
+    struct io ** eioptr);
+
+#endif // _ELEVATOR_H_
@@ -25,7 +25,8 @@ extern const char * error_name(int code) {
         [ECHILD] = "ECHILD",
         [ENOMEM] = "ENOMEM",
         [ENODATABLKS] = "ENODATABLKS",
-        [ENOINODEBLKS] = "ENOINODEBLKS"
+        [ENOINODEBLKS] = "ENOINODEBLKS",
+        [EFAULT] = "EFAULT"
     };
 
     const char * name;
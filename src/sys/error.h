@@ -24,6 +24,7 @@
 #define EPIPE      15
 #define ENODATABLKS  16
 #define ENOINODEBLKS 17
+#define EFAULT     18
 
 
 extern const char * error_name(int code);
@@ -30,6 +30,22 @@ extern void handle_umode_exception(unsigned int cause, struct trap_frame * tfr);
 
 extern void handle_syscall(struct trap_frame * tfr); // syscall.c
 
+// Exception table (usercopy.s): instructions that may fault on user memory, and
+// where to resume if they do.
+
+struct ex_entry {
+    uintptr_t insn;
+    uintptr_t fixup;
+};
+
+extern const struct ex_entry _ex_table_start[];
+extern const struct ex_entry _ex_table_end[];
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static uintptr_t find_fixup(uintptr_t sepc);
+
 // INTERNAL GLOBAL VARIABLES
 //
 
@@ -61,6 +77,30 @@ static const char * const excp_names[] = {
 void handle_smode_exception(unsigned int cause, struct trap_frame * tfr) {
     const char * name = NULL;
     char msgbuf[80];
+    uintptr_t fixup;
+
+    // A user-copy routine touched user memory that is not mapped yet (retry once
+    // it is), or that it may not access (resume at the fixup, which fails the copy).
+
+    switch (cause) {
+    case RISCV_SCAUSE_LOAD_PAGE_FAULT:
+    case RISCV_SCAUSE_STORE_PAGE_FAULT:
+    case RISCV_SCAUSE_LOAD_ACCESS_FAULT:
+    case RISCV_SCAUSE_STORE_ACCESS_FAULT:
+        fixup = find_fixup((uintptr_t)tfr->sepc);
+        if (fixup != 0) {
+            if (cause == RISCV_SCAUSE_LOAD_ACCESS_FAULT ||
+                cause == RISCV_SCAUSE_STORE_ACCESS_FAULT ||
+                !handle_usercopy_fault(tfr, csrr_stval()))
+            {
+                tfr->sepc = (void *)fixup;
+            }
+            return;
+        }
+        break;
+    default:
+        break;
+    }
 
     kprintf("DEBUG: smode exception: cause=%u, sepc=%p, badva=%p\n",
         cause, (void*)tfr->sepc, (void*)csrr_stval());
@@ -150,4 +190,23 @@ void handle_umode_exception(unsigned int cause, struct trap_frame * tfr) {
         kprintf("UNHANDLED EXCEPTION: %s\n", msgbuf);
     }
     process_exit();  // only exit on unhandled exceptions
-}
\ No newline at end of file
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+// static uintptr_t find_fixup(uintptr_t sepc)
+// Inputs: Address of the faulting instruction
+// Outputs: uintptr_t - address to resume at, or 0 if sepc is not in the table
+// Description: Looks up an instruction in the exception table.
+// Side Effects: None
+uintptr_t find_fixup(uintptr_t sepc) {
+    const struct ex_entry * ex;
+
+    for (ex = _ex_table_start; ex < _ex_table_end; ex++) {
+        if (ex->insn == sepc)
+            return ex->fixup;
+    }
+
+    return 0;
+}
@@ -13,6 +13,48 @@
 #define HEAP_ALLOC_MAX 4000
 #endif
 
+#ifndef HEAP_ALIGN
+#define HEAP_ALIGN 16
+#endif
+
+// The HEAP_ROUND macro rounds an object size up to a multiple of HEAP_ALIGN.
+
+#define HEAP_ROUND(n) (((n) + HEAP_ALIGN - 1) / HEAP_ALIGN * HEAP_ALIGN)
+
+// With HEAP_PROFILE defined, each object is preceded by a header naming the site
+// that allocated it, and per-site counters can be read from the HEAP_PROF_NAME
+// device. HEAP_PROFILE must be defined for every file or none.
+
+#ifdef HEAP_PROFILE
+#define HEAP_PROF_HDR HEAP_ALIGN
+#else
+#define HEAP_PROF_HDR 0
+#endif
+
+#ifndef HEAP_PROF_NAME
+#define HEAP_PROF_NAME "heapprof"
+#endif
+
+struct slab;
+
+// A cache of equal-sized objects, allocated from slabs (see heap1.c). Caches are
+// defined statically with KMEM_CACHE_INIT, for example:
+//
+//     static struct kmem_cache thread_cache =
+//         KMEM_CACHE_INIT("thread", sizeof(struct thread));
+
+struct kmem_cache {
+    const char * name;
+    size_t size;                ///< Slot size, a multiple of HEAP_ALIGN
+    struct slab * partial;      ///< Slabs with free objects
+    struct slab * spare;        ///< An empty slab kept for reuse, or NULL
+    unsigned long nobjs;        ///< Objects allocated
+    unsigned long nslabs;       ///< Slabs held, including the spare
+};
+
+#define KMEM_CACHE_INIT(nm, sz) \
+    { .name = (nm), .size = HEAP_ROUND(sz) + HEAP_PROF_HDR }
+
 extern char heap_initialized;
 extern void heap_init(void * start, void * end);
 
@@ -20,4 +62,7 @@ extern void * kmalloc(size_t size);
 extern void * kcalloc(size_t nelts, size_t eltsz);
 extern void kfree(void * ptr);
 
+extern void * kmem_cache_alloc(struct kmem_cache * kc);
+extern void kmem_cache_free(struct kmem_cache * kc, void * ptr);
+
 #endif // _HEAP_H_
\ No newline at end of file
@@ -0,0 +1,748 @@
+// heap1.c - Slab heap memory manager
+//
+// Copyright (c) 2024-2025 University of Illinois
+// SPDX-License-identifier: NCSA
+//
+
+// Small objects live in slabs: single physical pages holding a slab header
+// followed by equal-sized objects. Each object cache (struct kmem_cache) keeps
+// its slabs that have free objects on a list, plus at most one empty slab for
+// reuse; further empty slabs go back to the page allocator. kmalloc serves
+// requests up to KMALLOC_MAX from a set of power-of-two size class caches, and
+// larger ones directly from the page allocator. kfree finds which kind of block
+// a pointer belongs to from the header at the start of its page.
+//
+// Until the page allocator is up (memory_initialized), pages are carved from the
+// region given to heap_init instead, and are never returned.
+//
+// With HEAP_PROFILE, allocations are charged to the call site that made them (the
+// low 32 bits of its return address), which is kept in a header before the object.
+// Reading the HEAP_PROF_NAME device gives each site's allocations, frees, live and
+// peak bytes, busiest sites first.
+
+#ifdef HEAP_TRACE
+#define TRACE
+#endif
+
+#ifdef HEAP_DEBUG
+#define DEBUG
+#endif
+
+#include "conf.h"
+#include "heap.h"
+#include "string.h"
+#include "riscv.h"
+#include "assert.h"
+#include "memory.h"
+#include "device.h"
+#include "ioimpl.h"
+#include "error.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Largest request served from a size class; anything larger gets whole pages.
+
+#ifndef KMALLOC_MAX
+#define KMALLOC_MAX 1024
+#endif
+
+// Number of call sites the profiler tells apart. Allocations from further sites are
+// charged to a single overflow entry.
+
+#ifndef HEAP_PROF_SITES
+#define HEAP_PROF_SITES 128
+#endif
+
+// Pages for the report taken when the profile device is opened: enough for a line
+// per site.
+
+#define HEAP_PROF_PAGES 4
+
+#define SLAB_MAGIC 0x51AB51AB
+#define HEAP_ALLOC_MAGIC 0xEAEAEAEA
+#define HEAP_LARGE_MAGIC 0x1A461A46
+#define HEAP_FREE_MAGIC 0x25252525
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+//   page -> +----------------+----------------+
+//           |   SLAB_MAGIC   |     inuse      |
+//           +----------------+----------------+
+//           |     cache      |  next  |  prev |
+//           +----------------+----------------+
+//           |     free       |     (pad)      |
+//   objs -> +----------------+----------------+
+//           |   object 0     |   object 1 ... |
+//           +---------------------------------+
+
+// Header at the start of each slab page. Its size is rounded up to HEAP_ALIGN.
+
+struct slab {
+    uint32_t magic;             ///< SLAB_MAGIC
+    uint32_t inuse;             ///< Objects allocated from this slab
+    struct kmem_cache * cache;  ///< Cache the slab belongs to
+    struct slab * next;         ///< Next slab on cache's partial list
+    struct slab * prev;         ///< Previous slab on cache's partial list
+    struct heap_free_record * free; ///< Free objects in this slab
+};
+
+// Header at the start of the first page of a large allocation.
+
+struct heap_large {
+    uint32_t magic;     ///< HEAP_LARGE_MAGIC
+    uint32_t npages;    ///< Pages in the allocation, header included
+    uint32_t site;      ///< Profiler site index (HEAP_PROFILE)
+    uint32_t size;      ///< Requested size (HEAP_PROFILE)
+};
+
+// Precedes each slab object with HEAP_PROFILE. Must fit in HEAP_PROF_HDR bytes.
+
+struct heap_prof_header {
+    uint32_t magic;     ///< HEAP_ALLOC_MAGIC
+    uint32_t site;      ///< Profiler site index
+    uint32_t size;      ///< Requested size
+    uint32_t ra32;      ///< Caller return address
+};
+
+// Counters for one allocation site. Byte counts are of requested sizes.
+
+struct heap_site {
+    uint32_t ra32;          ///< Call site, or 0 if the entry is unused
+    unsigned long allocs;   ///< Allocations made
+    unsigned long frees;    ///< Allocations freed
+    unsigned long live;     ///< Bytes allocated and not freed
+    unsigned long peak;     ///< Largest value of live
+};
+
+// An open HEAP_PROF_NAME device: the report as it was at open, read in order.
+
+struct heap_prof_file {
+    struct io io;
+    char * text;    ///< Report, HEAP_PROF_PAGES pages
+    long len;       ///< Length of the report
+    long pos;       ///< Next byte to read
+};
+
+// Overlays a free object. Objects are at least HEAP_ALIGN bytes, so it fits.
+
+struct heap_free_record {
+    struct heap_free_record * next; ///< Next free object in the slab
+    uint32_t magic;     ///< HEAP_FREE_MAGIC
+    uint32_t ra32;      ///< Caller return address
+};
+
+#define SLAB_HDR_SIZE HEAP_ROUND(sizeof(struct slab))
+#define LARGE_HDR_SIZE HEAP_ROUND(sizeof(struct heap_large))
+
+// The ISPOW2 macro evaluates to 1 if its argument is either zero or a power of
+// two. The argument must be an integer type. Cast pointers to uintptr_t to test
+// pointer alignment.
+
+#define ISPOW2(n) (((n)&((n)-1)) == 0)
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static void * heap_low; // lowest address of heap_init memory
+static void * heap_end; // end of unused heap_init memory
+static void * heap_top; // end of heap_init memory
+
+static struct kmem_cache kmalloc_caches[] = {
+    KMEM_CACHE_INIT("kmalloc-16", 16),
+    KMEM_CACHE_INIT("kmalloc-32", 32),
+    KMEM_CACHE_INIT("kmalloc-64", 64),
+    KMEM_CACHE_INIT("kmalloc-128", 128),
+    KMEM_CACHE_INIT("kmalloc-256", 256),
+    KMEM_CACHE_INIT("kmalloc-512", 512),
+    KMEM_CACHE_INIT("kmalloc-1024", KMALLOC_MAX)
+};
+
+#define KMALLOC_NCLASS (sizeof(kmalloc_caches) / sizeof(kmalloc_caches[0]))
+
+#ifdef HEAP_PROFILE
+
+// Open-addressed by call site; the extra last entry is the overflow entry.
+static struct heap_site heap_sites[HEAP_PROF_SITES + 1];
+static struct heap_site heap_total; // all sites together
+
+#endif
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void * heap_malloc_actual(size_t size, void * ra);
+static void * heap_calloc_actual(size_t nelts, size_t eltsz, void * ra);
+static void heap_free_actual(void * ptr, void * ra);
+
+static void * cache_alloc_actual(struct kmem_cache * kc, size_t size, void * ra);
+static void cache_free_actual(struct kmem_cache * kc, void * ptr, void * ra);
+
+static struct slab * slab_create(struct kmem_cache * kc);
+static void slab_unlink(struct kmem_cache * kc, struct slab * slab);
+static void slab_push(struct kmem_cache * kc, struct slab * slab);
+
+static void * heap_pages_alloc(unsigned int cnt);
+static void heap_pages_free(void * pp, unsigned int cnt);
+
+#ifdef HEAP_PROFILE
+static uint32_t prof_alloc(void * ra, size_t size);
+static void prof_free(uint32_t site, size_t size);
+static void prof_count(struct heap_site * hs, long size);
+static int heap_prof_open(struct io ** ioptr, void * aux);
+static void heap_prof_close(struct io * io);
+static long heap_prof_read(struct io * io, void * buf, long bufsz);
+static long heap_prof_report(char * buf, size_t bufsz);
+#endif
+
+// EXPORTED GLOBAL VARIABLES
+//
+
+char heap_initialized = 0;
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+// void heap_init(void * start, void * end)
+// Inputs: void * start - start of memory for the heap before paging is up
+//         void * end - end of that memory
+// Outputs: None
+// Description: Initializes the heap. Pages for slabs and large allocations are
+// carved from [start,end) until the page allocator is initialized.
+// Side Effects: Sets heap_initialized
+void heap_init(void * start, void * end) {
+    trace("%s(%p,%p)", __func__, start, end);
+
+    assert (4 <= HEAP_ALIGN);
+    assert (ISPOW2(HEAP_ALIGN));
+    assert (SLAB_HDR_SIZE + HEAP_PROF_HDR + KMALLOC_MAX <= PAGE_SIZE);
+
+    heap_low = start;
+    heap_end = end;
+    heap_top = end;
+
+#ifdef HEAP_PROFILE
+    assert (sizeof(struct heap_prof_header) <= HEAP_PROF_HDR);
+    register_device(HEAP_PROF_NAME, heap_prof_open, NULL);
+#endif
+
+    heap_initialized = 1;
+}
+
+void * kmalloc(size_t size) {
+    return heap_malloc_actual(size, __builtin_return_address(0));
+}
+
+void * kcalloc(size_t nelts, size_t eltsz) {
+    return heap_calloc_actual(nelts, eltsz, __builtin_return_address(0));
+}
+
+void kfree(void * ptr) {
+    heap_free_actual(ptr, __builtin_return_address(0));
+}
+
+// void * kmem_cache_alloc(struct kmem_cache * kc)
+// Inputs: struct kmem_cache * kc - cache to allocate from
+// Outputs: void * - new object of kc->size bytes (contents undefined)
+// Description: Allocates an object from an object cache, starting a new slab if
+// none of the cache's slabs has a free object.
+// Side Effects: May allocate a page, panics if out of memory
+void * kmem_cache_alloc(struct kmem_cache * kc) {
+    return cache_alloc_actual(kc, kc->size - HEAP_PROF_HDR,
+        __builtin_return_address(0));
+}
+
+// void kmem_cache_free(struct kmem_cache * kc, void * ptr)
+// Inputs: struct kmem_cache * kc - cache ptr was allocated from
+//         void * ptr - object to free, or NULL
+// Outputs: None
+// Description: Returns an object to its cache. A slab left empty is kept for reuse
+// if the cache has no other empty slab, and otherwise returned to the page allocator.
+// Side Effects: May free a page, panics if ptr is not an object of kc
+void kmem_cache_free(struct kmem_cache * kc, void * ptr) {
+    if (ptr != NULL)
+        cache_free_actual(kc, ptr, __builtin_return_address(0));
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+void * heap_malloc_actual(size_t size, void * ra) {
+    struct heap_large * lg;
+    unsigned int npages;
+    unsigned int i;
+    void * ptr;
+
+    trace("%s(%zu,ra=%p)", __func__, size, ra);
+
+    if (size == 0)
+        return NULL;
+
+    if (size <= KMALLOC_MAX) {
+        for (i = 0; kmalloc_caches[i].size - HEAP_PROF_HDR < size; i++)
+            continue;
+        ptr = cache_alloc_actual(&kmalloc_caches[i], size, ra);
+    } else {
+        npages = (LARGE_HDR_SIZE + size + PAGE_SIZE - 1) / PAGE_SIZE;
+        lg = heap_pages_alloc(npages);
+        lg->magic = HEAP_LARGE_MAGIC;
+        lg->npages = npages;
+#ifdef HEAP_PROFILE
+        lg->site = prof_alloc(ra, size);
+        lg->size = size;
+#endif
+        ptr = (void *)lg + LARGE_HDR_SIZE;
+    }
+
+#ifdef HEAP_DEBUG
+    memset(ptr, 0x33, size);
+#endif
+    return ptr;
+}
+
+void * heap_calloc_actual(size_t nelts, size_t eltsz, void * ra) {
+    size_t size;
+    void * ptr;
+
+    trace("%s(%zu,%zu,ra=%p)", __func__, nelts, eltsz, ra);
+
+    if (eltsz != 0 && (size_t)-1 / eltsz < nelts)
+        return NULL;
+    size = nelts * eltsz;
+
+    ptr = heap_malloc_actual(size, ra);
+    if (ptr != NULL)
+        memset(ptr, 0, size);
+    return ptr;
+}
+
+void heap_free_actual(void * ptr, void * ra) {
+    struct heap_large * lg;
+    struct slab * slab;
+
+    trace("%s(%p,ra=%p)", __func__, ptr, ra);
+
+    if (ptr == NULL)
+        return;
+
+    slab = (void *)ROUND_DOWN((uintptr_t)ptr, PAGE_SIZE);
+
+    if (slab->magic == SLAB_MAGIC) {
+        cache_free_actual(slab->cache, ptr, ra);
+        return;
+    }
+
+    lg = (struct heap_large *)slab;
+
+    if (lg->magic != HEAP_LARGE_MAGIC || ptr != (void *)lg + LARGE_HDR_SIZE)
+        panic("kfree: not a heap pointer");
+
+    lg->magic = HEAP_FREE_MAGIC;
+
+#ifdef HEAP_PROFILE
+    prof_free(lg->site, lg->size);
+#endif
+    heap_pages_free(lg, lg->npages);
+}
+
+// static void * cache_alloc_actual(struct kmem_cache * kc, size_t size, void * ra)
+// Inputs: struct kmem_cache * kc - cache to allocate from
+//         size_t size - bytes requested, for the profiler
+//         void * ra - caller return address
+// Outputs: void * - new object
+// Description: Takes the first free object of the first partial slab, falling back
+// to the cache's spare empty slab and then to a new slab.
+// Side Effects: Modifies the cache's slab lists, may allocate a page
+void * cache_alloc_actual(struct kmem_cache * kc, size_t size, void * ra) {
+    struct heap_free_record * rec;
+    struct slab * slab;
+
+    trace("%s(%s,ra=%p)", __func__, kc->name, ra);
+
+    slab = kc->partial;
+
+    if (slab == NULL) {
+        if (kc->spare != NULL) {
+            slab = kc->spare;
+            kc->spare = NULL;
+        } else
+            slab = slab_create(kc);
+        slab_push(kc, slab);
+    }
+
+    rec = slab->free;
+    slab->free = rec->next;
+    slab->inuse++;
+    kc->nobjs++;
+
+    // a full slab leaves the partial list until one of its objects is freed
+    if (slab->free == NULL)
+        slab_unlink(kc, slab);
+
+#ifdef HEAP_PROFILE
+    struct heap_prof_header * hdr = (void *)rec;
+    hdr->magic = HEAP_ALLOC_MAGIC;
+    hdr->site = prof_alloc(ra, size);
+    hdr->size = size;
+    hdr->ra32 = (uint32_t)(uintptr_t)ra;
+#else
+    rec->magic = 0;
+#endif
+
+    return (void *)rec + HEAP_PROF_HDR;
+}
+
+// static void cache_free_actual(struct kmem_cache * kc, void * ptr, void * ra)
+// Inputs: struct kmem_cache * kc - cache ptr was allocated from
+//         void * ptr - object to free
+//         void * ra - caller return address
+// Outputs: None
+// Description: Puts an object back on its slab's free list, and moves the slab to
+// the partial list, the spare slot or the page allocator as its use count requires.
+// Side Effects: Modifies the cache's slab lists, may free a page
+void cache_free_actual(struct kmem_cache * kc, void * ptr, void * ra) {
+    struct heap_free_record * rec = ptr - HEAP_PROF_HDR;
+    struct slab * slab;
+
+    trace("%s(%s,%p,ra=%p)", __func__, kc->name, ptr, ra);
+
+    slab = (void *)ROUND_DOWN((uintptr_t)ptr, PAGE_SIZE);
+
+    if (slab->magic != SLAB_MAGIC || slab->cache != kc ||
+        (void *)rec < (void *)slab + SLAB_HDR_SIZE ||
+        ((void *)rec - ((void *)slab + SLAB_HDR_SIZE)) % kc->size != 0)
+    {
+        panic("kfree: not an object of this cache");
+    }
+
+
+#ifdef HEAP_PROFILE
+    struct heap_prof_header * hdr = (void *)rec;
+    if (hdr->magic != HEAP_ALLOC_MAGIC)
+        panic("kfree: double free");
+    prof_free(hdr->site, hdr->size);
+#endif
+
+#ifdef HEAP_DEBUG
+    // The magic alone could be object data, so only the free list is conclusive.
+    if (rec->magic == HEAP_FREE_MAGIC) {
+        struct heap_free_record * p;
+        for (p = slab->free; p != NULL; p = p->next) {
+            if (p == rec)
+                panic("kfree: double free");
+        }
+    }
+    memset(rec + 1, 0x11, kc->size - sizeof(struct heap_free_record));
+#endif
+
+    rec->magic = HEAP_FREE_MAGIC;
+    rec->ra32 = (uint32_t)(uintptr_t)ra;
+
+    // a full slab has free objects again
+    if (slab->free == NULL)
+        slab_push(kc, slab);
+
+    rec->next = slab->free;
+    slab->free = rec;
+    slab->inuse--;
+    kc->nobjs--;
+
+    if (slab->inuse == 0) {
+        slab_unlink(kc, slab);
+        if (kc->spare == NULL)
+            kc->spare = slab;
+        else {
+            slab->magic = HEAP_FREE_MAGIC;
+            kc->nslabs--;
+            heap_pages_free(slab, 1);
+        }
+    }
+}
+
+// static struct slab * slab_create(struct kmem_cache * kc)
+// Inputs: struct kmem_cache * kc - cache the slab is for
+// Outputs: struct slab * - new slab with all objects free, not on any list
+// Description: Allocates a page and lays out a slab header and kc's objects in it.
+// Side Effects: Allocates a page
+struct slab * slab_create(struct kmem_cache * kc) {
+    struct heap_free_record * rec;
+    struct slab * slab;
+    unsigned int cnt;
+    unsigned int i;
+
+    assert (kc->size != 0 && kc->size % HEAP_ALIGN == 0);
+    assert (SLAB_HDR_SIZE + kc->size <= PAGE_SIZE);
+
+    slab = heap_pages_alloc(1);
+    slab->magic = SLAB_MAGIC;
+    slab->inuse = 0;
+    slab->cache = kc;
+    slab->next = NULL;
+    slab->prev = NULL;
+    slab->free = NULL;
+
+    // link the objects so that the lowest address is handed out first
+
+    cnt = (PAGE_SIZE - SLAB_HDR_SIZE) / kc->size;
+
+    for (i = cnt; i != 0; i--) {
+        rec = (void *)slab + SLAB_HDR_SIZE + (i - 1) * kc->size;
+        rec->next = slab->free;
+        rec->magic = HEAP_FREE_MAGIC;
+        rec->ra32 = 0;
+        slab->free = rec;
+    }
+
+    kc->nslabs++;
+    return slab;
+}
+
+// static void slab_push(struct kmem_cache * kc, struct slab * slab)
+// Inputs: struct kmem_cache * kc - cache the slab belongs to
+//         struct slab * slab - slab not on the partial list
+// Outputs: None
+// Description: Adds a slab to the front of the cache's partial list.
+// Side Effects: Modifies the partial list
+void slab_push(struct kmem_cache * kc, struct slab * slab) {
+    slab->prev = NULL;
+    slab->next = kc->partial;
+    if (kc->partial != NULL)
+        kc->partial->prev = slab;
+    kc->partial = slab;
+}
+
+// static void slab_unlink(struct kmem_cache * kc, struct slab * slab)
+// Inputs: struct kmem_cache * kc - cache the slab belongs to
+//         struct slab * slab - slab on the partial list
+// Outputs: None
+// Description: Removes a slab from the cache's partial list.
+// Side Effects: Modifies the partial list
+void slab_unlink(struct kmem_cache * kc, struct slab * slab) {
+    if (slab->prev != NULL)
+        slab->prev->next = slab->next;
+    else
+        kc->partial = slab->next;
+    if (slab->next != NULL)
+        slab->next->prev = slab->prev;
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+// static void * heap_pages_alloc(unsigned int cnt)
+// Inputs: unsigned int cnt - number of pages
+// Outputs: void * - first of cnt contiguous pages
+// Description: Gets pages from the page allocator, or from the top of the heap_init
+// memory while the page allocator is not initialized.
+// Side Effects: Panics if out of memory
+void * heap_pages_alloc(unsigned int cnt) {
+    void * pp;
+
+    if (memory_initialized)
+        return alloc_phys_pages(cnt);
+
+    pp = (void *)ROUND_DOWN((uintptr_t)heap_end, PAGE_SIZE);
+
+    if (pp < heap_low || pp - heap_low < cnt * PAGE_SIZE)
+        panic("out of heap memory");
+
+    heap_end = pp - cnt * PAGE_SIZE;
+    return heap_end;
+}
+
+// static void heap_pages_free(void * pp, unsigned int cnt)
+// Inputs: void * pp - pages from heap_pages_alloc
+//         unsigned int cnt - number of pages
+// Outputs: None
+// Description: Returns pages to the page allocator. Pages carved from the heap_init
+// memory are not returned.
+// Side Effects: Frees pages
+void heap_pages_free(void * pp, unsigned int cnt) {
+    if (heap_low <= pp && pp < heap_top)
+        return;
+
+    free_phys_pages(pp, cnt);
+}
+
+#ifdef HEAP_PROFILE
+
+// static uint32_t prof_alloc(void * ra, size_t size)
+// Inputs: void * ra - return address of the allocating call
+//         size_t size - bytes requested
+// Outputs: uint32_t - index of the site's entry in heap_sites
+// Description: Charges an allocation to its call site, adding an entry for a new
+// site, or using the overflow entry if the table is full.
+// Side Effects: Modifies heap_sites
+uint32_t prof_alloc(void * ra, size_t size) {
+    uint32_t ra32 = (uint32_t)(uintptr_t)ra;
+    uint32_t i, k;
+
+    // instructions are at least 2-byte aligned
+    k = (ra32 >> 1) * 2654435761U % HEAP_PROF_SITES;
+
+    for (i = 0; i < HEAP_PROF_SITES; i++) {
+        if (heap_sites[k].ra32 == ra32 || heap_sites[k].ra32 == 0)
+            break;
+        k = (k + 1) % HEAP_PROF_SITES;
+    }
+
+    if (i == HEAP_PROF_SITES)
+        k = HEAP_PROF_SITES; // overflow entry
+    else
+        heap_sites[k].ra32 = ra32;
+
+    prof_count(&heap_sites[k], size);
+    prof_count(&heap_total, size);
+    return k;
+}
+
+// static void prof_free(uint32_t site, size_t size)
+// Inputs: uint32_t site - index from prof_alloc
+//         size_t size - bytes requested when allocated
+// Outputs: None
+// Description: Credits a free to the site that made the allocation.
+// Side Effects: Modifies heap_sites
+void prof_free(uint32_t site, size_t size) {
+    assert (site <= HEAP_PROF_SITES);
+    prof_count(&heap_sites[site], -(long)size);
+    prof_count(&heap_total, -(long)size);
+}
+
+// static void prof_count(struct heap_site * hs, long size)
+// Inputs: struct heap_site * hs - counters to update
+//         long size - bytes allocated, or minus bytes freed
+// Outputs: None
+// Description: Counts an allocation or free and tracks the peak of live bytes.
+// Side Effects: Modifies *hs
+void prof_count(struct heap_site * hs, long size) {
+    if (size < 0) {
+        hs->frees++;
+        hs->live -= -size;
+    } else {
+        hs->allocs++;
+        hs->live += size;
+        if (hs->peak < hs->live)
+            hs->peak = hs->live;
+    }
+}
+
+// static int heap_prof_open(struct io ** ioptr, void * aux)
+// Inputs: Double pointer to io interface, auxiliary data (unused)
+// Outputs: int - 0 on success
+// Description: Opens the heap profile device. The report is taken now, so it stays
+// consistent however it is read; open the device again for a new one.
+// Side Effects: Allocates the open file and pages for the report
+int heap_prof_open(struct io ** ioptr, void * aux) {
+    static const struct iointf heap_prof_iointf = {
+        .close = &heap_prof_close,
+        .read = &heap_prof_read
+    };
+    struct heap_prof_file * f;
+
+    (void)aux;
+
+    f = kmalloc(sizeof(struct heap_prof_file));
+    f->text = alloc_phys_pages(HEAP_PROF_PAGES);
+    f->len = heap_prof_report(f->text, HEAP_PROF_PAGES * PAGE_SIZE);
+    f->pos = 0;
+
+    *ioptr = ioinit1(&f->io, &heap_prof_iointf);
+    return 0;
+}
+
+// static void heap_prof_close(struct io * io)
+// Inputs: Pointer to the profile io
+// Outputs: None
+// Description: Frees the open file and its report.
+// Side Effects: Frees memory
+void heap_prof_close(struct io * io) {
+    struct heap_prof_file * const f = (void*)io - offsetof(struct heap_prof_file, io);
+
+    free_phys_pages(f->text, HEAP_PROF_PAGES);
+    kfree(f);
+}
+
+// static long heap_prof_read(struct io * io, void * buf, long bufsz)
+// Inputs: Pointer to the profile io, buffer, its size
+// Outputs: long - number of bytes read, 0 at the end of the report, -EFAULT if buf
+//          could not be stored to
+// Description: Reads the next part of the report taken at open.
+// Side Effects: Advances the read position
+long heap_prof_read(struct io * io, void * buf, long bufsz) {
+    struct heap_prof_file * const f = (void*)io - offsetof(struct heap_prof_file, io);
+
+    if (bufsz < 0)
+        return -EINVAL;
+
+    if (bufsz > f->len - f->pos)
+        bufsz = f->len - f->pos;
+
+    if (memcpy_nofault(buf, f->text + f->pos, bufsz) < 0)
+        return -EFAULT;
+    f->pos += bufsz;
+    return bufsz;
+}
+
+// static long heap_prof_report(char * buf, size_t bufsz)
+// Inputs: Buffer, its size
+// Outputs: long - length of the report (truncated to fit buf with its NUL)
+// Description: Formats the profile as text: the totals, then one line per call site
+// with its allocations, frees, live and peak bytes, ordered by allocations made.
+// Side Effects: None
+long heap_prof_report(char * buf, size_t bufsz) {
+    uint8_t done[HEAP_PROF_SITES + 1];
+    struct heap_site hs;
+    char * p = buf;
+    size_t rem;
+    size_t n;
+    int i, k;
+
+    rem = bufsz;
+
+    memset(done, 0, sizeof(done));
+
+// append to the report, stopping at the end of buf
+#define PROF_PRINT(...) do {                        \
+        n = snprintf(p, rem, __VA_ARGS__);          \
+        if (n >= rem) n = rem - 1;                  \
+        p += n;                                     \
+        rem -= n;                                   \
+    } while (0)
+
+    hs = heap_total;
+
+    PROF_PRINT("total: allocs %lu frees %lu live %lu peak %lu\n",
+        hs.allocs, hs.frees, hs.live, hs.peak);
+
+    // Counters may move between lines; each line is a consistent snapshot.
+
+    while (rem > 1) {
+        k = -1;
+        for (i = 0; i <= HEAP_PROF_SITES; i++) {
+            if (!done[i] && heap_sites[i].allocs != 0 &&
+                (k < 0 || heap_sites[k].allocs < heap_sites[i].allocs))
+            {
+                k = i;
+            }
+        }
+        if (k >= 0)
+            hs = heap_sites[k];
+
+        if (k < 0)
+            break;
+        done[k] = 1;
+
+        if (k == HEAP_PROF_SITES)
+            PROF_PRINT("   other:");
+        else
+            PROF_PRINT("%08x:", (unsigned int)hs.ra32);
+        PROF_PRINT(" allocs %lu frees %lu live %lu peak %lu\n",
+            hs.allocs, hs.frees, hs.live, hs.peak);
+    }
+
+#undef PROF_PRINT
+
+    return p - buf;
+}
+
+#endif // HEAP_PROFILE
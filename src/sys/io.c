@@ -12,6 +12,7 @@
 #include "error.h"
 #include "thread.h"
 #include "memory.h"
+#include "intr.h"
 
 #include <stddef.h>
 #include <limits.h>
@@ -240,6 +241,113 @@ long iowriteat (
     return io->intf->writeat(io, pos, buf, len);
 }
 
+void ioreq_init (
+    struct ioreq * req, int op, unsigned long long pos, void * buf, long len)
+{
+    memset(req, 0, sizeof(*req));
+    req->op = op;
+    req->pos = pos;
+    req->buf = buf;
+    req->len = len;
+    condition_init(&req->cond, "ioreq");
+}
+
+void ioreq_init_segs (
+    struct ioreq * req, int op, unsigned long long pos,
+    const struct ioseg * segs, int nsegs)
+{
+    long len = 0;
+    int i;
+
+    for (i = 0; i < nsegs; i++)
+        len += segs[i].len;
+
+    ioreq_init(req, op, pos, NULL, len);
+    req->segs = segs;
+    req->nsegs = nsegs;
+}
+
+void ioreq_complete(struct ioreq * req, long result) {
+    req->result = result;
+    req->done = 1;
+    if (req->callback != NULL)
+        req->callback(req);
+    condition_broadcast(&req->cond);
+}
+
+// Transfers a scattered request one segment at a time. Returns the total
+// transferred, or the first error.
+
+static long ioxfer_segs(struct io * io, struct ioreq * req) {
+    unsigned long long pos = req->pos;
+    long total = 0;
+    long result;
+    int i;
+
+    for (i = 0; i < req->nsegs; i++) {
+        if (req->op == IOREQ_READ)
+            result = ioreadat(io, pos, req->segs[i].buf, req->segs[i].len);
+        else
+            result = iowriteat(io, pos, req->segs[i].buf, req->segs[i].len);
+
+        if (result < 0)
+            return result;
+        total += result;
+        if ((unsigned long)result < req->segs[i].len)
+            break;
+        pos += result;
+    }
+
+    return total;
+}
+
+int iosubmit(struct io * io, struct ioreq * req) {
+    long result;
+
+    assert (io != NULL);
+    assert (io->intf != NULL);
+    assert (req != NULL);
+
+    if (req->len < 0 || (req->op != IOREQ_READ && req->op != IOREQ_WRITE))
+        return -EINVAL;
+
+    req->done = 0;
+
+    if (io->intf->submit != NULL)
+        return io->intf->submit(io, req);
+
+    // No native support: do it now and complete before returning
+
+    if (req->nsegs == 0) {
+        if (req->op == IOREQ_READ)
+            result = ioreadat(io, req->pos, req->buf, req->len);
+        else
+            result = iowriteat(io, req->pos, req->buf, req->len);
+    } else
+        result = ioxfer_segs(io, req);
+
+    ioreq_complete(req, result);
+    return 0;
+}
+
+long iowait(struct ioreq * req) {
+    int pie;
+
+    assert (req != NULL);
+
+    // The completion may come from an ISR, so check and sleep atomically
+    pie = disable_interrupts();
+    while (!req->done)
+        condition_wait(&req->cond);
+    restore_interrupts(pie);
+
+    return req->result;
+}
+
+int iopoll(const struct ioreq * req) {
+    return req->done;
+}
+
 int ioctl(struct io * io, int cmd, void * arg) {
     assert (io != NULL);
     assert (io->intf != NULL);
@@ -438,8 +546,12 @@ int seekio_cntl(struct io * io, int cmd, void * arg) {
     case IOCTL_SETEND:
         // Call backing endpoint ioctl and save result
         result = ioctl(sio->bkgio, IOCTL_SETEND, ullarg);
-        if (result == 0)
+        if (result == 0) {
             sio->end = *ullarg;
+            // Truncation may leave the position past the new end
+            if (sio->pos > sio->end)
+                sio->pos = sio->end;
+        }
         return result;
     default:
         return ioctl(sio->bkgio, cmd, arg);
@@ -555,7 +667,7 @@ void create_pipe(struct io **wioptr, struct io **rioptr) {
 
 // static long pipe_read(struct io * io, void * buf, long len)
 // Inputs: Pipe reader endpoint, destination buffer, length to read
-// Outputs: Number of bytes read, or -1 on EOF/error
+// Outputs: Number of bytes read, -EFAULT if nothing could be stored in buf, or -1 on EOF/error
 // Description: Reads from pipe buffer, blocking if empty unless writer has closed
 // Side Effects: Waits on condition variables, modifies pipe head, wakes writers
 static long pipe_read(struct io *io, void *buf, long len) {
@@ -563,6 +675,8 @@ static long pipe_read(struct io *io, void *buf, long len) {
     struct pipe *p = pio->pipe;
     char *dst = buf;
     int count = 0;
+    int fault = 0;
+    size_t n;
 
     lock_acquire(&p->lock);
 
@@ -574,7 +688,18 @@ static long pipe_read(struct io *io, void *buf, long len) {
         if (p->head == p->tail && !p->writer_open)
             break;
 
-        dst[count++] = p->buffer[p->head++ % PAGE_SIZE];
+        // copy the run up to the ring wrap; head only moves once it has landed
+        n = p->tail - p->head;
+        if (n > PAGE_SIZE - p->head % PAGE_SIZE)
+            n = PAGE_SIZE - p->head % PAGE_SIZE;
+        if (n > len - count)
+            n = len - count;
+        if (memcpy_nofault(dst + count, p->buffer + p->head % PAGE_SIZE, n) < 0) {
+            fault = 1;
+            break;
+        }
+        p->head += n;
+        count += n;
         condition_broadcast(&p->write_cond);
     }
 
@@ -583,6 +708,10 @@ static long pipe_read(struct io *io, void *buf, long len) {
     {
         return count;
     } 
+    else if (fault)
+    {
+        return -EFAULT;
+    }
     else 
     {
         if (p->writer_open) 
@@ -597,7 +726,8 @@ static long pipe_read(struct io *io, void *buf, long len) {
 
 // static long pipe_write(struct io * io, const void * buf, long len)
 // Inputs: Pipe writer endpoint, source buffer, length to write
-// Outputs: Number of bytes written, or -1 if reader is closed
+// Outputs: Number of bytes written, -EFAULT if nothing could be loaded from buf,
+//          or -1 if reader is closed
 // Description: Writes to pipe buffer, blocking if full unless reader has closed
 // Side Effects: Waits on condition variables, modifies pipe tail, wakes readers
 static long pipe_write(struct io *io, const void *buf, long len) {
@@ -605,6 +735,8 @@ static long pipe_write(struct io *io, const void *buf, long len) {
     struct pipe *p = pio->pipe;
     const char *src = buf;
     int count = 0;
+    int fault = 0;
+    size_t n;
 
     lock_acquire(&p->lock);
 
@@ -616,11 +748,24 @@ static long pipe_write(struct io *io, const void *buf, long len) {
         if (!p->reader_open)
             break;
 
-        p->buffer[p->tail++ % PAGE_SIZE] = src[count++];
+        // copy the run up to the ring wrap; tail only moves once it has landed
+        n = PAGE_SIZE - 1 - (p->tail - p->head);
+        if (n > PAGE_SIZE - p->tail % PAGE_SIZE)
+            n = PAGE_SIZE - p->tail % PAGE_SIZE;
+        if (n > len - count)
+            n = len - count;
+        if (memcpy_nofault(p->buffer + p->tail % PAGE_SIZE, src + count, n) < 0) {
+            fault = 1;
+            break;
+        }
+        p->tail += n;
+        count += n;
         condition_broadcast(&p->read_cond);
     }
 
     lock_release(&p->lock);
+    if (count == 0 && fault)
+        return -EFAULT;
     return (count > 0) ? count : (p->reader_open ? 0 : -1);
 }
 
@@ -9,6 +9,8 @@
 
 #include <stddef.h>
 
+#include "thread.h"
+
 // EXPORTED TYPE DEFINITIONS
 //
 
@@ -19,6 +21,71 @@ struct io; // opaque (defined in ioimpl.h)
 #define IOCTL_SETEND    3 // arg is const unsigned long long *
 #define IOCTL_GETPOS    4 // arg is unsigned long long *
 #define IOCTL_SETPOS    5 // arg is const unsigned long long *
+#define IOCTL_GETFRAG   6 // arg is unsigned int *
+#define IOCTL_DEFRAG    7 // arg is ignored
+#define IOCTL_PREALLOC  8 // arg is const unsigned long long *
+#define IOCTL_FLUSH     9 // arg is ignored
+#define IOCTL_DISCARD   10 // arg is const unsigned long long[2] (pos, len)
+#define IOCTL_WRITEZEROES 11 // arg is const unsigned long long[2] (pos, len)
+#define IOCTL_GETSTATS  12 // arg is struct blkstats *
+
+// Block device statistics (IOCTL_GETSTATS). Arrays are indexed by IOREQ_READ and
+// IOREQ_WRITE. Times are rdtime ticks (TIMER_FREQ per second) from submission to
+// completion, so they include time spent waiting for the device's queue.
+
+#define BLKSTATS_HIST 16 // bucket i counts latencies below 2^i us; the last, the rest
+
+struct blkstats {
+    unsigned long long since;       // rdtime when counting started
+    unsigned long long ops[2];      // completed requests
+    unsigned long long bytes[2];    // bytes transferred
+    unsigned long long merged[2];   // requests merged into those above by a scheduler
+    unsigned long long ticks[2];    // sum of latencies
+    unsigned long long hist[2][BLKSTATS_HIST];
+    unsigned long long other;       // flush, discard and write-zeroes requests
+    unsigned int depth;             // requests in flight now
+    unsigned int max_depth;         // most requests in flight at once
+};
+
+// Asynchronous requests. The caller fills in a request (see ioreq_init), hands it to
+// iosubmit() and later waits with iowait() or checks iopoll(). On completion /result/
+// holds the number of bytes transferred or a negative error, /done/ is set, the
+// callback (if any) is called, possibly from an ISR, and /cond/ is broadcast. The
+// request and its buffer must stay valid until then. Endpoints without a native
+// submit operation complete the request synchronously inside iosubmit().
+//
+// The data of a request may be scattered over several buffers: if /nsegs/ is non-zero,
+// /segs/ lists them in order and /buf/ is unused (see ioreq_init_segs). /len/ is always
+// the total length.
+
+#define IOREQ_READ      0
+#define IOREQ_WRITE     1
+
+struct ioseg {
+    void * buf;
+    unsigned long len;
+};
+
+struct ioreq {
+    int op;                         // IOREQ_READ or IOREQ_WRITE
+    unsigned long long pos;         // byte position on the endpoint
+    void * buf;
+    long len;
+    const struct ioseg * segs;      // scattered buffers, or NULL
+    int nsegs;
+
+    volatile long result;           // bytes transferred or negative error
+    volatile int done;              // set on completion
+    void (*callback)(struct ioreq * req); // optional, called on completion
+    void * aux;                     // for the submitter
+    struct condition cond;          // broadcast on completion
+
+    // Owned by the endpoint while the request is in flight
+    struct ioreq * next;
+    int parts;                      // outstanding device requests
+    int merged;                     // requests merged into this one by a scheduler
+    unsigned long long stamp;       // rdtime at submission, for statistics
+};
 
 // EXPORTED FUNCTION DECLARATIONS
 //
@@ -66,6 +133,26 @@ extern long iowriteat (
     long len
 );
 
+extern void ioreq_init (
+    struct ioreq * req,
+    int op,
+    unsigned long long pos,
+    void * buf,
+    long len
+);
+
+extern void ioreq_init_segs (
+    struct ioreq * req,
+    int op,
+    unsigned long long pos,
+    const struct ioseg * segs,
+    int nsegs
+);
+
+extern int iosubmit(struct io * io, struct ioreq * req);
+extern long iowait(struct ioreq * req);
+extern int iopoll(const struct ioreq * req);
+
 extern int ioseek (
     struct io * io,
     unsigned long long pos
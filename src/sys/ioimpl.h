@@ -48,6 +48,10 @@ struct iointf {
         const void * buf,
         long len
     );
+    int (*submit) (
+        struct io * io,
+        struct ioreq * req
+    );
 };
 
 // EXPORTED FUNCTION DECLARATIONS
@@ -62,4 +66,10 @@ struct iointf {
 extern struct io * ioinit0(struct io * io, const struct iointf * intf);
 extern struct io * ioinit1(struct io * io, const struct iointf * intf);
 
+// The ioreq_complete() function is called by an endpoint's submit implementation
+// when a request finishes. It stores the result, marks the request done, calls
+// the callback and wakes waiters. It may be called from an ISR.
+
+extern void ioreq_complete(struct ioreq * req, long result);
+
 #endif // _IOIMPL_H_
\ No newline at end of file
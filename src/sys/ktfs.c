@@ -26,6 +26,9 @@
 #include "string.h"
 #include "console.h"
 #include "cache.h"
+#include "conf.h"
+#include "elevator.h"
+#include "memory.h"
 
 
 // INTERNAL TYPE DEFINITIONS
@@ -70,6 +73,15 @@ int ktfs_delete(const char* name);
 int ktfs_getblksz(struct ktfs_file *fd);
 int ktfs_getend(struct ktfs_file *fd, void *arg);
 
+static int ktfs_reserve_blocks(struct ktfs_inode *inode, uint32_t nblocks);
+static uint32_t ktfs_init_blocks(const struct ktfs_inode *inode);
+static void ktfs_set_init_blocks(struct ktfs_inode *inode, uint32_t count);
+static int ktfs_zero_file_blocks(struct ktfs_inode *inode, uint32_t first, uint32_t last);
+static int ktfs_free_blocks_from(struct ktfs_inode *inode, uint32_t first);
+static int ktfs_prealloc(struct ktfs_file *file, unsigned long long len);
+static int ktfs_create_locked(const char* name);
+int get_blocknum_for_offset(struct ktfs_inode *inode, uint32_t file_block_index, uint32_t *out_blockno);
+
 
 int ktfs_flush(void);
 
@@ -305,23 +317,45 @@ static int ktfs_alloc_data_block(uint32_t *out_blockno) {
 //          unsigned long long new_end - this will new desried file size in bytes 
 // outputs: int- It will return 0 on succeses or negative code on failure 
 // Description: It will grow a file by allocating the new data block to extende the file to bytes 
-// and update the inode on disk and the memory file structure.
+// and update the inode on disk and the memory file structure. Shrinking truncates the file
+// and frees the blocks past the new end. New blocks are unwritten (see ktfs.h), so growing
+// reads zeros without zeroing anything on the device.
 //Side Effect: Allocate new data block, modifes the file inode and update data on disk 
 static int ktfs_set_end(struct ktfs_file *file, unsigned long long new_end) {
     struct ktfs_inode inode;
     int ret = ktfs_read_inode(file->inode_num, &inode);
     if (ret < 0) return ret;
-    // finding required new blocks
-    unsigned int old_size = inode.size;
-    unsigned int old_blocks = (old_size + KTFS_BLKSZ - 1) / KTFS_BLKSZ;
+    if (new_end > (unsigned long long)KTFS_MAX_FILE_BLOCKS * KTFS_BLKSZ) return -ENODATABLKS;
     unsigned int new_blocks = (new_end + KTFS_BLKSZ - 1) / KTFS_BLKSZ;
-    // allocate new data blocks (direct only)
-    for (unsigned i = old_blocks; i < new_blocks; i++) {
-        if (i >= KTFS_NUM_DIRECT_DATA_BLOCKS) return -ENODATABLKS;
-        uint32_t blkno;
-        ret = ktfs_alloc_data_block(&blkno);
-        if (ret < 0) return ret;
-        inode.block[i] = blkno;
+    if (new_end < inode.size) {
+        // truncating: free everything past the new last block (preallocated blocks too)
+        ret = ktfs_free_blocks_from(&inode, new_blocks);
+        if (ret < 0) {
+            ktfs_write_inode(file->inode_num, &inode);
+            return ret;
+        }
+        if (ktfs_init_blocks(&inode) > new_blocks)
+            ktfs_set_init_blocks(&inode, new_blocks);
+        // zero the tail of the last block so growing the file again reads zeros
+        if (new_end % KTFS_BLKSZ != 0 && new_blocks <= ktfs_init_blocks(&inode)) {
+            uint32_t data_base = 1 + fs.sb.bitmap_block_count + fs.sb.inode_block_count;
+            uint32_t last;
+            void *bp;
+            ret = get_blocknum_for_offset(&inode, new_blocks - 1, &last);
+            if (ret == 0)
+                ret = cache_get_block(fs.cache, (data_base + last) * KTFS_BLKSZ, &bp);
+            if (ret == 0) {
+                memset((char *)bp + new_end % KTFS_BLKSZ, 0, KTFS_BLKSZ - new_end % KTFS_BLKSZ);
+                cache_release_block(fs.cache, bp, 1);
+            }
+        }
+    } else {
+        // map any blocks that are not already there (preallocated blocks are reused)
+        ret = ktfs_reserve_blocks(&inode, new_blocks);
+        if (ret < 0) {
+            ktfs_write_inode(file->inode_num, &inode);
+            return ret;
+        }
     }
     // updating inode size
     inode.size = new_end;
@@ -333,66 +367,209 @@ static int ktfs_set_end(struct ktfs_file *file, unsigned long long new_end) {
     return 0;
 }
 
-// Inputs:  uint16_t inum -inode number of the file whose data block should be free 
-//Outputs: int - return 0 on success or negative erro on failure 
-//Description: free all data block associated with the given inode, inclding direct, indirect,
-// and doubly indirect blocks. It clear corresponding bits in the bit map.
-///side effect: This willl get the bit map and relesse allocated data block back to the system
-// and perform multiple disk read to the cache system.  
-static int ktfs_free_inode_blocks(uint16_t inum) {
-    struct ktfs_inode inode;
-    int ret = ktfs_read_inode(inum, &inode);
-    if (ret < 0) return ret;
+// Blocks being freed are collected here and cleared from the bitmap in sorted batches,
+// so each bitmap block is fetched once per batch rather than once per freed block.
+// Only used with fs_lock held, so one static batch is enough.
 
-    // compute global block offset for data blocks
+#define KTFS_FREE_BATCH (KTFS_BLKSZ / POINTER_BYTESIZE)
+
+static struct ktfs_free_batch {
+    uint32_t blk[KTFS_FREE_BATCH]; // data block numbers to free
+    int cnt;
+} free_batch;
+
+// Inputs:  None
+// Outputs: int - Returns 0 on success, or a negative failure
+// Description: Sorts the pending blocks and clears their bitmap bits. Whole bytes of
+// consecutive blocks are cleared at once, and the current bitmap block is held until
+// the next block falls outside it. Each run of consecutive blocks is then discarded
+// with one request.
+// Side Effects: Modifies bitmap blocks through the cache, discards the freed blocks,
+// empties the batch
+static int ktfs_free_batch_flush(void) {
     uint32_t data_base = 1 + fs.sb.bitmap_block_count + fs.sb.inode_block_count;
-    uint32_t ptrs = KTFS_BLKSZ / sizeof(uint32_t);
+    uint32_t bits_per_blk = KTFS_BLKSZ * 8;
+    uint32_t *blk = free_batch.blk;
+    int cnt = free_batch.cnt;
+    uint32_t cur_blk = 0;
+    void *bp = NULL;
+    int ret = 0;
 
-    // freeing direct blocks
-    for (int i = 0; i < KTFS_NUM_DIRECT_DATA_BLOCKS; i++) {
-        if (inode.block[i]) {
-            ret = ktfs_bitmap_clear_bit(data_base + inode.block[i]);
+    free_batch.cnt = 0;
+
+    // insertion sort, batches are usually already in order
+    for (int i = 1; i < cnt; i++) {
+        uint32_t key = blk[i];
+        int j = i - 1;
+        while (j >= 0 && blk[j] > key) {
+            blk[j+1] = blk[j];
+            j--;
+        }
+        blk[j+1] = key;
+    }
+
+    for (int i = 0; i < cnt; ) {
+        uint32_t bit_idx = data_base + blk[i];
+        uint32_t bm_blk = 1 + (bit_idx / bits_per_blk);
+        uint32_t off = bit_idx % bits_per_blk;
+        if (bp == NULL || bm_blk != cur_blk) {
+            if (bp) cache_release_block(fs.cache, bp, 1);
+            ret = cache_get_block(fs.cache, bm_blk * KTFS_BLKSZ, &bp);
             if (ret < 0) return ret;
+            cur_blk = bm_blk;
         }
+        // eight sorted consecutive blocks starting on a byte boundary clear a whole byte
+        if (off % 8 == 0 && i + 8 <= cnt && blk[i+7] == blk[i] + 7) {
+            ((uint8_t *)bp)[off/8] = 0;
+            i += 8;
+        } else {
+            ((uint8_t *)bp)[off/8] &= ~(1 << (off % 8));
+            i++;
+        }
+    }
+    if (bp) cache_release_block(fs.cache, bp, 1);
+
+    for (int i = 0; i < cnt; ) {
+        int j = i + 1;
+        while (j < cnt && blk[j] == blk[j-1] + 1)
+            j++;
+        ret = cache_discard(fs.cache, (unsigned long long)(data_base + blk[i]) * KTFS_BLKSZ, j - i);
+        if (ret < 0) return ret;
+        i = j;
     }
+    return 0;
+}
 
-    // freeing single-indirect blocks
-    if (inode.indirect) {
-        uint32_t idxs[ptrs];
-        ret = ktfs_read_data_block(inode.indirect, idxs);
+// Inputs:  uint32_t blockno - data block number to free
+// Outputs: int - Returns 0 on success, or a negative failure
+// Description: Queues a data block to be freed, flushing the batch when it is full.
+// Side Effects: May modify bitmap blocks through the cache
+static int ktfs_free_batch_add(uint32_t blockno) {
+    if (free_batch.cnt == KTFS_FREE_BATCH) {
+        int ret = ktfs_free_batch_flush();
         if (ret < 0) return ret;
-        for (uint32_t i = 0; i < ptrs && idxs[i]; i++) {
-            ret = ktfs_bitmap_clear_bit(data_base + idxs[i]);
+    }
+    free_batch.blk[free_batch.cnt++] = blockno;
+    return 0;
+}
+
+// Inputs:  uint32_t ptr_blockno - data block number of a block of pointers
+//          uint32_t first - index of the first pointer to free
+// Outputs: int - Returns 0 on success, or a negative failure
+// Description: Queues every data block referenced from slot /first/ on. If some slots
+// are kept (first > 0), the freed slots are zeroed in the pointer block. The pointer
+// block itself is not freed here.
+// Side Effects: May modify the pointer block and bitmap blocks through the cache
+static int ktfs_free_pointer_slots(uint32_t ptr_blockno, uint32_t first) {
+    const uint32_t ptrs = KTFS_BLKSZ / POINTER_BYTESIZE;
+    uint32_t idxs[ptrs];
+    int ret = ktfs_read_data_block(ptr_blockno, idxs);
+    if (ret != KTFS_BLKSZ) return (ret < 0) ? ret : -EIO;
+
+    for (uint32_t i = first; i < ptrs; i++) {
+        if (idxs[i]) {
+            ret = ktfs_free_batch_add(idxs[i]);
             if (ret < 0) return ret;
         }
-        // then free the indirect block itself
-        ret = ktfs_bitmap_clear_bit(data_base + inode.indirect);
+    }
+
+    if (first > 0) {
+        uint32_t data_base = 1 + fs.sb.bitmap_block_count + fs.sb.inode_block_count;
+        void *bp;
+        ret = cache_get_block(fs.cache, (data_base + ptr_blockno) * KTFS_BLKSZ, &bp);
         if (ret < 0) return ret;
+        memset((uint32_t *)bp + first, 0, (ptrs - first) * POINTER_BYTESIZE);
+        cache_release_block(fs.cache, bp, 1);
+    }
+    return 0;
+}
+
+// Inputs:  struct ktfs_inode *inode - inode of the file being truncated
+//          uint32_t first - index of the first file block to free
+// Outputs: int - Returns 0 on success, or a negative failure
+// Description: Frees every data block at file index /first/ or above, along with any
+// indirect blocks that no longer map anything, and clears the pointers to them. Freeing
+// is batched, so the cost depends on the pointer blocks read rather than on the number
+// of data blocks freed. The caller writes the inode back.
+// Side Effects: Modifies pointer blocks and the bitmap through the cache
+static int ktfs_free_blocks_from(struct ktfs_inode *inode, uint32_t first) {
+    const uint32_t ptrs = KTFS_BLKSZ / POINTER_BYTESIZE;
+    uint32_t base;
+    int ret;
+
+    free_batch.cnt = 0;
+
+    // direct blocks
+    for (uint32_t i = first; i < KTFS_NUM_DIRECT_DATA_BLOCKS; i++) {
+        if (inode->block[i]) {
+            ret = ktfs_free_batch_add(inode->block[i]);
+            if (ret < 0) return ret;
+            inode->block[i] = 0;
+        }
     }
 
-    // freeing doubly-indirect blocks
-    for (int d = 0; d < KTFS_NUM_DINDIRECT_BLOCKS; d++) {
-        uint32_t d1_idxs[ptrs];
-        if (!inode.dindirect[d]) continue;
-        ret = ktfs_read_data_block(inode.dindirect[d], d1_idxs);
+    // single-indirect block
+    base = KTFS_NUM_DIRECT_DATA_BLOCKS;
+    if (inode->indirect && first < base + ptrs) {
+        uint32_t lo = (first > base) ? first - base : 0;
+        ret = ktfs_free_pointer_slots(inode->indirect, lo);
         if (ret < 0) return ret;
-        for (uint32_t i = 0; i < ptrs && d1_idxs[i]; i++) {
-            uint32_t d2_idxs[ptrs];
-            ret = ktfs_read_data_block(d1_idxs[i], d2_idxs);
+        if (lo == 0) {
+            ret = ktfs_free_batch_add(inode->indirect);
             if (ret < 0) return ret;
-            for (uint32_t j = 0; j < ptrs && d2_idxs[j]; j++) {
-                ret = ktfs_bitmap_clear_bit(data_base + d2_idxs[j]);
+            inode->indirect = 0;
+        }
+    }
+    base += ptrs;
+
+    // doubly-indirect blocks
+    for (int d = 0; d < KTFS_NUM_DINDIRECT_BLOCKS; d++, base += ptrs * ptrs) {
+        if (!inode->dindirect[d] || first >= base + ptrs * ptrs) continue;
+        uint32_t lo = (first > base) ? first - base : 0;
+        uint32_t level1[ptrs];
+        int changed = 0;
+        ret = ktfs_read_data_block(inode->dindirect[d], level1);
+        if (ret != KTFS_BLKSZ) return (ret < 0) ? ret : -EIO;
+        for (uint32_t i = lo / ptrs; i < ptrs; i++) {
+            if (!level1[i]) continue;
+            uint32_t sub_lo = (i == lo / ptrs) ? lo % ptrs : 0;
+            ret = ktfs_free_pointer_slots(level1[i], sub_lo);
+            if (ret < 0) return ret;
+            if (sub_lo == 0) {
+                ret = ktfs_free_batch_add(level1[i]);
                 if (ret < 0) return ret;
+                level1[i] = 0;
+                changed = 1;
             }
-            // free this level-1 indirect block
-            ret = ktfs_bitmap_clear_bit(data_base + d1_idxs[i]);
+        }
+        if (lo == 0) {
+            ret = ktfs_free_batch_add(inode->dindirect[d]);
+            if (ret < 0) return ret;
+            inode->dindirect[d] = 0;
+        } else if (changed) {
+            uint32_t data_base = 1 + fs.sb.bitmap_block_count + fs.sb.inode_block_count;
+            void *bp;
+            ret = cache_get_block(fs.cache, (data_base + inode->dindirect[d]) * KTFS_BLKSZ, &bp);
             if (ret < 0) return ret;
+            memcpy(bp, level1, KTFS_BLKSZ);
+            cache_release_block(fs.cache, bp, 1);
         }
-        // free the top-level doubly-indirect block
-        ret = ktfs_bitmap_clear_bit(data_base + inode.dindirect[d]);
-        if (ret < 0) return ret;
     }
-    return 0;
+
+    return ktfs_free_batch_flush();
+}
+
+// Inputs:  uint16_t inum -inode number of the file whose data block should be free 
+//Outputs: int - return 0 on success or negative erro on failure 
+//Description: free all data block associated with the given inode, inclding direct, indirect,
+// and doubly indirect blocks. It clear corresponding bits in the bit map.
+///side effect: This willl get the bit map and relesse allocated data block back to the system
+// and perform multiple disk read to the cache system.  
+static int ktfs_free_inode_blocks(uint16_t inum) {
+    struct ktfs_inode inode;
+    int ret = ktfs_read_inode(inum, &inode);
+    if (ret < 0) return ret;
+    return ktfs_free_blocks_from(&inode, 0);
 }
 
 
@@ -452,6 +629,540 @@ int get_blocknum_for_offset(struct ktfs_inode *inode, uint32_t file_block_index,
     }
     return -ENOENT;
 }
+
+// Inputs:  uint32_t ptr_blockno - data block number of the indirect block to modify
+//          uint32_t slot - index of the pointer within that block
+//          uint32_t value - new data block number to store in the slot
+// Outputs: int - Returns 0 on success, or a negative failure
+// Description: Updates a single pointer inside an indirect block through the cache.
+// Side Effects: Marks the indirect block dirty in the cache
+static int ktfs_write_pointer(uint32_t ptr_blockno, uint32_t slot, uint32_t value) {
+    uint32_t data_base = 1 + fs.sb.bitmap_block_count + fs.sb.inode_block_count;
+    void *bp;
+    int ret = cache_get_block(fs.cache, (data_base + ptr_blockno) * KTFS_BLKSZ, &bp);
+    if (ret < 0) return ret;
+    ((uint32_t *)bp)[slot] = value;
+    cache_release_block(fs.cache, bp, 1);
+    return 0;
+}
+
+// Inputs:  uint32_t *out_blockno - set to the data block number of the new pointer block
+// Outputs: int - Returns 0 on success, or a negative failure
+// Description: Allocates a data block to hold block pointers and zeroes it, so that
+// every slot reads back as "no block".
+// Side Effects: Modifies the bitmap and the new block through the cache
+static int ktfs_alloc_pointer_block(uint32_t *out_blockno) {
+    uint32_t data_base = 1 + fs.sb.bitmap_block_count + fs.sb.inode_block_count;
+    void *bp;
+    int ret = ktfs_alloc_data_block(out_blockno);
+    if (ret < 0) return ret;
+    ret = cache_get_block(fs.cache, (data_base + *out_blockno) * KTFS_BLKSZ, &bp);
+    if (ret < 0) {
+        ktfs_bitmap_clear_bit(data_base + *out_blockno);
+        return ret;
+    }
+    memset(bp, 0, KTFS_BLKSZ);
+    cache_release_block(fs.cache, bp, 1);
+    return 0;
+}
+
+// Inputs:  struct ktfs_inode *inode - inode whose block pointer is updated
+//          uint32_t file_block_index - index of the data block within the file
+//          uint32_t blockno - new data block number for that index
+// Outputs: int - Returns 0 on success, or a negative failure
+// Description: Counterpart of get_blocknum_for_offset. Direct pointers are changed in
+// the in-memory inode (the caller writes it back), indirect pointers are changed in place.
+// Indirect blocks missing on the path are allocated; a level-1 block that cannot be
+// linked in is freed again.
+// Side Effects: May allocate and modify indirect blocks through the cache
+static int ktfs_set_blocknum_for_offset(struct ktfs_inode *inode, uint32_t file_block_index, uint32_t blockno) {
+    const uint32_t ptrs_per_block = KTFS_BLKSZ / POINTER_BYTESIZE;
+    uint32_t data_base = 1 + fs.sb.bitmap_block_count + fs.sb.inode_block_count;
+    int ret;
+
+    if (file_block_index < KTFS_NUM_DIRECT_DATA_BLOCKS) {
+        inode->block[file_block_index] = blockno;
+        return 0;
+    }
+
+    file_block_index -= KTFS_NUM_DIRECT_DATA_BLOCKS;
+
+    if (file_block_index < ptrs_per_block) {
+        if (inode->indirect == 0) {
+            uint32_t ptrblk;
+            ret = ktfs_alloc_pointer_block(&ptrblk);
+            if (ret < 0) return ret;
+            inode->indirect = ptrblk;
+        }
+        return ktfs_write_pointer(inode->indirect, file_block_index, blockno);
+    }
+
+    file_block_index -= ptrs_per_block;
+    const uint32_t blocks_per_dindirect = ptrs_per_block * ptrs_per_block;
+
+    for (int i = 0; i < KTFS_NUM_DINDIRECT_BLOCKS; i++) {
+        if (file_block_index < blocks_per_dindirect) {
+            if (inode->dindirect[i] == 0) {
+                uint32_t ptrblk;
+                ret = ktfs_alloc_pointer_block(&ptrblk);
+                if (ret < 0) return ret;
+                inode->dindirect[i] = ptrblk;
+            }
+            uint32_t level1[ptrs_per_block];
+            ret = ktfs_read_data_block(inode->dindirect[i], level1);
+            if (ret != KTFS_BLKSZ) return -EIO;
+            uint32_t l1_index = file_block_index / ptrs_per_block;
+            if (level1[l1_index] == 0) {
+                ret = ktfs_alloc_pointer_block(&level1[l1_index]);
+                if (ret < 0) return ret;
+                ret = ktfs_write_pointer(inode->dindirect[i], l1_index, level1[l1_index]);
+                if (ret < 0) {
+                    // nothing points at the new block yet, so give it back
+                    ktfs_bitmap_clear_bit(data_base + level1[l1_index]);
+                    return ret;
+                }
+            }
+            return ktfs_write_pointer(level1[l1_index], file_block_index % ptrs_per_block, blockno);
+        }
+        file_block_index -= blocks_per_dindirect;
+    }
+    return -ENODATABLKS;
+}
+
+// Inputs:  uint32_t count - number of consecutive data blocks wanted
+//          uint32_t *out_blockno - set to the first data block number of the run
+// Outputs: int - Returns 0 on success, -ENODATABLKS if no run is long enough,
+//          or a negative error from the cache
+// Description: Finds the first run of /count/ free data blocks in the bitmap and marks
+// the whole run used. Each bitmap block is fetched once per pass instead of once per bit.
+// If marking fails part way, the bits already set are cleared again.
+// Side Effects: Modifies the bitmap blocks through the cache
+static int ktfs_alloc_data_run(uint32_t count, uint32_t *out_blockno) {
+    uint32_t data_base = 1 + fs.sb.bitmap_block_count + fs.sb.inode_block_count;
+    uint32_t bits_per_blk = KTFS_BLKSZ * 8;
+    uint32_t run_start = 0;
+    uint32_t run_len = 0;
+    uint32_t cur_blk = 0;
+    void *bp = NULL;
+    int ret;
+
+    if (count == 0) return -EINVAL;
+
+    // data block 0 is the root directory and 0 means "no block", so start at 1
+    for (uint32_t idx = data_base + 1; idx < fs.sb.block_count; idx++) {
+        uint32_t bm_blk = 1 + (idx / bits_per_blk);
+        uint32_t off = idx % bits_per_blk;
+        if (bp == NULL || bm_blk != cur_blk) {
+            if (bp) cache_release_block(fs.cache, bp, 0);
+            ret = cache_get_block(fs.cache, bm_blk * KTFS_BLKSZ, &bp);
+            if (ret < 0) return ret;
+            cur_blk = bm_blk;
+        }
+        if (((uint8_t *)bp)[off/8] & (1 << (off % 8))) {
+            run_len = 0; // used block breaks the run
+            continue;
+        }
+        if (run_len++ == 0) run_start = idx;
+        if (run_len == count) break;
+    }
+    if (bp) cache_release_block(fs.cache, bp, 0);
+    if (run_len < count) return -ENODATABLKS;
+
+    // second pass marks the run used
+    bp = NULL;
+    for (uint32_t idx = run_start; idx < run_start + count; idx++) {
+        uint32_t bm_blk = 1 + (idx / bits_per_blk);
+        uint32_t off = idx % bits_per_blk;
+        if (bp == NULL || bm_blk != cur_blk) {
+            if (bp) cache_release_block(fs.cache, bp, 1);
+            ret = cache_get_block(fs.cache, bm_blk * KTFS_BLKSZ, &bp);
+            if (ret < 0) {
+                // give back the part of the run already marked
+                for (uint32_t j = run_start; j < idx; j++)
+                    ktfs_bitmap_clear_bit(j);
+                return ret;
+            }
+            cur_blk = bm_blk;
+        }
+        ((uint8_t *)bp)[off/8] |= (1 << (off % 8));
+    }
+    cache_release_block(fs.cache, bp, 1);
+
+    *out_blockno = run_start - data_base;
+    return 0;
+}
+
+// Inputs:  uint32_t src - data block number to copy from
+//          uint32_t dst - data block number to copy to
+// Outputs: int - Returns 0 on success, or a negative failure
+// Description: Copies the contents of one data block to another through the cache.
+// Side Effects: The destination block is marked dirty in the cache
+static int ktfs_copy_data_block(uint32_t src, uint32_t dst) {
+    uint32_t data_base = 1 + fs.sb.bitmap_block_count + fs.sb.inode_block_count;
+    char buf[KTFS_BLKSZ];
+    void *bp;
+    int ret = ktfs_read_data_block(src, buf);
+    if (ret != KTFS_BLKSZ) return (ret < 0) ? ret : -EIO;
+    ret = cache_get_block(fs.cache, (data_base + dst) * KTFS_BLKSZ, &bp);
+    if (ret < 0) return ret;
+    memcpy(bp, buf, KTFS_BLKSZ);
+    cache_release_block(fs.cache, bp, 1);
+    return 0;
+}
+
+// Inputs:  struct ktfs_inode *inode - inode of the file to inspect
+//          uint32_t *out_count - set to the number of mapped data blocks
+// Outputs: int - Returns 0 on success, or a negative failure
+// Description: Blocks are always mapped as a prefix of the file, but preallocation can
+// map blocks past the end of the file. This counts the whole mapped prefix.
+// Side Effects: Reads indirect blocks through the cache
+static int ktfs_mapped_block_count(struct ktfs_inode *inode, uint32_t *out_count) {
+    uint32_t count = (inode->size + KTFS_BLKSZ - 1) / KTFS_BLKSZ;
+    uint32_t blkno;
+    int ret;
+    while (count < KTFS_MAX_FILE_BLOCKS) {
+        ret = get_blocknum_for_offset(inode, count, &blkno);
+        if (ret == -ENOENT) break;
+        if (ret < 0) return ret;
+        count++;
+    }
+    *out_count = count;
+    return 0;
+}
+
+// Inputs:  struct ktfs_inode *inode - inode of the file being grown
+//          uint32_t nblocks - number of blocks that must be mapped from the start of the file
+// Outputs: int - Returns 0 on success, or a negative failure
+// Description: Maps any missing blocks below /nblocks/. The missing blocks are taken as
+// one contiguous run when the bitmap has one, and one at a time otherwise. They are not
+// zeroed: the inode's initialized mark is kept below them, so they read as zeros until
+// written. The caller writes the inode back, also on failure, since direct pointers may
+// already have been set.
+// Side Effects: Allocates data and indirect blocks, modifies the bitmap
+static int ktfs_reserve_blocks(struct ktfs_inode *inode, uint32_t nblocks) {
+    uint32_t data_base = 1 + fs.sb.bitmap_block_count + fs.sb.inode_block_count;
+    uint32_t mapped;
+    uint32_t start;
+    uint32_t blkno;
+    int contiguous;
+    int ret;
+
+    if (nblocks > KTFS_MAX_FILE_BLOCKS) return -ENODATABLKS;
+    ret = ktfs_mapped_block_count(inode, &mapped);
+    if (ret < 0) return ret;
+    if (mapped >= nblocks) return 0;
+    if (ktfs_init_blocks(inode) > mapped)
+        ktfs_set_init_blocks(inode, mapped);
+
+    ret = ktfs_alloc_data_run(nblocks - mapped, &start);
+    contiguous = (ret == 0);
+    if (ret < 0 && ret != -ENODATABLKS) return ret;
+
+    for (uint32_t i = mapped; i < nblocks; i++) {
+        if (contiguous) {
+            blkno = start + (i - mapped);
+        } else {
+            ret = ktfs_alloc_data_block(&blkno);
+            if (ret < 0) return ret;
+        }
+        if (ret == 0)
+            ret = ktfs_set_blocknum_for_offset(inode, i, blkno);
+        if (ret < 0) {
+            // release this block and, for a run, the rest of it
+            uint32_t last = contiguous ? start + (nblocks - mapped) : blkno + 1;
+            for (uint32_t b = blkno; b < last; b++)
+                ktfs_bitmap_clear_bit(data_base + b);
+            return ret;
+        }
+    }
+    return 0;
+}
+
+// Inputs:  const struct ktfs_inode *inode - inode of the file
+// Outputs: uint32_t - number of blocks from the start of the file that have been written
+// Description: Blocks at or past the returned count are unwritten and read as zeros. An
+// inode without the mark has every mapped block written, so KTFS_MAX_FILE_BLOCKS is
+// returned for it.
+// Side Effects: None
+static uint32_t ktfs_init_blocks(const struct ktfs_inode *inode) {
+    if (inode->flags & KTFS_INODE_INITMARK)
+        return inode->flags >> KTFS_INODE_INIT_SHIFT;
+    return KTFS_MAX_FILE_BLOCKS;
+}
+
+// Inputs:  struct ktfs_inode *inode - inode of the file
+//          uint32_t count - number of blocks from the start of the file that have been written
+// Outputs: None
+// Description: Records the initialized mark in the inode's flags. The caller writes the
+// inode back.
+// Side Effects: Modifies the inode in memory
+static void ktfs_set_init_blocks(struct ktfs_inode *inode, uint32_t count) {
+    inode->flags = (inode->flags & ((1U << KTFS_INODE_INIT_SHIFT) - 1)) |
+        KTFS_INODE_INITMARK | (count << KTFS_INODE_INIT_SHIFT);
+}
+
+// Inputs:  struct ktfs_inode *inode - inode of the file
+//          uint32_t first - first file block to zero
+//          uint32_t last - file block to stop at (not zeroed)
+// Outputs: int - Returns 0 on success, or a negative failure
+// Description: Zeroes the mapped file blocks [first, last) through cache_zero, one request
+// per run of physically consecutive blocks.
+// Side Effects: Writes zeros to the device, drops cached copies of the blocks
+static int ktfs_zero_file_blocks(struct ktfs_inode *inode, uint32_t first, uint32_t last) {
+    uint32_t data_base = 1 + fs.sb.bitmap_block_count + fs.sb.inode_block_count;
+    uint32_t run_start = 0;
+    uint32_t run_len = 0;
+    uint32_t blkno;
+    int ret;
+
+    for (uint32_t i = first; i < last; i++) {
+        ret = get_blocknum_for_offset(inode, i, &blkno);
+        if (ret < 0) return ret;
+        if (run_len != 0 && blkno == run_start + run_len) {
+            run_len++;
+            continue;
+        }
+        ret = cache_zero(fs.cache, (unsigned long long)(data_base + run_start) * KTFS_BLKSZ, run_len);
+        if (ret < 0) return ret;
+        run_start = blkno;
+        run_len = 1;
+    }
+    return cache_zero(fs.cache, (unsigned long long)(data_base + run_start) * KTFS_BLKSZ, run_len);
+}
+
+// Inputs:  struct ktfs_file *file - open file to reserve space for
+//          unsigned long long len - number of bytes from the start of the file to back with blocks
+// Outputs: int - Returns 0 on success, or a negative failure
+// Description: Reserves blocks for the first /len/ bytes without changing the file size,
+// so later writes that grow the file land in blocks that are already allocated and
+// (when space allows) contiguous. Reserved blocks are unwritten rather than zeroed on the
+// device, so extending the size over them reads zeros and never exposes old data.
+// Side Effects: Allocates data and indirect blocks, writes the inode
+static int ktfs_prealloc(struct ktfs_file *file, unsigned long long len) {
+    struct ktfs_inode inode;
+    int ret = ktfs_read_inode(file->inode_num, &inode);
+    if (ret < 0) return ret;
+    if (len > (unsigned long long)KTFS_MAX_FILE_BLOCKS * KTFS_BLKSZ) return -ENODATABLKS;
+    ret = ktfs_reserve_blocks(&inode, (len + KTFS_BLKSZ - 1) / KTFS_BLKSZ);
+    int wret = ktfs_write_inode(file->inode_num, &inode);
+    return (ret < 0) ? ret : wret;
+}
+
+// Inputs:  struct ktfs_inode *inode - inode of the file to inspect
+//          unsigned int *out_score - set to the fragmentation score
+// Outputs: int - Returns 0 on success, or a negative failure
+// Description: Walks the data blocks of a file and counts how many times the next
+// block is not physically adjacent to the previous one. A score of 0 means the file
+// is one contiguous extent; every additional extent adds one to the score.
+// Side Effects: Reads indirect blocks through the cache
+static int ktfs_frag_score(struct ktfs_inode *inode, unsigned int *out_score) {
+    uint32_t nblocks;
+    unsigned int score = 0;
+    uint32_t prev = 0;
+    int ret = ktfs_mapped_block_count(inode, &nblocks);
+    if (ret < 0) return ret;
+    for (uint32_t i = 0; i < nblocks; i++) {
+        uint32_t cur;
+        ret = get_blocknum_for_offset(inode, i, &cur);
+        if (ret < 0) return ret;
+        if (i > 0 && cur != prev + 1) score++;
+        prev = cur;
+    }
+    *out_score = score;
+    return 0;
+}
+
+// Inputs:  struct ktfs_file *file - open file to defragment
+// Outputs: int - Returns 0 on success (including when the file is already contiguous),
+//          -ENODATABLKS if there is no free run large enough, or a negative failure
+// Description: Moves the data blocks of a file into a single contiguous run. Each block
+// is copied into the new run before its pointer is switched, then the old block is freed
+// (and discarded) through the free batch.
+// The caller holds fs_lock, so readers and writers never observe a half-moved file.
+// Indirect blocks themselves are not moved.
+// Side Effects: Allocates and frees data blocks, rewrites block pointers and the inode
+static int ktfs_defrag_file(struct ktfs_file *file) {
+    struct ktfs_inode inode;
+    unsigned int score;
+    uint32_t nblocks;
+    uint32_t start;
+    uint32_t i;
+    int ret;
+
+    ret = ktfs_read_inode(file->inode_num, &inode);
+    if (ret < 0) return ret;
+    ret = ktfs_frag_score(&inode, &score);
+    if (ret < 0) return ret;
+    if (score == 0) return 0; // already contiguous
+
+    ret = ktfs_mapped_block_count(&inode, &nblocks);
+    if (ret < 0) return ret;
+    ret = ktfs_alloc_data_run(nblocks, &start);
+    if (ret < 0) return ret;
+
+    for (i = 0; i < nblocks; i++) {
+        uint32_t old;
+        ret = get_blocknum_for_offset(&inode, i, &old);
+        if (ret < 0) break;
+        ret = ktfs_copy_data_block(old, start + i);
+        if (ret < 0) break;
+        ret = ktfs_set_blocknum_for_offset(&inode, i, start + i);
+        if (ret < 0) break;
+        ret = ktfs_free_batch_add(old);
+        if (ret < 0) {
+            i++; // start + i is in use now
+            break;
+        }
+    }
+
+    // on failure, give back the part of the run that was never used
+    if (ret < 0) {
+        for (uint32_t j = i; j < nblocks; j++)
+            ktfs_free_batch_add(start + j);
+    }
+
+    // direct pointers live in the inode, so write it back even on partial failure,
+    // and only then free the blocks it no longer points to
+    int wret = ktfs_write_inode(file->inode_num, &inode);
+    int fret = ktfs_free_batch_flush();
+    if (ret < 0) return ret;
+    return (wret < 0) ? wret : fret;
+}
+
+// Inputs:  const char *name - file name to look up in the root directory
+//          uint16_t *out_inum - set to the inode number of the file
+// Outputs: int - Returns 0 on success, -ENOENT if not found, or a negative failure
+// Description: Searches the root directory entries for /name/. Deletes leave holes, so
+// every directory block is scanned and empty entries (inode 0) are skipped. The first
+// block is always scanned, as the root directory may live in data block 0. Caller
+// holds fs_lock.
+// Side Effects: Reads the root directory through the cache
+static int ktfs_lookup(const char *name, uint16_t *out_inum) {
+    struct ktfs_inode root_inode;
+    struct ktfs_dir_entry dentries[KTFS_BLKSZ / KTFS_DENSZ];
+    int ret = ktfs_read_inode(fs.sb.root_directory_inode, &root_inode);
+    if (ret < 0) return ret;
+
+    for (uint32_t i = 0; i < KTFS_NUM_DIRECT_DATA_BLOCKS; i++) {
+        if (i > 0 && root_inode.block[i] == 0) continue; // skipping unused blocks
+        ret = ktfs_read_data_block(root_inode.block[i], dentries);
+        if (ret < 0) return ret;
+        for (uint32_t j = 0; j < KTFS_BLKSZ / KTFS_DENSZ; j++) {
+            if (dentries[j].inode != 0 && strcmp(dentries[j].name, name) == 0) {
+                *out_inum = dentries[j].inode;
+                return 0;
+            }
+        }
+    }
+    return -ENOENT;
+}
+
+
+#ifdef WITH_KTFS_PREFETCH
+
+// Boot prefetch list. The first KTFS_PREFETCH_MAX distinct blocks that miss in the cache
+// after mount, or are first used after being prefetched, are written to a reserved file.
+// On the next mount the list is sorted, coalesced into runs and read into the cache in
+// large batches. Counting prefetched blocks keeps the list from emptying every other boot.
+
+#define KTFS_PREFETCH_NAME ".prefetch"
+#define KTFS_PREFETCH_MAX CACHE_CAPACITY // more would just evict itself
+
+static uint64_t prefetch_log[KTFS_PREFETCH_MAX]; // block numbers missed (or prefetched and used) since mount
+static int prefetch_saved; // list is only written once per boot
+
+
+// Inputs:  None
+// Outputs: None
+// Description: Reads the prefetch list saved on the previous boot, sorts it, and loads
+// each run of consecutive blocks into the cache with one batched read. A missing or
+// empty list is not an error.
+// Side Effects: Fills the cache from the backing device
+static void ktfs_prefetch_load(void) {
+    uint32_t list[KTFS_BLKSZ / sizeof(uint32_t)];
+    struct ktfs_inode inode;
+    uint16_t inum;
+    int cnt;
+
+    if (ktfs_lookup(KTFS_PREFETCH_NAME, &inum) < 0) return;
+    if (ktfs_read_inode(inum, &inode) < 0 || inode.size == 0) return;
+    if (ktfs_read_data_block(inode.block[0], list) != KTFS_BLKSZ) return;
+
+    cnt = inode.size / sizeof(uint32_t);
+    if (cnt > KTFS_PREFETCH_MAX) cnt = KTFS_PREFETCH_MAX;
+
+    // insertion sort, the list is short
+    for (int i = 1; i < cnt; i++) {
+        uint32_t key = list[i];
+        int j = i - 1;
+        while (j >= 0 && list[j] > key) {
+            list[j+1] = list[j];
+            j--;
+        }
+        list[j+1] = key;
+    }
+
+    for (int i = 0; i < cnt; ) {
+        int j = i + 1;
+        while (j < cnt && list[j] == list[j-1] + 1) j++;
+        if (list[i] < fs.sb.block_count && list[j-1] < fs.sb.block_count)
+            cache_prefetch(fs.cache, (unsigned long long)list[i] * KTFS_BLKSZ, j - i);
+        // skip duplicates of the run's last block
+        while (j < cnt && list[j] == list[j-1]) j++;
+        i = j;
+    }
+}
+
+// Inputs:  None
+// Outputs: int - Returns 0 on success, or a negative failure
+// Description: Stops recording and writes the blocks missed since mount to the prefetch
+// file, creating it if needed. Runs at most once per boot. Caller holds fs_lock.
+// Side Effects: May create a file, allocates a block, writes through the cache
+static int ktfs_prefetch_save(void) {
+    struct ktfs_inode inode;
+    uint16_t inum;
+    void *bp;
+    int cnt;
+    int ret;
+
+    if (prefetch_saved) return 0;
+    cnt = cache_trace_count(fs.cache);
+    if (cnt == 0) return 0;
+    prefetch_saved = 1;
+    // stop before our own metadata updates show up in the list
+    cache_trace(fs.cache, NULL, 0);
+
+    ret = ktfs_lookup(KTFS_PREFETCH_NAME, &inum);
+    if (ret == -ENOENT) {
+        ret = ktfs_create_locked(KTFS_PREFETCH_NAME);
+        if (ret == 0) ret = ktfs_lookup(KTFS_PREFETCH_NAME, &inum);
+    }
+    if (ret < 0) return ret;
+
+    ret = ktfs_read_inode(inum, &inode);
+    if (ret < 0) return ret;
+    ret = ktfs_reserve_blocks(&inode, 1);
+    if (ret < 0) {
+        ktfs_write_inode(inum, &inode);
+        return ret;
+    }
+    if (ktfs_init_blocks(&inode) < 1)
+        ktfs_set_init_blocks(&inode, 1); // written in full below
+
+    uint32_t data_base = 1 + fs.sb.bitmap_block_count + fs.sb.inode_block_count;
+    ret = cache_get_block(fs.cache, (data_base + inode.block[0]) * KTFS_BLKSZ, &bp);
+    if (ret < 0) return ret;
+    memset(bp, 0, KTFS_BLKSZ);
+    for (int i = 0; i < cnt; i++)
+        ((uint32_t *)bp)[i] = prefetch_log[i];
+    cache_release_block(fs.cache, bp, 1);
+
+    inode.size = cnt * sizeof(uint32_t);
+    return ktfs_write_inode(inum, &inode);
+}
+
+#endif // WITH_KTFS_PREFETCH
+
 // EXPORTED FUNCTION DEFINITIONS
 // Inputs: struct io *io - it will point to the I/O intrerface representation the backing storage device
 // Outputs: int - Returns 0 on success, or a negative failure
@@ -469,8 +1180,13 @@ int ktfs_mount(struct io * io) {
     lock_init(&fs.fs_lock);
     // at reference and store into struct
     fs.bdev = ioaddref(io);
-    // create the cache here
-    int rc = create_cache(fs.bdev, &fs.cache);
+    // schedule block I/O through an elevator, and cache on top of it
+    struct io * eio;
+    int rc = create_elevator(fs.bdev, &elevator_clook, &eio);
+    if (rc < 0)
+        return rc;
+    rc = create_cache(eio, &fs.cache);
+    ioclose(eio); // the cache holds its own reference
     if (rc < 0) 
         return rc;
     // reading superblock into buffer
@@ -484,6 +1200,11 @@ int ktfs_mount(struct io * io) {
     if (fs.sb.block_count == 0 || fs.sb.bitmap_block_count == 0 || fs.sb.inode_block_count == 0) {
         return -EINVAL;
     }
+#ifdef WITH_KTFS_PREFETCH
+    // warm the cache from the last boot's list, then record this boot's
+    ktfs_prefetch_load();
+    cache_trace(fs.cache, prefetch_log, KTFS_PREFETCH_MAX);
+#endif
     return 0;
 }
 
@@ -491,7 +1212,7 @@ int ktfs_mount(struct io * io) {
 // Inputs: const char *name - name of the file to the opened in the file root directory
 // struct io **ioptr - the output pointer that will be set to the I/O object to the opened files
 // Outputs: int - Returns 0 on success, or a negative failure
-// Description: Searches the root directory for a file matching to the given name. If it found read the inode allocate the file structure,
+// Description: Looks up the given name in the root directory (ktfs_lookup). If it found read the inode allocate the file structure,
 // and intializes its interface with function pointer for reading, closing, and control. Sets to the caller's ioptr to the point to this I/O object.  
 // Side Effects: it may perfrom multiple block read from the backing device, allocate memory for the file structure,
 //and acquires for the global file lock.
@@ -510,73 +1231,45 @@ int ktfs_open(const char * name, struct io ** ioptr) {
     // }
 
     lock_acquire(&fs.fs_lock);
-    // read root inode
-    struct ktfs_inode root_inode;
-    int ret = ktfs_read_inode(fs.sb.root_directory_inode, &root_inode);
+    // find the file in the root directory
+    uint16_t inum;
+    int ret = ktfs_lookup(name, &inum);
     if (ret < 0){
         lock_release(&fs.fs_lock); 
         return ret;
-    } //fail
-
-
-    // iterate through direct data blocks to find the file
-    struct ktfs_dir_entry dentries[KTFS_BLKSZ / KTFS_DENSZ]; //buffer to store entries in single data block
- 
-
-
-    for (int i = 0; i < KTFS_NUM_DIRECT_DATA_BLOCKS; i++) { //each direct data block pointer has own data block of dentries
-        if (root_inode.block[i] == 0 && root_inode.block[0] != 0) continue; // skipping unused blocks
-
-
-        ret = ktfs_read_data_block(root_inode.block[i], dentries);
-        if (ret < 0){
-            lock_release(&fs.fs_lock); 
-            return ret;
-        } //fail
-
+    } //fail or file not found
 
-        for (int j = 0; j < KTFS_BLKSZ / KTFS_DENSZ; j++) { // looping over each dentry
 
-
-            if (strcmp(dentries[j].name, name) == 0) { //comparing the name to parsed name
-                // found the file, now load its inode
-                kprintf("found file\n");
-                struct ktfs_inode file_inode;
-                ret = ktfs_read_inode(dentries[j].inode, &file_inode); // save inode to driver
-                if (ret < 0){
-                    lock_release(&fs.fs_lock); 
-                    return ret;
-                } //fail
-
-
-                // allocate a ktfs_file and initialize
-                struct ktfs_file *file = kcalloc(1, sizeof(struct ktfs_file));
-                file->inode_num = dentries[j].inode;
-                file->size = file_inode.size;
-                file->flags = KTFS_FILE_IN_USE;
+    // found the file, now load its inode
+    kprintf("found file\n");
+    struct ktfs_inode file_inode;
+    ret = ktfs_read_inode(inum, &file_inode); // save inode to driver
+    if (ret < 0){
+        lock_release(&fs.fs_lock); 
+        return ret;
+    } //fail
 
 
-                // assigning the io abstraction
-                static const struct iointf file_intf = {
-                    .readat = ktfs_readat,
-                    .cntl = ktfs_cntl,
-                    .close = ktfs_close,
-                    .writeat = ktfs_writeat
-                };
+    // allocate a ktfs_file and initialize
+    struct ktfs_file *file = kcalloc(1, sizeof(struct ktfs_file));
+    file->inode_num = inum;
+    file->size = file_inode.size;
+    file->flags = KTFS_FILE_IN_USE;
 
 
-                ioinit1(&file->io, &file_intf);
-                *ioptr = create_seekable_io(&file->io); // io pointer to be updated to the file io object we created
-                lock_release(&fs.fs_lock);
-                return 0;
-            }
-        }
-    }
+    // assigning the io abstraction
+    static const struct iointf file_intf = {
+        .readat = ktfs_readat,
+        .cntl = ktfs_cntl,
+        .close = ktfs_close,
+        .writeat = ktfs_writeat
+    };
 
 
-    // File not found
+    ioinit1(&file->io, &file_intf);
+    *ioptr = create_seekable_io(&file->io); // io pointer to be updated to the file io object we created
     lock_release(&fs.fs_lock);
-    return -ENOENT;
+    return 0;
 }
 // Inputs:  struct io *io - this will pont to the I/O object with the open files
 // Outputs: None
@@ -591,6 +1284,14 @@ void ktfs_close(struct io* io) {
         struct ktfs_file *file = (struct ktfs_file *)((char *)io - offsetof(struct ktfs_file, io));
         file->flags = KTFS_FILE_FREE;  // Clear the in-use flag
 
+#ifdef WITH_KTFS_PREFETCH
+        // save the boot list once it is full (e.g. after the shell image is loaded)
+        lock_acquire(&fs.fs_lock);
+        if (cache_trace_count(fs.cache) >= KTFS_PREFETCH_MAX)
+            ktfs_prefetch_save();
+        lock_release(&fs.fs_lock);
+#endif
+
 
         // freeing the memory
         kfree(file);
@@ -639,9 +1340,11 @@ long ktfs_readat(struct io* io, unsigned long long pos, void * buf, long len) {
     }
 
 
-    // create out buffer for read
-    char blkbuf[KTFS_BLKSZ];
+    // data is copied from the cached block straight into buf, which may be user memory
+    uint32_t data_base = 1 + fs.sb.bitmap_block_count + fs.sb.inode_block_count;
+    void *blk;
     long total_read = 0;
+    uint32_t init_blocks = ktfs_init_blocks(&inode); // blocks past these are unwritten
 
 
     while (total_read < len) {
@@ -657,6 +1360,15 @@ long ktfs_readat(struct io* io, unsigned long long pos, void * buf, long len) {
             to_copy = bytes_left; // bytes from the offset to the end, tocopy = bytes_left
 
 
+        if (block_idx >= init_blocks) { // unwritten, nothing to read from the device
+            static const char zero_block[KTFS_BLKSZ];
+            ret = memcpy_nofault((char*)buf + total_read, zero_block, to_copy);
+            if (ret < 0)
+                break;
+            total_read += to_copy;
+            continue;
+        }
+
         uint32_t phys_blockno;
         ret = get_blocknum_for_offset(&inode, block_idx, &phys_blockno); // retriece block number of where data is in file
         if (ret < 0){
@@ -665,17 +1377,22 @@ long ktfs_readat(struct io* io, unsigned long long pos, void * buf, long len) {
         } //failed, return
 
 
-        ret = ktfs_read_data_block(phys_blockno, blkbuf); // read from the data block (entire 512 bytes)
-        if (ret != KTFS_BLKSZ){
+        ret = cache_get_block(fs.cache, (uint64_t)(data_base + phys_blockno) * KTFS_BLKSZ, &blk); // get the data block from the cache
+        if (ret < 0){
             lock_release(&fs.fs_lock); 
             return -EIO;
         } // fail
 
 
-        memcpy((char*)buf + total_read, blkbuf + block_offset, to_copy); // copy data into buffer, by "to_copy" chunks
+        ret = memcpy_nofault((char*)buf + total_read, (char*)blk + block_offset, to_copy); // copy data into buffer, by "to_copy" chunks
+        cache_release_block(fs.cache, blk, 0);
+        if (ret < 0)
+            break; // bad buffer: return what was read, or -EFAULT
         total_read += to_copy; // update how much we read
     }
     lock_release(&fs.fs_lock);
+    if (total_read == 0 && ret < 0)
+        return ret;
     return total_read; // return how much we read
 }
 // Inputs: struct io *io - it will pointer to the I/O object to the open file
@@ -685,6 +1402,7 @@ long ktfs_readat(struct io* io, unsigned long long pos, void * buf, long len) {
 //and return invalid argument and unsupported command
 // Description: Handles control request on file I/O object. Supports  retrieving the blcok size of the file system
 //and the size fo the file in the bytes to the local style commands.
+// IOCTL_GETFRAG reports the fragmentation score and IOCTL_DEFRAG moves the file into one extent.
 // Side Effects: It write to the memory poniter to the argument if the command and acqurire and release the global file system lock.  
 int ktfs_cntl(struct io *io, int cmd, void *arg) {
     if (!io) return -EINVAL;
@@ -708,6 +1426,22 @@ int ktfs_cntl(struct io *io, int cmd, void *arg) {
             ret = ktfs_set_end(file, new_end);
         }
         break;
+    case IOCTL_PREALLOC:
+        if (!arg) ret = -EINVAL;
+        else ret = ktfs_prealloc(file, *(unsigned long long *)arg);
+        break;
+    case IOCTL_GETFRAG:
+        if (!arg) {
+            ret = -EINVAL;
+        } else {
+            struct ktfs_inode inode;
+            ret = ktfs_read_inode(file->inode_num, &inode);
+            if (ret == 0) ret = ktfs_frag_score(&inode, (unsigned int *)arg);
+        }
+        break;
+    case IOCTL_DEFRAG:
+        ret = ktfs_defrag_file(file);
+        break;
     default:
         ret = -ENOTSUP;
     }
@@ -726,8 +1460,12 @@ int ktfs_flush(void) {
 
 
     int ret = 0;
+#ifdef WITH_KTFS_PREFETCH
+    if (fs.cache != NULL)
+        ktfs_prefetch_save(); // best effort, a lost list only costs boot time
+#endif
     if (fs.cache != NULL) { //if cache exists, we will flusht to device
-        ret = cache_flush(fs.cache);
+        ret = cache_sync(fs.cache);
     }
 
 
@@ -751,7 +1489,8 @@ long ktfs_writeat(struct io *io, unsigned long long pos, const void *buf, long l
         lock_release(&fs.fs_lock);
         return -EINVAL;
     }
-  //if the writing past it, it will grow the file 
+ //if the writing past it, it will grow the file. New blocks are unwritten (see ktfs.h);
+ //writing one zeroes only the parts the write does not cover.
     unsigned long long end_pos = pos + len;
     if (end_pos > file->size) {
         int e2 = ktfs_set_end(file, end_pos);
@@ -767,7 +1506,20 @@ long ktfs_writeat(struct io *io, unsigned long long pos, const void *buf, long l
         lock_release(&fs.fs_lock); 
         return ret; 
     }
+    // the write moves the initialized mark past its last block, so unwritten blocks it
+    // skips over are zeroed first
+    uint32_t fresh = ktfs_init_blocks(&inode); // first unwritten block
+    uint32_t first_written = pos / KTFS_BLKSZ;
+    uint32_t end_written = (len != 0) ? (end_pos - 1) / KTFS_BLKSZ + 1 : 0; // past the last block
+    if (end_written > fresh && first_written > fresh) {
+        ret = ktfs_zero_file_blocks(&inode, fresh, first_written);
+        if (ret < 0) {
+            lock_release(&fs.fs_lock);
+            return ret;
+        }
+    }
     long total = 0;
+    uint32_t init_end = fresh; // blocks below this now hold data or zeros
     while (total < len) {
         uint64_t cur = pos + total;   //current write postion 
         uint32_t bidx = cur / KTFS_BLKSZ; ///block index 
@@ -777,24 +1529,41 @@ long ktfs_writeat(struct io *io, unsigned long long pos, const void *buf, long l
         if (to > left) to = left;         // clamp to the remaining bytes 
         uint32_t phys;
         ret = get_blocknum_for_offset(&inode, bidx, &phys);
-        if (ret < 0) { 
-            lock_release(&fs.fs_lock); 
-            return ret; 
-        }
+        if (ret < 0)
+            break;
         void *blk;
         ///calculate the bytes offset in the device 
         uint64_t disk_off = (1 + fs.sb.bitmap_block_count + fs.sb.inode_block_count + phys) * KTFS_BLKSZ; //it wil get the physicla block 
         ret = cache_get_block(fs.cache, disk_off, &blk); // fetch the cache
-        if (ret < 0) { 
-            lock_release(&fs.fs_lock); 
-            return ret; 
+        if (ret < 0)
+            break;
+        // an unwritten block gets zeros wherever the write does not reach
+        if (bidx >= fresh) {
+            memset(blk, 0, boff);
+            memset((char *)blk + boff + to, 0, KTFS_BLKSZ - boff - to);
         }
-        // this will copy the data into the block and mark it dirty 
-        memcpy((char *)blk + boff, (char *)buf + total, to);
+        // this will copy the data (possibly from user memory) into the block and mark it dirty 
+        ret = memcpy_nofault((char *)blk + boff, (const char *)buf + total, to);
+        if (ret < 0 && bidx >= fresh)
+            memset((char *)blk + boff, 0, to); // the copy may have stopped part way
         cache_release_block(fs.cache, blk, 1); //release the block as dirty
+        if (bidx >= fresh)
+            init_end = bidx + 1;
+        if (ret < 0)
+            break; // bad buffer: a short write, or -EFAULT
         total += to;
     }
+    if (init_end > fresh) {
+        ktfs_set_init_blocks(&inode, init_end);
+        int wret = ktfs_write_inode(file->inode_num, &inode);
+        if (wret < 0) {
+            lock_release(&fs.fs_lock);
+            return wret;
+        }
+    }
     lock_release(&fs.fs_lock);
+    if (total == 0 && ret < 0)
+        return ret;
     return total; //it will return the total bytes written
 }
 // Inputs:  const char* name - Null-terminated name of the new file to create in the root directory
@@ -802,34 +1571,30 @@ long ktfs_writeat(struct io *io, unsigned long long pos, const void *buf, long l
 // Description: Creates a new empty file with the given name in the KTFS root directory.
 //              Allocates an inode, updates the directory entry, and initializes on-disk metadata.
 // Side Effects: Allocates a new inode and possibly a new directory data block and
-// modifies the inode and block bitmap and updates root directory metadata 
-int ktfs_create(const char* name) {
+// modifies the inode and block bitmap and updates root directory metadata.
+// The caller holds the global file system lock.
+static int ktfs_create_locked(const char* name) {
     if (!name || strlen(name) > KTFS_MAX_FILENAME_LEN)
         return -EINVAL; //check if it invalid name 
 
-    lock_acquire(&fs.fs_lock); //accqurie lock 
-
     //  read root directory inode 
     struct ktfs_inode root_inode;
     int ret = ktfs_read_inode(fs.sb.root_directory_inode, &root_inode);
-    if (ret < 0) { 
-        lock_release(&fs.fs_lock); 
-        return ret; 
+    if (ret < 0) {
+        return ret;
     }
 
     // the root directory has a no data block allocaite one 
     if (root_inode.block[0] == 0) {
         uint32_t new_blk;
         ret = ktfs_alloc_data_block(&new_blk);
-        if (ret < 0) { 
-            lock_release(&fs.fs_lock); 
-            return ret; 
+        if (ret < 0) {
+            return ret;
         }
         root_inode.block[0] = new_blk;
         ret = ktfs_write_inode(fs.sb.root_directory_inode, &root_inode);
-        if (ret < 0) { 
-            lock_release(&fs.fs_lock); 
-            return ret; 
+        if (ret < 0) {
+            return ret;
         }
 
         // it will zero out the new direcotry block 
@@ -839,9 +1604,8 @@ int ktfs_create(const char* name) {
                         + new_blk;
         void *bp;
         ret = cache_get_block(fs.cache, global * KTFS_BLKSZ, &bp);
-        if (ret < 0) { 
-            lock_release(&fs.fs_lock); 
-            return ret; 
+        if (ret < 0) {
+            return ret;
         }
         memcpy(bp, zero, KTFS_BLKSZ);
         cache_release_block(fs.cache, bp, 1);
@@ -853,14 +1617,12 @@ int ktfs_create(const char* name) {
     for (int i = 0; i < KTFS_NUM_DIRECT_DATA_BLOCKS; i++) {
         if (root_inode.block[i] == 0) continue;
         ret = ktfs_read_data_block(root_inode.block[i], dentries);
-        if (ret < 0) { 
-            lock_release(&fs.fs_lock); 
-            return ret; 
+        if (ret < 0) {
+            return ret;
         }
         for (int j = 0; j < KTFS_BLKSZ/KTFS_DENSZ; j++) {
             if (dentries[j].inode) {
                 if (strcmp(dentries[j].name, name) == 0) {
-                    lock_release(&fs.fs_lock);
                     return -EINVAL;
                 }
             } else if (free_idx < 0) {
@@ -870,7 +1632,6 @@ int ktfs_create(const char* name) {
         }
     }
     if (free_idx < 0) {
-        lock_release(&fs.fs_lock);
         return -EINVAL; //no space 
     }
 
@@ -884,31 +1645,27 @@ int ktfs_create(const char* name) {
         if (ret == 0 && tmp.flags == 0) break; ///unused inode 
     }
     if (free_inum >= total_inodes) {
-        lock_release(&fs.fs_lock);
         return -ENOINODEBLKS;
     }
 
     //initalize the new inode 
     ret = ktfs_bitmap_set(free_inum);
-    if (ret < 0) { 
-        lock_release(&fs.fs_lock); 
-        return ret; 
+    if (ret < 0) {
+        return ret;
     }
 
     // it will intialize the new node 
     struct ktfs_inode new_inode = {0};
     new_inode.flags = KTFS_FILE_IN_USE;
     ret = ktfs_write_inode(free_inum, &new_inode);
-    if (ret < 0) { 
-        lock_release(&fs.fs_lock); 
-        return ret; 
+    if (ret < 0) {
+        return ret;
     }
 
     // inseer the new directory entry
     ret = ktfs_read_data_block(root_inode.block[block_idx], dentries);
-    if (ret < 0) { 
-        lock_release(&fs.fs_lock); 
-        return ret; 
+    if (ret < 0) {
+        return ret;
     }
     strncpy(dentries[free_idx].name, name, KTFS_MAX_FILENAME_LEN);
     dentries[free_idx].name[KTFS_MAX_FILENAME_LEN] = '\0';
@@ -918,23 +1675,30 @@ int ktfs_create(const char* name) {
     uint32_t dblk = 1 + fs.sb.bitmap_block_count + fs.sb.inode_block_count + root_inode.block[block_idx];
     void *dptr;
     ret = cache_get_block(fs.cache, dblk * KTFS_BLKSZ, &dptr);
-    if (ret < 0) { 
-        lock_release(&fs.fs_lock); 
-        return ret; 
+    if (ret < 0) {
+        return ret;
     }
     memcpy(dptr, dentries, KTFS_BLKSZ);
     cache_release_block(fs.cache, dptr, 1);
 
 // update root inode size
     ret = ktfs_update_root_size(KTFS_DENSZ);
-    if (ret < 0) { 
-        lock_release(&fs.fs_lock); 
-        return ret; 
+    if (ret < 0) {
+        return ret;
     }
 
-    lock_release(&fs.fs_lock);
     return 0;
 }
+// Inputs:  const char* name - Null-terminated name of the new file to create in the root directory
+// Outputs: int - Returns 0 on success, or a negative on failure 
+// Description: Locked wrapper around ktfs_create_locked.
+// Side Effects: Acquires and releases the global file system lock
+int ktfs_create(const char* name) {
+    lock_acquire(&fs.fs_lock); //accqurie lock 
+    int ret = ktfs_create_locked(name);
+    lock_release(&fs.fs_lock);
+    return ret;
+}
 // Inputs:  const char* name - the name of the file to delete from the root directory
 // Outputs: int - Returns 0 on success, or a negative on failure
 // Description: Deletes a file from the KTFS root directory. Frees all data blocks used by the file,
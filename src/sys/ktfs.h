@@ -9,10 +9,20 @@
 #define KTFS_NUM_INDIRECT_BLOCKS     1
 #define KTFS_NUM_DINDIRECT_BLOCKS    2
 #define POINTER_BYTESIZE             4
+#define KTFS_MAX_FILE_BLOCKS         (KTFS_NUM_DIRECT_DATA_BLOCKS + \
+                                      KTFS_BLKSZ / POINTER_BYTESIZE + \
+                                      KTFS_NUM_DINDIRECT_BLOCKS * (KTFS_BLKSZ / POINTER_BYTESIZE) * (KTFS_BLKSZ / POINTER_BYTESIZE))
 
 #define KTFS_FILE_IN_USE (1 << 0)
 #define KTFS_FILE_FREE (0 << 0)
 
+// Unwritten blocks: with KTFS_INODE_INITMARK set in an inode's flags, only the first
+// (flags >> KTFS_INODE_INIT_SHIFT) blocks of the file have been written (or zeroed).
+// Blocks past them are mapped but unwritten and read as zeros. Without the flag,
+// every mapped block has been written.
+#define KTFS_INODE_INITMARK (1 << 1)
+#define KTFS_INODE_INIT_SHIFT 16
+
 /*
 Overall filesystem image layout
 
@@ -65,7 +75,7 @@ struct ktfs_superblock {
 // Inode with indirect and doubly-indirect blocks
 struct ktfs_inode {
     uint32_t size;                                  // Size in bytes
-    uint32_t flags;                                 // File type, etc. (unused in MP3)
+    uint32_t flags;                                 // KTFS_FILE_IN_USE, initialized blocks
     uint32_t block[KTFS_NUM_DIRECT_DATA_BLOCKS];    // Direct block indices
     uint32_t indirect;                              // Indirect block index
     uint32_t dindirect[KTFS_NUM_DINDIRECT_BLOCKS];  // Doubly-indirect block indices
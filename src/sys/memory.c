@@ -33,6 +33,32 @@
 #define HEAP_INIT_MIN 256
 #endif
 
+// A user page fault also maps the unmapped pages around the faulting one, in an
+// aligned window of this many pages: fresh zeroed pages for a store, the shared zero
+// page for a load.
+
+#ifndef FAULT_AROUND_PAGES
+#define FAULT_AROUND_PAGES 4
+#endif
+
+// Range TLB flushes of more pages than this flush the whole address space instead.
+
+#ifndef TLB_FLUSH_PAGES_MAX
+#define TLB_FLUSH_PAGES_MAX 32
+#endif
+
+// Number of buddy allocator orders. The largest free block is 2^(PAGE_ORDERS-1) pages.
+
+#ifndef PAGE_ORDERS
+#define PAGE_ORDERS 19
+#endif
+
+// Number of pre-zeroed pages the idle thread keeps ready for alloc_zeroed_page.
+
+#ifndef ZERO_POOL_PAGES
+#define ZERO_POOL_PAGES 32
+#endif
+
 // INTERNAL CONSTANT DEFINITIONS
 //
 
@@ -63,6 +89,10 @@ extern char _kimg_data_start[];
 extern char _kimg_data_end[];
 extern char _kimg_end[];
 
+// usercopy.s
+extern long _user_copy(void * dst, const void * src, size_t n);
+extern long _user_strncpy(char * dst, const char * src, size_t n);
+
 // EXPORTED GLOBAL VARIABLES
 //
 
@@ -71,19 +101,18 @@ char memory_initialized = 0;
 // INTERNAL TYPE DEFINITIONS
 //
 
-// We keep free physical pages in a linked list of _chunks_, where each chunk
-// consists of several consecutive pages of memory. Initially, all free pages
-// are in a single large chunk. To allocate a block of pages, we break up the
-// smallest chunk on the list.
+// Free physical pages are managed by a binary buddy allocator. A free block of
+// order k is 2^k pages, aligned to 2^k pages from RAM_START; its buddy is the block
+// whose page index differs in bit k. Each order has its own free list. Allocating
+// splits the smallest large enough block in halves; freeing merges a block with its
+// buddy for as long as the buddy is free. Both take at most PAGE_ORDERS steps.
 
 /**
- * @brief Section of consecutive physical pages. We keep free physical pages in a
- * linked list of chunks. Initially, all free pages are in a single large chunk. To
- * allocate a block of pages, we break up the smallest chunk in the list
+ * @brief Free block of 2^k pages, stored in its first page, on the list for order k
  */
 struct page_chunk {
-    struct page_chunk * next; ///< Next page in list
-    unsigned long pagecnt; ///< Number of pages in chunk
+    struct page_chunk * next; ///< Next block in list
+    struct page_chunk * prev; ///< Previous block in list
 };
 
 /**
@@ -106,6 +135,7 @@ struct pte {
 #define VPN1(vma) ((VPN(vma) >> (1*9)) % PTE_CNT)
 #define VPN0(vma) ((VPN(vma) >> (0*9)) % PTE_CNT)
 #define MIN(a,b) (((a)<(b))?(a):(b))
+#define MAX(a,b) (((a)>(b))?(a):(b))
 #define ROUND_UP(n,k) (((n)+(k)-1)/(k)*(k)) 
 #define ROUND_DOWN(n,k) ((n)/(k)*(k))
 
@@ -115,6 +145,13 @@ struct pte {
 #define PTE_VALID(pte) (((pte).flags & PTE_V) != 0)
 #define PTE_GLOBAL(pte) (((pte).flags & PTE_G) != 0)
 #define PTE_LEAF(pte) (((pte).flags & (PTE_R | PTE_W | PTE_X)) != 0)
+// A user page shared copy-on-write by fork is mapped without PTE_W and marked with
+// this software (RSW) bit. A store to it faults, and the fault handler copies the page
+// or, if nobody else maps it any more, just makes it writable again.
+
+#define PTE_RSW_COW 1
+#define PTE_COW(pte) (((pte).rsw & PTE_RSW_COW) != 0)
+
 #define PT_INDEX(lvl, vpn) (((vpn) & (0x1FF << (lvl * (PAGE_ORDER - PTE_ORDER)))) \
                              >> (lvl * (PAGE_ORDER - PTE_ORDER)))
 
@@ -132,6 +169,22 @@ static inline struct pte leaf_pte(const void * pp, uint_fast8_t rwxug_flags);
 static inline struct pte ptab_pte(const struct pte * pt, uint_fast8_t g_flag);
 static inline struct pte null_pte(void);
 
+static inline unsigned long page_index(const void * pp);
+static struct pte * walk_pte (
+    struct pte * root, uintptr_t vma, int lvl, int create, uint_fast8_t g_flag);
+static struct pte * find_leaf(struct pte * root, uintptr_t vma);
+static void split_mega(struct pte * pte);
+static void put_user_pages(void * pp, unsigned int cnt);
+static void set_leaf_flags(struct pte * pte, int rwxug_flags);
+static void * buddy_alloc(unsigned int cnt);
+static void cow_break(struct pte * pte);
+static void put_user_page(void * pp);
+static void share_user_page(void * pp);
+static inline struct pte zero_pte(void);
+static unsigned int active_space_asid(void);
+static unsigned int space_asid(struct pte * root);
+static void flush_range(uintptr_t vma, size_t size, int global);
+
 // INTERNAL GLOBAL VARIABLES
 //
 
@@ -146,7 +199,40 @@ static struct pte main_pt1_0x80000[PTE_CNT]
 static struct pte main_pt0_0x80000[PTE_CNT]
     __attribute__ ((section(".bss.pagetable"), aligned(4096)));
 
-static struct page_chunk * free_chunk_list;
+static struct page_chunk * free_lists[PAGE_ORDERS]; // free blocks, by order
+
+// For each page of RAM: k+1 if the page starts a free block of order k, otherwise 0
+static uint8_t free_order[RAM_SIZE / PAGE_SIZE];
+
+static unsigned long free_page_cnt; // pages on all free lists
+
+// For each page of RAM: number of memory spaces mapping it besides the first
+static uint16_t page_share[RAM_SIZE / PAGE_SIZE];
+
+// Read-only page of zeros, mapped copy-on-write wherever user memory has been read
+// but not written. It is never freed and has no share count.
+static void * zero_page;
+
+// Pages cleared ahead of time by the idle thread, linked through their first word.
+// They are taken from the free lists but still count as free, and go back to them
+// when a buddy allocation would otherwise fail.
+static struct page_chunk * zero_pool;
+static unsigned int zero_pool_cnt;
+
+// ASIDs are assigned to memory spaces when they are switched to, in generations.
+// Within a generation each ASID goes to one space only, so TLB entries tagged with it
+// can only belong to that space, and switching spaces needs no flush. When the ASIDs
+// run out, a new generation starts with a single full flush, and every space gets a
+// new ASID the next time it is switched to. ASID 0 is the main space's.
+
+static unsigned int asid_limit;     // ASIDs implemented by the hart (1 if none)
+static uint64_t asid_gen = 1;       // current generation, never wraps
+static unsigned int asid_next = 1;  // next ASID of this generation to hand out
+
+// For each page of RAM used as a root page table: generation << 16 | ASID. The
+// generation is kept at full width so a stale context (or a new space's 0) can
+// never match a later generation.
+static uint64_t asid_ctx[RAM_SIZE / PAGE_SIZE];
 
 // EXPORTED FUNCTION DECLARATIONS
 // 
@@ -155,17 +241,14 @@ static struct page_chunk * free_chunk_list;
 // Inputs: struct pte *old_ptab - pointer to page table to clone
 //         int lvl - level of the page table to clone
 // Outputs: struct pte * - pointer to the cloned page table
-// Description: Recursively clones a multi-level page table structure.
-// Side Effects: Allocates physical memory, copies or shares page mappings
+// Description: Recursively clones a multi-level page table structure. User pages are
+// not copied: both spaces map them, writable ones read-only and copy-on-write.
+// Side Effects: Allocates page tables, write-protects writable pages in old_ptab
 static struct pte *clone_ptab(struct pte *old_ptab, int lvl)
 {
     // allocate a new page for this level's page table
-    void *new_page = alloc_phys_page();
-    if (!new_page) {
-        panic("clone_ptab: out of pages");
-    }
+    void *new_page = alloc_zeroed_page();
     struct pte *new_ptab = (struct pte *)new_page;
-    memset(new_ptab, 0, PAGE_SIZE);
 
     for (unsigned i = 0; i < PTE_CNT; i++) {
         struct pte p = old_ptab[i];
@@ -186,19 +269,31 @@ static struct pte *clone_ptab(struct pte *old_ptab, int lvl)
         } 
         else {
             // leaf, so allocate a new data page and copy its contents
-            if (lvl > 0) {
-                // larger page, share the entire mapping
+            if (lvl > 1) {
+                // gigapage, share the entire mapping
                 new_ptab[i] = p;
-            } 
+            }
+            else if (lvl == 1) {
+                // megapage, shared copy-on-write like its 512 small pages; a store
+                // splits it (see handle_umode_page_fault)
+                if (p.flags & PTE_W) {
+                    p.flags &= ~PTE_W;
+                    p.rsw |= PTE_RSW_COW;
+                    old_ptab[i] = p;
+                }
+                for (unsigned j = 0; j < PTE_CNT; j++)
+                    share_user_page(pageptr(p.ppn + j));
+                new_ptab[i] = p;
+            }
             else {
-                // small page, duplicate the data
-                void *old_data = (void *)(uintptr_t)(p.ppn << PAGE_ORDER);
-                void *dup_data = alloc_phys_page();
-                if (!dup_data)
-                    panic("clone_ptab: out of pages");
-                memcpy(dup_data, old_data, PAGE_SIZE);
-                // making a new leaf PTE with the same flags
-                new_ptab[i] = leaf_pte(dup_data, p.flags & (PTE_R|PTE_W|PTE_X|PTE_U));
+                // small page, share it; a writable one is copied on the first store
+                if (p.flags & PTE_W) {
+                    p.flags &= ~PTE_W;
+                    p.rsw |= PTE_RSW_COW;
+                    old_ptab[i] = p;
+                }
+                share_user_page(pageptr(p.ppn));
+                new_ptab[i] = p;
             }
         }
     }
@@ -277,10 +372,16 @@ void memory_init(void) {
             leaf_pte(pp, PTE_R | PTE_W | PTE_G);
     }
 
-    // Enable paging; this part always makes me nervous.
+    // Enable paging; this part always makes me nervous. The ASID bits the hart
+    // implements read back as ones.
+
+    csrw_satp(ptab_to_mtag(main_pt2, (1U << RISCV_SATP_ASID_nbits) - 1));
+    asid_limit = ((csrr_satp() >> RISCV_SATP_ASID_shift) &
+        ((1U << RISCV_SATP_ASID_nbits) - 1)) + 1;
 
     main_mtag = ptab_to_mtag(main_pt2, 0);
     csrw_satp(main_mtag);
+    sfence_vma();
 
     // Give the memory between the end of the kernel image and the next page
     // boundary to the heap allocator, but make sure it is at least
@@ -304,13 +405,12 @@ void memory_init(void) {
     kprintf("Heap allocator: [%p,%p): %zu KB free\n",
         heap_start, heap_end, (heap_end - heap_start) / 1024);
     
-    // TODO: Initialize the free chunk list here
-    // finding # of free pages by dividing total available memory by page size
-    unsigned long free_pages = (unsigned long)(RAM_END - (uintptr_t)heap_end) / PAGE_SIZE;
-    // casting start of available memory(heap end) as page chunk and initializing free_chunk_list
-    free_chunk_list = (struct page_chunk *)heap_end;
-    free_chunk_list->pagecnt = free_pages;
-    free_chunk_list->next = NULL;
+    // Everything after the heap goes to the page allocator, as the largest aligned
+    // blocks that fit.
+    free_phys_pages(heap_end, (RAM_END - heap_end) / PAGE_SIZE);
+
+    zero_page = alloc_phys_page();
+    memset(zero_page, 0, PAGE_SIZE);
     
     // Allow supervisor to access user memory. We could be more precise by only
     // enabling supervisor access to user memory when we are explicitly trying
@@ -334,20 +434,24 @@ mtag_t active_mspace(void) {
 // Inputs: mtag_t mtag - the SATP tag to switch to
 // Outputs: mtag_t - previous SATP tag
 // Description: Switches to a new memory space identified by the given SATP tag and returns the previous one.
-// Side Effects: Flushes TLB
+// The space runs under its ASID of the current generation, so the TLB need not be
+// flushed, unless the hart has no ASIDs.
+// Side Effects: May assign an ASID (and flush the TLB on rollover)
 mtag_t switch_mspace(mtag_t mtag) {
+    struct pte *root = mtag_to_ptab(mtag);
     mtag_t prev;
-    
-    prev = csrrw_satp(mtag);
-    sfence_vma();
+
+    prev = csrrw_satp(ptab_to_mtag(root, space_asid(root)));
+    if (asid_limit == 1)
+        sfence_vma();
     return prev;
 }
 
 // mtag_t clone_active_mspace(void)
 // Inputs: None
 // Outputs: mtag_t - new SATP tag for the cloned memory space
-// Description: Clones the currently active memory space including page tables and data pages, assigns a new ASID.
-// Side Effects: Allocates physical memory for new page tables and possibly data pages
+// Description: Clones the currently active memory space, sharing its data pages copy-on-write.
+// Side Effects: Allocates physical memory for new page tables, write-protects the active space
 mtag_t clone_active_mspace(void) {
     // mtag_t TODO; 
     // TODO = 0; 
@@ -357,16 +461,86 @@ mtag_t clone_active_mspace(void) {
     // cloning all 3 levels
     struct pte *new_root = clone_ptab(old_root, ROOT_LEVEL);
 
-    // allocating a unique ASID
-    static unsigned next_asid = 1;
-    unsigned max_asid = 1u << RISCV_SATP_ASID_nbits;
-    unsigned asid = next_asid;
-    next_asid = (next_asid + 1) % max_asid;
-    if (next_asid == 0)
-        next_asid = 1;
+    // our writable pages are now read-only
+    sfence_vma_asid(active_space_asid());
 
-    // creating and returning the SATP tag for the cloned space
-    return ptab_to_mtag(new_root, asid);
+    // creating and returning the SATP tag for the cloned space; it gets an ASID
+    // when it is first switched to
+    asid_ctx[page_index(new_root)] = 0;
+    return ptab_to_mtag(new_root, 0);
+}
+
+// mtag_t create_mspace(void)
+// Inputs: None
+// Outputs: mtag_t - SATP tag of the new memory space
+// Description: Creates an empty memory space: the kernel's global mappings and no
+// user mappings. Unlike clone_active_mspace, the active space is not looked at.
+// Side Effects: Allocates a root page table
+mtag_t create_mspace(void) {
+    struct pte *root = alloc_zeroed_page();
+
+    // global entries are shared by every space
+    for (unsigned i = 0; i < PTE_CNT; i++)
+        if (PTE_VALID(main_pt2[i]) && PTE_GLOBAL(main_pt2[i]))
+            root[i] = main_pt2[i];
+
+    asid_ctx[page_index(root)] = 0; // no ASID yet
+    return ptab_to_mtag(root, 0);
+}
+
+// unsigned int space_asid(struct pte * root)
+// Inputs: struct pte * root - root page table of a memory space
+// Outputs: unsigned int - the space's ASID
+// Description: Returns the ASID the space has in the current generation, assigning
+// the next free one if it has none. When none are left, starts a new generation:
+// all TLB entries are flushed, since every ASID may now go to a different space.
+// Side Effects: May flush the TLB
+static unsigned int space_asid(struct pte * root) {
+    unsigned long n;
+
+    if (root == main_pt2 || asid_limit == 1)
+        return 0;
+
+    n = page_index(root);
+    if ((asid_ctx[n] >> 16) != asid_gen) {
+        if (asid_next == asid_limit) {
+            asid_gen++;
+            asid_next = 1;
+            sfence_vma();
+        }
+        asid_ctx[n] = asid_gen << 16 | asid_next++;
+    }
+    return asid_ctx[n] & 0xffff;
+}
+
+// unsigned int active_space_asid(void)
+// Inputs: None
+// Outputs: unsigned int - ASID of the active memory space
+// Description: Reads the ASID from satp.
+// Side Effects: None
+static unsigned int active_space_asid(void) {
+    return (csrr_satp() >> RISCV_SATP_ASID_shift) & ((1U << RISCV_SATP_ASID_nbits) - 1);
+}
+
+// void flush_range(uintptr_t vma, size_t size, int global)
+// Inputs: uintptr_t vma - start of the range, size_t size - its size in bytes
+//         int global - nonzero if the mappings are global
+// Outputs: None
+// Description: Flushes TLB entries for a range of the active space, page by page
+// for up to TLB_FLUSH_PAGES_MAX pages and for the whole ASID beyond that. Global
+// mappings are not tagged with an ASID, so for those everything is flushed.
+// Side Effects: Flushes TLB entries
+static void flush_range(uintptr_t vma, size_t size, int global) {
+    unsigned int asid = active_space_asid();
+    size_t npages = ROUND_UP(size, PAGE_SIZE) / PAGE_SIZE;
+
+    if (global)
+        sfence_vma();
+    else if (npages > TLB_FLUSH_PAGES_MAX)
+        sfence_vma_asid(asid);
+    else
+        for (size_t i = 0; i < npages; i++)
+            sfence_vma_page(vma + i * PAGE_SIZE, asid);
 }
 
 
@@ -391,13 +565,19 @@ void reset_active_mspace(void) {
             if (!PTE_VALID(e1) || (e1.flags & PTE_G)) // skipping invalid or global
                 continue;
 
+            if (PTE_LEAF(e1)) { // megapage: no lvl0 table
+                put_user_pages(pageptr(e1.ppn), PTE_CNT);
+                lvl1[i1] = null_pte();
+                continue;
+            }
+
             struct pte *lvl0 = (void *)(uintptr_t)(e1.ppn << PAGE_ORDER); // finding lvl0 table
             // checking level 0 entries
             for (unsigned i0 = 0; i0 < PTE_CNT; i0++) {
                 struct pte leaf = lvl0[i0]; // loading leaf PTE
                 if (!PTE_VALID(leaf) || (leaf.flags & PTE_G)) // skipping invalid or global
                     continue;
-                free_phys_page((void *)(uintptr_t)(leaf.ppn << PAGE_ORDER)); // freeing data page
+                put_user_page((void *)(uintptr_t)(leaf.ppn << PAGE_ORDER)); // freeing data page, unless shared
                 lvl0[i0] = null_pte(); // clearing leaf
             }
             lvl1[i1] = null_pte(); // clearing lvl1 entry
@@ -407,7 +587,7 @@ void reset_active_mspace(void) {
         free_phys_page(lvl1); // freeing lvl1 table page
     }
 
-    sfence_vma(); // flushing the TLB to ensure unmapped pages aren't in cache
+    sfence_vma_asid(active_space_asid()); // flushing our TLB entries so unmapped pages aren't in cache
 }
 
 // mtag_t discard_active_mspace(void)
@@ -426,9 +606,9 @@ mtag_t discard_active_mspace(void) {
     // unmapping & freeing every non-global page in current mspace
     reset_active_mspace();
 
-    // switching back to the main kernel/initial page table
+    // switching back to the main kernel/initial page table; our ASID is not used
+    // again in this generation, so its stale entries do no harm
     csrw_satp(main_mtag);
-    sfence_vma();
     
     // freeing old root page table
     free_phys_page(old_root);
@@ -438,13 +618,13 @@ mtag_t discard_active_mspace(void) {
 
 // The map_page() function maps a single page into the active address space at
 // the specified address. The map_range() function maps a range of contiguous
-// pages into the active address space. Note that map_page() is a special case
-// of map_range(), so it can be implemented by calling map_range(). Or
-// map_range() can be implemented by calling map_page() for each page in the
-// range. The current implementation does the latter.
-
-// We currently map 4K pages only. At some point it may be disirable to support
-// mapping megapages and gigapages.
+// pages into the active address space by calling map_page() for each page.
+//
+// alloc_and_map_range() maps every 2 MB-aligned part of the range that it can get
+// a free 2 MB buddy block for as one megapage (a level 1 leaf), and the rest as
+// 4 KB pages. A megapage is split into 512 small pages (see split_mega) when only
+// part of it is remapped, unmapped, or given new flags, and when a store to a
+// copy-on-write megapage needs to copy one of its pages.
 
 // void* map_page(uintptr_t vma, void* pp, int rwxug_flags)
 // Inputs: uintptr_t vma - virtual address
@@ -460,52 +640,14 @@ void * map_page(uintptr_t vma, void * pp, int rwxug_flags) {
     // checking that page is well formed
     assert(wellformed(vma));
 
-    // getting pointer to level 2 page table
-    struct pte *lvl2 = active_space_ptab();
-
-    // using macro to compute index into level 2 page table
-    unsigned int lvl2_idx = VPN2(vma);
-
-    // checking that lvl2 entry is valid
-    if (!PTE_VALID(lvl2[lvl2_idx])) {
-        // if not, allocate new page for lvl1 table, clear it, 
-        // and create a new PTE for it to assign to the lvl2 entry
-        void *new_lvl1 = alloc_phys_page();
-        memset(new_lvl1, 0, PAGE_SIZE);
-        lvl2[lvl2_idx] = ptab_pte((struct pte *)new_lvl1, PTE_G);
-    }
-
-    // finding address of level 1 page table by left shifting by PAGE_ORDER
-    struct pte *lvl1 = (struct pte *)((uintptr_t)lvl2[lvl2_idx].ppn << PAGE_ORDER);
-
-    // using macro to compute level 1 index
-    unsigned int lvl1_idx = VPN1(vma);
-
-    // checking that lvl1 entry is valid
-    if (!PTE_VALID(lvl1[lvl1_idx])) {
-        // if not, allocate new page for lvl0 table, clear it, 
-        // and create a new PTE for it to assign to the lvl0 entry
-        void *new_lvl0 = alloc_phys_page();
-        memset(new_lvl0, 0, PAGE_SIZE);
-        lvl1[lvl1_idx] = ptab_pte((struct pte *)new_lvl0, PTE_G);
-    }
-
-    // finding address of level 0 page table by left shifting by PAGE_ORDER
-    struct pte *lvl0 = (struct pte *)((uintptr_t)lvl1[lvl1_idx].ppn << PAGE_ORDER);
-
-    // using macro to compute level 0 index
-    unsigned int lvl0_idx = VPN0(vma);
-
-    // kprintf("Mapping vaddr 0x%lx to physical %p (VPN2=%u, VPN1=%u, VPN0=%u)\n", vma, pp, VPN2(vma), VPN1(vma), VPN0(vma));
+    // finding (or creating) the level 0 entry; tables are global only for global mappings
+    struct pte *pte = walk_pte(active_space_ptab(), vma, 0, 1, rwxug_flags & PTE_G);
 
     // setting leaf PTE
-    lvl0[lvl0_idx] = leaf_pte(pp, rwxug_flags);
+    *pte = leaf_pte(pp, rwxug_flags);
 
-    // struct pte p = lvl0[lvl0_idx];
-    // kprintf("Final PTE: flags=0x%x, ppn=0x%lx\n", p.flags, p.ppn);
-
-    // flushing the TLB
-    sfence_vma();
+    // flushing the TLB entry for this page
+    flush_range(vma, PAGE_SIZE, rwxug_flags & PTE_G);
 
     return (void *)vma;
 }
@@ -538,24 +680,43 @@ void * map_range(uintptr_t vma, size_t size, void * pp, int rwxug_flags) {
 //         size_t size - number of bytes
 //         int rwxug_flags - permission flags
 // Outputs: void* - base virtual address
-// Description: Allocates physical memory, clears it, and maps it to the given virtual address.
+// Description: Allocates physical memory, clears it, and maps it to the given virtual
+// address. Each 2 MB-aligned 2 MB of the range with nothing mapped yet is mapped as a
+// megapage if a 2 MB block is free; the rest is allocated in runs that end at 2 MB
+// boundaries and mapped as 4 KB pages.
 // Side Effects: Allocates and maps physical memory, flushes TLB
-
-
 void * alloc_and_map_range(uintptr_t vma, size_t size, int rwxug_flags) {
-    // making sure size is a multiple of PAGE_SIZE and calculating page count
-    unsigned int page_count = ROUND_UP(size, PAGE_SIZE) / PAGE_SIZE;
-
-    // allocating pages and storing returned physical address pointer
-    void* phys_address_pointer = alloc_phys_pages(page_count);
-    if (!phys_address_pointer) panic("Failed to alloc physical pages!");
-
-    // clear the pages in range
-    memset(phys_address_pointer, 0, page_count * PAGE_SIZE);
+    uintptr_t end = vma + ROUND_UP(size, PAGE_SIZE);
+    uintptr_t pos = vma;
+    unsigned int page_count;
+    struct pte *pte;
+    void *pp;
+
+    while (pos < end) {
+        // a whole megapage, if nothing is mapped there and memory allows
+        if (pos % MEGA_SIZE == 0 && end - pos >= MEGA_SIZE) {
+            pte = walk_pte(active_space_ptab(), pos, 1, 1, rwxug_flags & PTE_G);
+            if (!PTE_VALID(*pte) && (pp = buddy_alloc(PTE_CNT)) != NULL) {
+                memset(pp, 0, MEGA_SIZE);
+                *pte = leaf_pte(pp, rwxug_flags);
+                pos += MEGA_SIZE;
+                continue;
+            }
+        }
 
-    // mapping pages using returned physical address pointer
-    map_range(vma, size, phys_address_pointer, rwxug_flags);
+        // otherwise small pages up to the next 2 MB boundary
+        page_count = (MIN(ROUND_DOWN(pos, MEGA_SIZE) + MEGA_SIZE, end) - pos) / PAGE_SIZE;
+        if (page_count == 1) {
+            pp = alloc_zeroed_page();
+        } else {
+            pp = alloc_phys_pages(page_count);
+            memset(pp, 0, page_count * PAGE_SIZE);
+        }
+        map_range(pos, page_count * PAGE_SIZE, pp, rwxug_flags);
+        pos += page_count * PAGE_SIZE;
+    }
 
+    flush_range(vma, end - vma, rwxug_flags & PTE_G);
     return (void *)vma; 
 }
 
@@ -566,40 +727,33 @@ void * alloc_and_map_range(uintptr_t vma, size_t size, int rwxug_flags) {
 //         int rwxug_flags - new permission flags
 // Outputs: None
 // Description: Changes permission flags of all PTEs in a given virtual address range.
-// Side Effects: Updates page table entries, flushes TLB
+// A megapage the range covers entirely keeps its single PTE; one it covers in part
+// is split first.
+// Side Effects: Updates page table entries, may split megapages, flushes TLB
 void set_range_flags(const void * vp, size_t size, int rwxug_flags) {
-    // ensuring that the size is a multiple of PAGE_SIZE
-    size_t rounded_size = ROUND_UP(size, PAGE_SIZE);
-
-    // iterating over all pages in range
-    for (size_t page_offset = 0; page_offset < rounded_size; page_offset += PAGE_SIZE) {
-        // calculating page virtual and physical addresses and mapping each page
-        uintptr_t page_vma = (uintptr_t)vp + page_offset;
-
-        // getting pointer to level 2 page table
-        struct pte *lvl2 = active_space_ptab();
-        // using macro to compute index into level 2 page table
-        unsigned int lvl2_idx = VPN2(page_vma);
-
-        // finding address of level 1 page table by left shifting by PAGE_ORDER
-        struct pte *lvl1 = (struct pte *)((uintptr_t)lvl2[lvl2_idx].ppn << PAGE_ORDER);
-        // using macro to compute level 1 index
-        unsigned int lvl1_idx = VPN1(page_vma);
-
-        // finding address of level 0 page table by left shifting by PAGE_ORDER
-        struct pte *lvl0 = (struct pte *)((uintptr_t)lvl1[lvl1_idx].ppn << PAGE_ORDER);
-        // using macro to compute level 0 index
-        unsigned int lvl0_idx = VPN0(page_vma);
-
-        // getting current physical page number
-        uintptr_t ppn = lvl0[lvl0_idx].ppn;
+    uintptr_t pos = (uintptr_t)vp;
+    uintptr_t end = pos + ROUND_UP(size, PAGE_SIZE);
+    struct pte *pte;
+
+    while (pos < end) {
+        pte = walk_pte(active_space_ptab(), pos, 1, 0, 0);
+        if (pte != NULL && PTE_VALID(*pte) && PTE_LEAF(*pte)) {
+            if (pos % MEGA_SIZE == 0 && end - pos >= MEGA_SIZE) {
+                set_leaf_flags(pte, rwxug_flags);
+                pos += MEGA_SIZE;
+                continue;
+            }
+            split_mega(pte);
+        }
 
-        // creating new leaf PTE with updated flags
-        lvl0[lvl0_idx] = leaf_pte(pageptr(ppn), rwxug_flags);
+        pte = walk_pte(active_space_ptab(), pos, 0, 0, 0);
+        if (pte != NULL && PTE_VALID(*pte))
+            set_leaf_flags(pte, rwxug_flags);
+        pos += PAGE_SIZE;
     }
 
     // flushing TLB after updating range
-    sfence_vma(); 
+    flush_range((uintptr_t)vp, end - (uintptr_t)vp, rwxug_flags & PTE_G);
 }
 
 
@@ -608,46 +762,37 @@ void set_range_flags(const void * vp, size_t size, int rwxug_flags) {
 //         size_t size - range in bytes
 // Outputs: None
 // Description: Unmaps virtual memory range and frees corresponding physical pages.
+// A megapage the range covers in part is split first.
 // Side Effects: Frees physical memory, modifies page tables, flushes TLB
 void unmap_and_free_range(void * vp, size_t size) {
-    // ensuring that the size is a multiple of PAGE_SIZE
-    size_t rounded_size = ROUND_UP(size, PAGE_SIZE);
-
-    // iterating over all pages in range
-    for (size_t page_offset = 0; page_offset < rounded_size; page_offset += PAGE_SIZE) {
-        // calculating page virtual and physical addresses and mapping each page
-        uintptr_t page_vma = (uintptr_t)vp + page_offset;
-
-        // getting pointer to level 2 page table
-        struct pte *lvl2 = active_space_ptab();
-        // using macro to compute index into level 2 page table
-        unsigned int lvl2_idx = VPN2(page_vma);
-
-        // finding address of level 1 page table by left shifting by PAGE_ORDER
-        struct pte *lvl1 = (struct pte *)((uintptr_t)lvl2[lvl2_idx].ppn << PAGE_ORDER);
-        // using macro to compute level 1 index
-        unsigned int lvl1_idx = VPN1(page_vma);
-
-        // finding address of level 0 page table by left shifting by PAGE_ORDER
-        struct pte *lvl0 = (struct pte *)((uintptr_t)lvl1[lvl1_idx].ppn << PAGE_ORDER);
-        // using macro to compute level 0 index
-        unsigned int lvl0_idx = VPN0(page_vma);
-
-        // getting current physical page number
-        uintptr_t ppn = lvl0[lvl0_idx].ppn;
-
-        // converting page number to a pointer to the physical address of the page
-        void *phys_page_addr = (void *)((uintptr_t)ppn << PAGE_ORDER);
-
-        // freeing the physical page
-        free_phys_page(phys_page_addr);
+    uintptr_t pos = (uintptr_t)vp;
+    uintptr_t end = pos + ROUND_UP(size, PAGE_SIZE);
+    struct pte *pte;
+
+    while (pos < end) {
+        pte = walk_pte(active_space_ptab(), pos, 1, 0, 0);
+        if (pte != NULL && PTE_VALID(*pte) && PTE_LEAF(*pte)) {
+            if (pos % MEGA_SIZE == 0 && end - pos >= MEGA_SIZE) {
+                put_user_pages(pageptr(pte->ppn), PTE_CNT);
+                *pte = null_pte();
+                pos += MEGA_SIZE;
+                continue;
+            }
+            split_mega(pte);
+        }
 
-        // clearing the PTE
-        lvl0[lvl0_idx] = null_pte();
+        pte = walk_pte(active_space_ptab(), pos, 0, 0, 0);
+        if (pte != NULL && PTE_VALID(*pte)) {
+            // freeing the physical page, unless another space still maps it
+            put_user_page(pageptr(pte->ppn));
+            // clearing the PTE
+            *pte = null_pte();
+        }
+        pos += PAGE_SIZE;
     }
 
     // flushing TLB after updating range
-    sfence_vma();
+    flush_range((uintptr_t)vp, end - (uintptr_t)vp, 0);
 }
 
 
@@ -660,6 +805,51 @@ void * alloc_phys_page(void) {
     return alloc_phys_pages(1); // same as multiple pages but with pagecnt of 1
 }
 
+// void* alloc_zeroed_page(void)
+// Inputs: None
+// Outputs: void* - pointer to a zero-filled physical page
+// Description: Allocates a single physical page filled with zeros. The page comes
+// from the pre-zeroed pool when it has one, so the caller does not pay for clearing.
+// Side Effects: Removes a page from the pool or the free lists, panics if out of memory
+void * alloc_zeroed_page(void) {
+    struct page_chunk * pp;
+
+    if (zero_pool == NULL) {
+        pp = alloc_phys_page();
+        memset(pp, 0, PAGE_SIZE);
+        return pp;
+    }
+
+    pp = zero_pool;
+    zero_pool = pp->next;
+    zero_pool_cnt--;
+    pp->next = NULL; // the link was the only nonzero word
+    return pp;
+}
+
+// int refill_zeroed_page(void)
+// Inputs: None
+// Outputs: int - 1 if a page was added to the pre-zeroed pool, 0 otherwise
+// Description: Clears one free page and adds it to the pre-zeroed pool, unless the
+// pool is full or that would take the last free pages. Called by the idle thread.
+// Side Effects: Moves a page from the free lists to the pool
+int refill_zeroed_page(void) {
+    struct page_chunk * pp;
+
+    if (zero_pool_cnt >= ZERO_POOL_PAGES || free_page_cnt <= ZERO_POOL_PAGES)
+        return 0;
+
+    pp = buddy_alloc(1);
+    if (pp == NULL)
+        return 0;
+
+    memset(pp, 0, PAGE_SIZE);
+    pp->next = zero_pool;
+    zero_pool = pp;
+    zero_pool_cnt++;
+    return 1;
+}
+
 // void free_phys_page(void* pp)
 // Inputs: void* pp - physical page to free
 // Outputs: None
@@ -669,102 +859,174 @@ void free_phys_page(void * pp) {
     free_phys_pages(pp, 1); // same as multiple pages but with pagecnt of 1
 }
 
+// static void buddy_unlink(unsigned long n, int k)
+// Inputs: unsigned long n - page index (from RAM_START) of a free block
+//         int k - its order
+// Outputs: None
+// Description: Takes a free block off the free list for its order.
+// Side Effects: Modifies free_lists and free_order
+static void buddy_unlink(unsigned long n, int k) {
+    struct page_chunk * chunk = (struct page_chunk *)(RAM_START + n * PAGE_SIZE);
+
+    if (chunk->prev != NULL)
+        chunk->prev->next = chunk->next;
+    else
+        free_lists[k] = chunk->next;
+    if (chunk->next != NULL)
+        chunk->next->prev = chunk->prev;
+    free_order[n] = 0;
+}
+
+// static void buddy_link(unsigned long n, int k)
+// Inputs: unsigned long n - page index (from RAM_START) of a block
+//         int k - its order
+// Outputs: None
+// Description: Puts a block on the free list for its order.
+// Side Effects: Modifies free_lists and free_order
+static void buddy_link(unsigned long n, int k) {
+    struct page_chunk * chunk = (struct page_chunk *)(RAM_START + n * PAGE_SIZE);
+
+    chunk->prev = NULL;
+    chunk->next = free_lists[k];
+    if (chunk->next != NULL)
+        chunk->next->prev = chunk;
+    free_lists[k] = chunk;
+    free_order[n] = k + 1;
+}
+
+// static void buddy_free(unsigned long n, int k)
+// Inputs: unsigned long n - page index (from RAM_START) of a block aligned to 2^k pages
+//         int k - its order
+// Outputs: None
+// Description: Frees a block, merging it with its buddy while the buddy is free.
+// Side Effects: Modifies free lists
+static void buddy_free(unsigned long n, int k) {
+    unsigned long b;
+
+    assert (free_order[n] == 0); // double free
+
+    while (k < PAGE_ORDERS - 1) {
+        b = n ^ (1UL << k);
+        if (b >= RAM_SIZE / PAGE_SIZE || free_order[b] != k + 1)
+            break;
+        buddy_unlink(b, k);
+        n &= ~(1UL << k);
+        k++;
+    }
+    buddy_link(n, k);
+}
+
 // void* alloc_phys_pages(unsigned int cnt)
 // Inputs: unsigned int cnt - number of pages to allocate
 // Outputs: void* - base physical address of allocated pages
-// Description: Allocates multiple physical pages from the free list.
-// Side Effects: Modifies free page list
+// Description: Allocates cnt contiguous physical pages (see buddy_alloc).
+// Side Effects: Modifies free lists, panics if no block is large enough
 void * alloc_phys_pages(unsigned int cnt) {
-    // declaring variables for navigating free_chunk_list and holding output
-    struct page_chunk *curr = free_chunk_list;
-    struct page_chunk *prev = NULL;
-    void * phys_address = NULL;
-
-    // iterating through free_chunk_list until I find one with enough pages
-    while (curr != NULL) {
-        // checking if current chunk has at least my desired page count
-        if (curr->pagecnt >= cnt) {
-            phys_address = (void *)curr; // storing address of the desired chunk
-            // case 1: chunk->pagecnt == cnt
-            if (curr->pagecnt == cnt) {
-                // if at head of free_chunk_list, move to next node
-                if (prev == NULL) {
-                    free_chunk_list = curr->next;
-                }
-                // else update prev next pointer to current next node
-                else {
-                    prev->next = curr->next;
-                }
-            }
-            // case 2: chunk->pagecnt > cnt
-            else {
-                // create a new chunk after subtracting cnt pages
-                struct page_chunk *new_chunk = (struct page_chunk *)((uintptr_t)curr + cnt * PAGE_SIZE);
-                // update new chunk's pagecnt and link to next node in free_chunk_list
-                new_chunk->pagecnt = curr->pagecnt - cnt;
-                new_chunk->next = curr->next;
-                // if at head of free_chunk_list, move to next node
-                if (prev == NULL) {
-                    free_chunk_list = new_chunk;
-                } 
-                // else, update prev pointer to the new chunk
-                else {
-                    prev->next = new_chunk;
-                }
-            }
-            return phys_address;
-        }
-        // move to next node in free_chunk_list
-        prev = curr;
-        curr = curr->next;
+    struct page_chunk * zp;
+    void * pp = buddy_alloc(cnt);
+
+    // the pre-zeroed pool is still free memory: give it back and try again
+    while (pp == NULL && zero_pool != NULL) {
+        zp = zero_pool;
+        zero_pool = zp->next;
+        zero_pool_cnt--;
+        free_phys_pages(zp, 1);
+        pp = buddy_alloc(cnt);
     }
-    // if no chunk is found, panic
-    panic("ran out of physical memory for allocating pages");
-    return NULL;
+
+    if (pp == NULL)
+        panic("ran out of physical memory for allocating pages");
+    return pp;
+}
+
+// static void* buddy_alloc(unsigned int cnt)
+// Inputs: unsigned int cnt - number of pages to allocate
+// Outputs: void* - base physical address of allocated pages, or NULL
+// Description: Takes the smallest free block of at least cnt pages, splitting larger
+// blocks in halves as needed, and gives back the pages past cnt when cnt is not a
+// power of two. A power-of-two allocation is aligned to its size.
+// Side Effects: Modifies free lists
+static void * buddy_alloc(unsigned int cnt) {
+    unsigned long n;
+    int k, j;
+
+    assert (cnt != 0);
+
+    // smallest order that holds cnt pages
+    for (k = 0; k < PAGE_ORDERS && (1UL << k) < cnt; k++)
+        continue;
+
+    // smallest free block of at least that order
+    for (j = k; j < PAGE_ORDERS && free_lists[j] == NULL; j++)
+        continue;
+    if (j >= PAGE_ORDERS)
+        return NULL;
+
+    n = pagenum(free_lists[j]) - pagenum(RAM_START);
+    buddy_unlink(n, j);
+
+    // split, keeping the lower half and freeing the upper one
+    while (j > k) {
+        j--;
+        buddy_link(n + (1UL << j), j);
+    }
+
+    free_page_cnt -= 1UL << k;
+
+    // return the unused tail
+    if ((1UL << k) > cnt)
+        free_phys_pages(RAM_START + (n + cnt) * PAGE_SIZE, (1UL << k) - cnt);
+
+    return RAM_START + n * PAGE_SIZE;
 }
 
 // void free_phys_pages(void* pp, unsigned int cnt)
 // Inputs: void* pp - base physical page address
 //         unsigned int cnt - number of pages
 // Outputs: None
-// Description: Frees multiple physical pages.
-// Side Effects: Adds chunk back to free page list
+// Description: Frees cnt contiguous pages, which need not be a whole allocation. The
+// range is freed as the largest aligned power-of-two blocks it contains, each merged
+// with its buddies.
+// Side Effects: Modifies free lists
 void free_phys_pages(void * pp, unsigned int cnt) {
-    // casting provided page base address to a chunk
-    struct page_chunk * free_chunk = (struct page_chunk *)pp;
+    unsigned long n = pagenum(pp) - pagenum(RAM_START);
+    int k;
+
+    assert ((uintptr_t)pp % PAGE_SIZE == 0);
+    assert (RAM_START <= pp && n + cnt <= RAM_SIZE / PAGE_SIZE);
 
-    // setting provided chunk pagecount
-    free_chunk->pagecnt = cnt;
+    free_page_cnt += cnt;
 
-    // adding freed chunk to head of free_chunk_list
-    free_chunk->next = free_chunk_list;
-    free_chunk_list = free_chunk;
+    while (cnt != 0) {
+        k = 0;
+        while (k < PAGE_ORDERS - 1 && n % (2UL << k) == 0 && (2UL << k) <= cnt)
+            k++;
+        buddy_free(n, k);
+        n += 1UL << k;
+        cnt -= 1UL << k;
+    }
 }
 
 // unsigned long free_phys_page_count(void)
 // Inputs: None
 // Outputs: unsigned long - number of free pages
-// Description: Returns the current number of free physical pages.
+// Description: Returns the current number of free physical pages, including the
+// pre-zeroed pool.
 // Side Effects: None
 unsigned long free_phys_page_count(void) {
-    // declaring variables for navigating free_chunk_list and holding the final page count
-    struct page_chunk *curr = free_chunk_list;
-    unsigned long count = 0;
-
-    // iterating through free_chunk_list and adding each chunk's pagecount to count
-    while (curr != NULL) {
-        count += curr->pagecnt;
-        curr = curr->next;
-    }
-
-    return count; //returning total free page count
+    return free_page_cnt + zero_pool_cnt;
 }
 
 // int handle_umode_page_fault(struct trap_frame* tfr, uintptr_t vma)
 // Inputs: struct trap_frame* tfr - trap frame
 //         uintptr_t vma - virtual address that caused the fault
 // Outputs: int - 1 if fault handled, 0 otherwise
-// Description: Handles user-mode page faults by allocating and mapping a zeroed page.
+// Description: Handles user-mode page faults. A store to a copy-on-write page gets a
+// private copy. Any other fault on a mapped page is a permission violation and is not
+// handled. Otherwise the faulting page is mapped: a load maps the shared zero
+// page, a store or instruction fetch a fresh zeroed page. Loads and stores also map
+// the other unmapped pages of the FAULT_AROUND_PAGES window around the fault the
+// same way, so that touching nearby memory does not trap again.
 // Side Effects: Allocates and maps physical memory, modifies page tables, flushes TLB
 int handle_umode_page_fault(struct trap_frame * tfr, uintptr_t vma) {
     // checking that vma is within user memory
@@ -776,6 +1038,24 @@ int handle_umode_page_fault(struct trap_frame * tfr, uintptr_t vma) {
     vma = ROUND_DOWN(vma, PAGE_SIZE);
 
     unsigned long long cause = csrr_scause();
+    struct pte *root = active_space_ptab();
+    struct pte *pte;
+
+    // store to a page shared by fork (or to the zero page): copy it
+    if (cause == RISCV_SCAUSE_STORE_PAGE_FAULT) {
+        pte = find_leaf(root, vma);
+        if (pte != NULL && PTE_COW(*pte)) {
+            // copy-on-write megapages are copied a page at a time
+            pte = walk_pte(root, vma, 0, 0, 0);
+            cow_break(pte);
+            sfence_vma_page(vma, active_space_asid());
+            return 1;
+        }
+    }
+
+    // any other fault on a mapped page is a real permission violation
+    if (find_leaf(root, vma) != NULL)
+        return 0;
 
     int flags = PTE_R | PTE_U;
 
@@ -786,19 +1066,211 @@ int handle_umode_page_fault(struct trap_frame * tfr, uintptr_t vma) {
     if (cause == RISCV_SCAUSE_INSTR_PAGE_FAULT) {
         flags |= PTE_X;
     }
-    // allocating a new physical page
-    void *new_page = alloc_phys_page();
-    assert(new_page != NULL);
 
-    // clearing page before mapping
-    memset(new_page, 0, PAGE_SIZE);
+    // the window: just the faulting page for instruction fetches
+    uintptr_t start = vma;
+    uintptr_t end = vma + PAGE_SIZE;
+    if (cause != RISCV_SCAUSE_INSTR_PAGE_FAULT) {
+        start = MAX(ROUND_DOWN(vma, FAULT_AROUND_PAGES * PAGE_SIZE), UMEM_START_VMA);
+        end = MIN(start + FAULT_AROUND_PAGES * PAGE_SIZE, UMEM_END_VMA);
+    }
 
-    // mapping the new page with given vma and user-mode flags
-    map_page(vma, new_page, flags);
+    for (uintptr_t pos = start; pos < end; pos += PAGE_SIZE) {
+        // neighbours that are already mapped are left alone
+        if (pos != vma && find_leaf(root, pos) != NULL)
+            continue;
+
+        pte = walk_pte(root, pos, 0, 1, 0);
+
+        if (cause == RISCV_SCAUSE_LOAD_PAGE_FAULT) {
+            *pte = zero_pte();
+        } else {
+            // a new physical page, cleared ahead of time if the pool has one
+            *pte = leaf_pte(alloc_zeroed_page(), flags);
+        }
+    }
+
+    flush_range(start, end - start, 0);
 
     return 1; // signaling handled fault
 }
 
+// struct pte * walk_pte(struct pte * root, uintptr_t vma, int lvl, int create, uint_fast8_t g_flag)
+// Inputs: struct pte * root - level 2 page table
+//         uintptr_t vma - virtual address
+//         int lvl - level of the entry wanted (0 or 1)
+//         int create - nonzero to allocate missing page tables
+//         uint_fast8_t g_flag - PTE_G for tables of global mappings
+// Outputs: struct pte * - the level lvl entry for vma, or NULL if a table is missing
+// Description: Walks the page table down to level lvl. A megapage in the way of a
+// level 0 walk is split, so the result is always the entry at the level asked for.
+// Side Effects: May allocate page tables and split megapages
+static struct pte * walk_pte (
+    struct pte * root, uintptr_t vma, int lvl, int create, uint_fast8_t g_flag)
+{
+    struct pte * pt = root;
+    struct pte * e;
+
+    for (int l = ROOT_LEVEL; l > lvl; l--) {
+        e = &pt[PT_INDEX(l, VPN(vma))];
+        if (!PTE_VALID(*e)) {
+            if (!create)
+                return NULL;
+            pt = alloc_zeroed_page();
+            *e = ptab_pte(pt, g_flag);
+            continue;
+        }
+        if (PTE_LEAF(*e)) {
+            assert (l == 1); // gigapages are the kernel's
+            split_mega(e);
+        }
+        pt = pageptr(e->ppn);
+    }
+    return &pt[PT_INDEX(lvl, VPN(vma))];
+}
+
+// struct pte * find_leaf(struct pte * root, uintptr_t vma)
+// Inputs: struct pte * root - level 2 page table
+//         uintptr_t vma - virtual address
+// Outputs: struct pte * - valid leaf PTE mapping vma (any level), or NULL
+// Description: Looks up the mapping of an address without changing anything.
+// Side Effects: None
+static struct pte * find_leaf(struct pte * root, uintptr_t vma) {
+    struct pte * pt = root;
+    struct pte * e;
+
+    for (int l = ROOT_LEVEL; l >= 0; l--) {
+        e = &pt[PT_INDEX(l, VPN(vma))];
+        if (!PTE_VALID(*e))
+            return NULL;
+        if (PTE_LEAF(*e))
+            return e;
+        pt = pageptr(e->ppn);
+    }
+    return NULL;
+}
+
+// void split_mega(struct pte * pte)
+// Inputs: struct pte * pte - level 1 leaf (megapage) PTE
+// Outputs: None
+// Description: Replaces a megapage by a level 0 table of 512 small pages with the
+// same flags (including copy-on-write), covering the same physical memory.
+// Side Effects: Allocates a page table
+static void split_mega(struct pte * pte) {
+    struct pte * pt = alloc_phys_page();
+
+    for (unsigned i = 0; i < PTE_CNT; i++) {
+        pt[i] = *pte;
+        pt[i].ppn = pte->ppn + i;
+    }
+    *pte = ptab_pte(pt, pte->flags & PTE_G);
+
+    // No flush: the translations have not changed, and whoever changes one of the
+    // small pages flushes its address, which drops a cached megapage entry too.
+}
+
+// void set_leaf_flags(struct pte * pte, int rwxug_flags)
+// Inputs: struct pte * pte - valid leaf PTE, int rwxug_flags - new permission flags
+// Outputs: None
+// Description: Gives a leaf new flags. A copy-on-write page stays read-only until
+// it is copied. The caller flushes the TLB.
+// Side Effects: Modifies the PTE
+static void set_leaf_flags(struct pte * pte, int rwxug_flags) {
+    if (PTE_COW(*pte)) {
+        *pte = leaf_pte(pageptr(pte->ppn), rwxug_flags & ~PTE_W);
+        pte->rsw = PTE_RSW_COW;
+    } else
+        *pte = leaf_pte(pageptr(pte->ppn), rwxug_flags);
+}
+
+// void cow_break(struct pte * pte)
+// Inputs: struct pte * pte - valid copy-on-write leaf PTE in the active space
+// Outputs: None
+// Description: Makes a copy-on-write page writable. If other spaces still map the
+// page, it is copied and this space switches to the copy; otherwise the page is
+// already private and only needs PTE_W back. The zero page is replaced by a fresh
+// zeroed page. The caller flushes the TLB.
+// Side Effects: May allocate a page, modifies the PTE
+static void cow_break(struct pte * pte) {
+    void * old_page = pageptr(pte->ppn);
+    unsigned long n = page_index(old_page);
+    void * new_page;
+
+    if (old_page == zero_page) {
+        new_page = alloc_zeroed_page();
+        *pte = leaf_pte(new_page, (pte->flags & (PTE_R | PTE_X | PTE_U)) | PTE_W);
+        return;
+    }
+
+    if (page_share[n] == 0) {
+        pte->flags |= PTE_W;
+        pte->rsw &= ~PTE_RSW_COW;
+        return;
+    }
+
+    new_page = alloc_phys_page();
+    memcpy(new_page, old_page, PAGE_SIZE);
+    page_share[n]--;
+    *pte = leaf_pte(new_page, (pte->flags & (PTE_R | PTE_X | PTE_U)) | PTE_W);
+}
+
+// void put_user_page(void * pp)
+// Inputs: void * pp - physical page being unmapped from a user space
+// Outputs: None
+// Description: Drops one mapping of a user page, freeing it if it was the last.
+// Side Effects: May free the page
+static void put_user_page(void * pp) {
+    unsigned long n = page_index(pp);
+
+    if (pp == zero_page)
+        return;
+    if (page_share[n] != 0)
+        page_share[n]--;
+    else
+        free_phys_page(pp);
+}
+
+// void share_user_page(void * pp)
+// Inputs: void * pp - physical page being mapped into one more user space
+// Outputs: None
+// Description: Counts another mapping of a user page (see put_user_page).
+// Side Effects: Modifies page_share
+static void share_user_page(void * pp) {
+    if (pp != zero_page)
+        page_share[page_index(pp)]++;
+}
+
+// struct pte zero_pte(void)
+// Inputs: None
+// Outputs: struct pte - user leaf PTE for the zero page
+// Description: Read-only, copy-on-write mapping of the zero page.
+// Side Effects: None
+static inline struct pte zero_pte(void) {
+    struct pte pte = leaf_pte(zero_page, PTE_R | PTE_U);
+    pte.rsw = PTE_RSW_COW;
+    return pte;
+}
+
+// void put_user_pages(void * pp, unsigned int cnt)
+// Inputs: void * pp - first of cnt contiguous physical pages being unmapped
+// Outputs: None
+// Description: put_user_page for each page, as when unmapping a megapage.
+// Side Effects: May free pages
+static void put_user_pages(void * pp, unsigned int cnt) {
+    for (unsigned int i = 0; i < cnt; i++)
+        put_user_page(pp + i * PAGE_SIZE);
+}
+
+// unsigned long page_index(const void * pp)
+// Inputs: const void * pp - physical page in RAM
+// Outputs: unsigned long - its index from RAM_START
+// Description: Indexes the per-page arrays (free_order, page_share).
+// Side Effects: None
+static inline unsigned long page_index(const void * pp) {
+    assert (RAM_START <= pp && pp < RAM_END);
+    return pagenum(pp) - pagenum(RAM_START);
+}
+
 // mtag_t active_mspace(void)
 // Inputs: None
 // Outputs: mtag_t - current active memory tag
@@ -899,87 +1371,101 @@ static inline struct pte null_pte(void) {
     return (struct pte) { };
 }
 
-// int validate_vptr(const void* vp, size_t len, int rwxu_flags)
-// Inputs: const void* vp - starting user pointer
+// int user_range(const void * vp, size_t len)
+// Inputs: const void * vp - start of the range
 //         size_t len - length in bytes
-//         int rwxu_flags - expected access flags
-// Outputs: int - 0 if valid, error code otherwise
-// Description: Validates a user pointer range for read/write/execute access.
+// Outputs: int - 1 if [vp,vp+len) lies within user memory, 0 otherwise
+// Description: Checks a user pointer before the kernel accesses it. SUM is always
+// set, so a pointer into kernel memory would otherwise be followed.
 // Side Effects: None
-int validate_vptr(const void *vp, size_t len, int rwxu_flags) {
-    uintptr_t start = (uintptr_t)vp;              // convert pointer to integer for arithmetic
-    if (!wellformed(start)) {                     // checking if wellformed
-        return EINVAL;
-    }
-    uintptr_t end = start + len;                  // computing end address
-    if (end < start) {                            // checking for wraparound/overflow
-        return EINVAL;
-    }
-
-    // align to page boundaries so we cover every page
-    uintptr_t page_start = ROUND_DOWN(start, PAGE_SIZE);
-    uintptr_t page_end   = ROUND_UP  (end,   PAGE_SIZE);
-
-    for (uintptr_t addr = page_start; addr < page_end; addr += PAGE_SIZE) {
-        // walk the three-level page table
-        struct pte *lvl2 = active_space_ptab();  // top-level page table base
-        if (!PTE_VALID(lvl2[VPN2(addr)])) {      // checking for valid level-2 entry
-            return EACCESS;
-        }
-
-        struct pte *lvl1 = (struct pte *)(uintptr_t)(lvl2[VPN2(addr)].ppn << PAGE_ORDER); // finding level-1 table
-        if (!PTE_VALID(lvl1[VPN1(addr)])) {      // checking for valid level-1 entry
-            return EACCESS;
-        }
-
-        struct pte *lvl0 = (struct pte *)(uintptr_t)(lvl1[VPN1(addr)].ppn << PAGE_ORDER); // finding level-0 table
-        struct pte p = lvl0[VPN0(addr)];         // fetching the leaf PTE
-        // checking for valid and all requested R/W/X/U bits
-        if (!PTE_VALID(p) || (p.flags & rwxu_flags) != rwxu_flags) {
-            return EACCESS;
-        }
-    }
-
-    return 0;
+int user_range(const void * vp, size_t len) {
+    uintptr_t const vma = (uintptr_t)vp;
+    return (UMEM_START_VMA <= vma && vma <= UMEM_END_VMA &&
+        len <= UMEM_END_VMA - vma);
 }
 
-// int validate_vstr(const char* vs, int ug_flags)
-// Inputs: const char* vs - user string pointer
-//         int ug_flags - expected user/global access flags
-// Outputs: int - 0 if valid, error code otherwise
-// Description: Validates a null-terminated user string.
-// Side Effects: None
-int validate_vstr(const char *vs, int ug_flags) {
-    uintptr_t addr = (uintptr_t)vs;               // converting to pointer for arithmetic
-    if (!wellformed(addr)) {                      // checking if wellformed
-        return EINVAL;
-    }
+// long copy_from_user(void * dst, const void * usrc, size_t n)
+// Inputs: void * dst - kernel destination
+//         const void * usrc - user source
+//         size_t n - number of bytes
+// Outputs: long - 0 on success, -EFAULT if usrc is not readable user memory
+// Description: Copies n bytes from user memory. dst may be partly written on failure.
+// Side Effects: May fault in user pages
+long copy_from_user(void * dst, const void * usrc, size_t n) {
+    if (!user_range(usrc, n))
+        return -EFAULT;
+    return _user_copy(dst, usrc, n);
+}
 
-    while (1) {
-        struct pte *lvl2 = active_space_ptab();  // top-level page table
-        if (!PTE_VALID(lvl2[VPN2(addr)]))        // checking for valid level-2 entry
-            return EACCESS;
+// long copy_to_user(void * udst, const void * src, size_t n)
+// Inputs: void * udst - user destination
+//         const void * src - kernel source
+//         size_t n - number of bytes
+// Outputs: long - 0 on success, -EFAULT if udst is not writable user memory
+// Description: Copies n bytes to user memory. udst may be partly written on failure.
+// Side Effects: May fault in user pages, copies pages shared copy-on-write
+long copy_to_user(void * udst, const void * src, size_t n) {
+    if (!user_range(udst, n))
+        return -EFAULT;
+    return _user_copy(udst, src, n);
+}
 
-        struct pte *lvl1 = (struct pte *)(uintptr_t)(lvl2[VPN2(addr)].ppn << PAGE_ORDER); // finding level-1 table
-        if (!PTE_VALID(lvl1[VPN1(addr)]))
-            return EACCESS;
+// long memcpy_nofault(void * dst, const void * src, size_t n)
+// Inputs: void * dst - destination
+//         const void * src - source
+//         size_t n - number of bytes
+// Outputs: long - 0 on success, -EFAULT if an access faulted
+// Description: Copies n bytes where either buffer may be kernel memory or user memory
+// the caller has already checked with user_range, as for the buffer of a read or
+// write. dst may be partly written on failure.
+// Side Effects: May fault in user pages, copies pages shared copy-on-write
+long memcpy_nofault(void * dst, const void * src, size_t n) {
+    return _user_copy(dst, src, n);
+}
 
-        struct pte *lvl0 = (struct pte *)(uintptr_t)(lvl1[VPN1(addr)].ppn << PAGE_ORDER); // finding level-0 table
-        struct pte p = lvl0[VPN0(addr)];         // fetching the leaf PTE
-        // checking for valid and all requested R/W/X/U bits
-        if (!PTE_VALID(p) || (p.flags & ug_flags) != ug_flags)
-            return EACCESS;
+// long strncpy_from_user(char * dst, const char * usrc, size_t n)
+// Inputs: char * dst - kernel destination of n bytes
+//         const char * usrc - null-terminated user string
+//         size_t n - size of dst
+// Outputs: long - length of the string, n if it does not fit in dst (which is then
+//                 not terminated), or -EFAULT if usrc is not readable user memory
+// Description: Copies a null-terminated string from user memory.
+// Side Effects: May fault in user pages
+long strncpy_from_user(char * dst, const char * usrc, size_t n) {
+    size_t lim = n;
+    long len;
+
+    if (!user_range(usrc, 0))
+        return -EFAULT;
+
+    // a string running into the end of user memory is a fault, not a long string
+    if (UMEM_END_VMA - (uintptr_t)usrc < lim)
+        lim = UMEM_END_VMA - (uintptr_t)usrc;
+
+    len = _user_strncpy(dst, usrc, lim);
+    if (len == lim && lim < n)
+        return -EFAULT;
+    return len;
+}
 
-        char c = *(const char *)addr;
-        if (c == '\0')                           // stop at null terminator
-            break;
+// int handle_usercopy_fault(struct trap_frame * tfr, uintptr_t vma)
+// Inputs: struct trap_frame * tfr - trap frame of the kernel fault
+//         uintptr_t vma - faulting address
+// Outputs: int - 1 if the fault was handled and the access can be retried, 0 if
+//                the copy routine must fail
+// Description: Handles a page fault taken by a user-copy routine. User pages not
+// mapped yet and stores to pages shared copy-on-write are handled as they would be
+// for user mode; a mapped page that lacks the permission is an error.
+// Side Effects: May allocate and map pages
+int handle_usercopy_fault(struct trap_frame * tfr, uintptr_t vma) {
+    struct pte * pte;
+
+    if (vma < UMEM_START_VMA || vma >= UMEM_END_VMA)
+        return 0;
 
-        // moving to next character, checking for overflow
-        uintptr_t next = addr + 1;
-        if (next < addr)
-            return EINVAL;
-        addr = next;
-    }
+    pte = find_leaf(active_space_ptab(), vma);
+    if (pte != NULL && !(csrr_scause() == RISCV_SCAUSE_STORE_PAGE_FAULT && PTE_COW(*pte)))
+        return 0;
 
-    return 0;
-}
\ No newline at end of file
+    return handle_umode_page_fault(tfr, vma);
+}
@@ -52,6 +52,8 @@ extern mtag_t switch_mspace(mtag_t mtag);
 
 extern mtag_t clone_active_mspace(void);
 
+extern mtag_t create_mspace(void);
+
 extern void reset_active_mspace(void);
 
 extern mtag_t discard_active_mspace(void);
@@ -70,6 +72,10 @@ extern void unmap_and_free_range(void * vp, size_t size);
 
 extern void * alloc_phys_page(void);
 
+extern void * alloc_zeroed_page(void);
+
+extern int refill_zeroed_page(void);
+
 extern void free_phys_page(void * pp);
 
 extern void * alloc_phys_pages(unsigned int cnt);
@@ -81,8 +87,21 @@ extern unsigned long free_phys_page_count(void);
 extern int handle_umode_page_fault (
     struct trap_frame * tfr, uintptr_t vma);
 
-// added validate function declerations
-extern int validate_vptr(const void *vp, size_t len, int rwxu_flags);
+// The following copy between kernel memory and user memory of the active space.
+// They do not walk the page tables: an access to user memory that faults is
+// caught through the exception table (see usercopy.s), so they return -EFAULT for
+// a bad user pointer instead of panicking. memcpy_nofault skips the user_range
+// check, for buffers that may be in either kernel or (checked) user memory.
+
+extern int user_range(const void * vp, size_t len);
+
+extern long copy_from_user(void * dst, const void * usrc, size_t n);
+
+extern long copy_to_user(void * udst, const void * src, size_t n);
+
+extern long memcpy_nofault(void * dst, const void * src, size_t n);
+
+extern long strncpy_from_user(char * dst, const char * usrc, size_t n);
 
-extern int validate_vstr(const char *vs, int ug_flags);
+extern int handle_usercopy_fault(struct trap_frame * tfr, uintptr_t vma);
 #endif
\ No newline at end of file
@@ -46,6 +46,22 @@ static int build_stack(void * stack, int argc, char ** argv);
 
 static void fork_func(struct condition * done, struct trap_frame * tfr);
 
+static int load_image (
+    struct io * exeio, int argc, char ** argv, struct trap_frame * tf);
+
+// Handed from process_spawn to the child's first thread function. Lives on the
+// parent's stack; the parent waits until the child has loaded its image.
+
+struct spawn_args {
+    struct io * exeio;
+    int argc;
+    char ** argv;           // in kernel memory, readable from any space
+    struct condition done;  // broadcast once the image is loaded (or not)
+    int result;             // 0 or error from load_image
+};
+
+static void spawn_func(struct spawn_args * sa);
+
 
 // static void fork_func(struct condition * forked, struct trap_frame * tfr);
 
@@ -60,6 +76,13 @@ static struct process * proctab[NPROC] = {
     &main_proc
 };
 
+// Processes other than main, and the trap frames handed to forked children, are
+// allocated from their own slab caches.
+static struct kmem_cache process_cache =
+    KMEM_CACHE_INIT("process", sizeof(struct process));
+static struct kmem_cache trap_frame_cache =
+    KMEM_CACHE_INIT("trap_frame", sizeof(struct trap_frame));
+
 // EXPORTED GLOBAL VARIABLES
 //
 
@@ -115,52 +138,12 @@ int process_exec(struct io * exeio, int argc, char ** argv) {
     reset_active_mspace();
     // kprintf("Successfully Reset Memory Space...\n");
 
-    // Load ELF executable (returns entry point or 0 on failure)
-    void (*entry)(void);
-    int ret = elf_load(exeio, &entry);
-    if (ret < 0 || entry == NULL) {
-        kprintf("ELF LOAD FAILED\n");
+    // Load the ELF image and user stack, set up trap frame
+    struct trap_frame tf;
+    if (load_image(exeio, argc, argv, &tf) < 0)
         thread_exit();
-    }
-    // kprintf("Successfully Loaded ELF...\n");
 
-    // Allocate and build user stack
-    void *stack = alloc_phys_page();
-    if (stack == NULL) {
-        kprintf("FAILED TO ALLOCATE STACK\n");
-        thread_exit();
-    }
-    // kprintf("Successfully Allocated User Stack...\n");
-
-    map_page(UMEM_END_VMA - PAGE_SIZE, stack, PTE_R | PTE_W | PTE_U);
-    int stksz = build_stack(stack, argc, argv);
-    if (stksz < 0) {
-        kprintf("FAILED TO BUILD USER STACK\n");
-        thread_exit();
-    }
-    // kprintf("Successfully Built User Stack...\n");
-
-    //  Copy I/O args into process->iotab after memory reset
-    // for (int i = 0; i < argc && i < PROCESS_IOMAX; i++) {
-    //     proc->iotab[i] = (struct io *)argv[i];
-    //     if (proc->iotab[i]) ioaddref(proc->iotab[i]);
-    // }
-
-    // Set up trap frame
-    struct trap_frame tf = {0};
-    tf.sp = (void *)(UMEM_END_VMA - stksz); // user stack top
-    kprintf("Stack size = %d\n", stksz);
-    kprintf("Expected tf.sp = 0x%x\n", (uintptr_t)(UMEM_END_VMA - stksz));
-    tf.ra = entry; // jump to ELF entry point
-    tf.sepc = entry;  // program counter
-    tf.sstatus = ((RISCV_SSTATUS_SPIE | RISCV_SSTATUS_SUM )); //SPIE enables U-int on return and then SUM allows kernel to touch U pages
-    tf.tp = current_thread();
-
-    // Set argument registers
-    tf.a0 = argc;
-    tf.a1 = (uintptr_t)tf.sp; // where argv is in user stack
     // kprintf("Successfully Built Trapframe...\n");
-    kprintf("JUMPING TO USER ENTRY = %p\n", entry);
     // Jump to user mode
     trap_frame_jump(&tf, get_scratch());
 
@@ -180,7 +163,7 @@ int process_fork(const struct trap_frame * tfr) {
     assert(tfr != NULL);
 
     // create new process struct for the child
-    struct process *child_proc = kmalloc(sizeof(struct process));
+    struct process *child_proc = kmem_cache_alloc(&process_cache);
     if (!child_proc)
         return -ENOMEM;
 
@@ -206,18 +189,18 @@ int process_fork(const struct trap_frame * tfr) {
         }
     }
     if (idx < 0) {
-        kfree(child_proc); //free child if no idx is found in process table
+        kmem_cache_free(&process_cache, child_proc); //free child if no idx is found in process table
         return -ECHILD;
     }
 
     // clone parent trap frame
-    struct trap_frame *child_tfr = kmalloc(sizeof(struct trap_frame));
+    struct trap_frame *child_tfr = kmem_cache_alloc(&trap_frame_cache);
     if (!child_tfr) { //if no trap frame is created, close everything in the child process's io table
         for (int i = 0; i < PROCESS_IOMAX; i++) {
             if (child_proc->iotab[i])
                 ioclose(child_proc->iotab[i]);
         }
-        kfree(child_proc); // then free the child_proc memory in heap
+        kmem_cache_free(&process_cache, child_proc); // then free the child_proc memory in heap
         return -ENOMEM;
     }
     memcpy(child_tfr, tfr, sizeof(struct trap_frame)); // copying parent trapframe to child's
@@ -232,12 +215,12 @@ int process_fork(const struct trap_frame * tfr) {
     // spawn child thread to run fork_func and get tid for process struct member
     int tid = thread_spawn("child", (void*)fork_func, &done, child_tfr);
     if (tid < 0) { // in the case that thread spawn failed
-        kfree(child_tfr); //free child trapframe
+        kmem_cache_free(&trap_frame_cache, child_tfr); //free child trapframe
         for (int i = 0; i < PROCESS_IOMAX; i++) { //close everything in I/O table
             if (child_proc->iotab[i])
                 ioclose(child_proc->iotab[i]);
         }
-        kfree(child_proc); //free the process
+        kmem_cache_free(&process_cache, child_proc); //free the process
         return tid; // error
     }
 
@@ -253,6 +236,84 @@ int process_fork(const struct trap_frame * tfr) {
     return tid; // parent returns child's thread ID
 }
 
+// int process_spawn(struct io * exeio, int argc, char ** argv, struct io * const * iotab)
+// Inputs: struct io * exeio - Executable file to load
+//         int argc - Argument count
+//         char ** argv - Argument vector, in kernel memory
+//         struct io * const * iotab - PROCESS_IOMAX I/O objects for the child (NULL entries are closed)
+// Outputs: int - TID of the child on success, or negative error code on failure
+// Description: Starts an executable in a new child process. The child gets a fresh
+// memory space from create_mspace and loads the image itself, so the parent's memory
+// space is neither cloned nor touched, and the cost does not depend on its size. The
+// parent waits until the image is loaded so that load errors are returned here.
+// Side Effects: Allocates memory, modifies global process table, creates new thread
+
+int process_spawn (
+    struct io * exeio, int argc, char ** argv, struct io * const * iotab)
+{
+    struct spawn_args sa;
+    int idx = -1;
+    int tid;
+    int pie;
+
+    assert(exeio != NULL && iotab != NULL);
+
+    for (int i = 0; i < NPROC; i++) {
+        if (proctab[i] == NULL) {
+            idx = i;
+            break;
+        }
+    }
+    if (idx < 0)
+        return -ECHILD;
+
+    struct process *child_proc = kmem_cache_alloc(&process_cache);
+    if (!child_proc)
+        return -ENOMEM;
+
+    for (int i = 0; i < PROCESS_IOMAX; i++) {
+        child_proc->iotab[i] = iotab[i];
+        if (child_proc->iotab[i])
+            ioaddref(child_proc->iotab[i]);
+    }
+
+    sa.exeio = ioaddref(exeio);
+    sa.argc = argc;
+    sa.argv = argv;
+    sa.result = 0;
+    condition_init(&sa.done, "spawn.done");
+
+    pie = disable_interrupts();
+
+    tid = thread_spawn("child", (void*)spawn_func, &sa);
+    if (tid < 0) {
+        restore_interrupts(pie);
+        ioclose(sa.exeio);
+        for (int i = 0; i < PROCESS_IOMAX; i++) {
+            if (child_proc->iotab[i])
+                ioclose(child_proc->iotab[i]);
+        }
+        kmem_cache_free(&process_cache, child_proc);
+        return tid;
+    }
+
+    child_proc->tid = tid;
+    child_proc->mtag = create_mspace();
+    child_proc->idx = idx;
+    proctab[idx] = child_proc;
+    thread_set_process(tid, child_proc);
+
+    condition_wait(&sa.done); // wait for the child to load its image
+    restore_interrupts(pie);
+
+    if (sa.result < 0) {
+        thread_join(tid); // the child has exited; reap it
+        return sa.result;
+    }
+
+    return tid;
+}
+
 // void process_exit(void)
 // Inputs: None
 // Outputs: None
@@ -287,7 +348,7 @@ void process_exit(void) {
 
     // free process if not static main_proc
     if (proc != &main_proc)
-        kfree(proc);
+        kmem_cache_free(&process_cache, proc);
 
     // exit thread
     thread_exit();
@@ -296,6 +357,54 @@ void process_exit(void) {
 // INTERNAL FUNCTION DEFINITIONS
 //
 
+// int load_image(struct io * exeio, int argc, char ** argv, struct trap_frame * tf)
+// Inputs: struct io * exeio - Executable file to load
+//         int argc - Argument count
+//         char ** argv - Argument vector
+//         struct trap_frame * tf - Set to the trap frame that enters the image
+// Outputs: int - 0 on success, or negative error code on failure
+// Description: Loads an ELF image and a user stack holding argv into the active
+// memory space, which must have no user mappings.
+// Side Effects: Allocates and maps memory in the active space
+static int load_image (
+    struct io * exeio, int argc, char ** argv, struct trap_frame * tf)
+{
+    // Load ELF executable (returns entry point or 0 on failure)
+    void (*entry)(void);
+    int ret = elf_load(exeio, &entry);
+    if (ret < 0 || entry == NULL) {
+        kprintf("ELF LOAD FAILED\n");
+        return (ret < 0) ? ret : -EINVAL;
+    }
+
+    // Allocate and build user stack
+    void *stack = alloc_phys_page();
+    if (stack == NULL) {
+        kprintf("FAILED TO ALLOCATE STACK\n");
+        return -ENOMEM;
+    }
+
+    map_page(UMEM_END_VMA - PAGE_SIZE, stack, PTE_R | PTE_W | PTE_U);
+    int stksz = build_stack(stack, argc, argv);
+    if (stksz < 0) {
+        kprintf("FAILED TO BUILD USER STACK\n");
+        return stksz;
+    }
+
+    // Set up trap frame
+    memset(tf, 0, sizeof(*tf));
+    tf->sp = (void *)(UMEM_END_VMA - stksz); // user stack top
+    tf->ra = entry; // jump to ELF entry point
+    tf->sepc = entry;  // program counter
+    tf->sstatus = ((RISCV_SSTATUS_SPIE | RISCV_SSTATUS_SUM )); //SPIE enables U-int on return and then SUM allows kernel to touch U pages
+    tf->tp = current_thread();
+
+    // Set argument registers
+    tf->a0 = argc;
+    tf->a1 = (uintptr_t)tf->sp; // where argv is in user stack
+    return 0;
+}
+
 int build_stack(void * stack, int argc, char ** argv) {
     size_t stksz, argsz;
     uintptr_t * newargv;
@@ -355,13 +464,45 @@ int build_stack(void * stack, int argc, char ** argv) {
 // Side Effects: Performs context switch, broadcasts on condition variable
 
 void fork_func(struct condition * done, struct trap_frame * tfr) {
+    struct trap_frame tf = *tfr;
+
+    // the trap frame is ours now; return its memory
+    kmem_cache_free(&trap_frame_cache, tfr);
+
     // switch to child’s memory space
     switch_mspace(current_process()->mtag);
 
-    // Notify parent it can free trap frame
+    // Notify parent the child has started
     condition_broadcast(done);
 
     // enter U-mode
-    trap_frame_jump(tfr, get_scratch());
+    trap_frame_jump(&tf, get_scratch());
     return;
-}
\ No newline at end of file
+}
+
+// void spawn_func(struct spawn_args * sa)
+// Inputs: struct spawn_args * sa - Image to load, on the parent's stack
+// Outputs: None
+// Description: First function of a spawned child. Switches to the child's new memory
+// space, loads the image into it, reports the result to the parent, and enters user
+// mode, or exits if the image could not be loaded.
+// Side Effects: Performs context switch, broadcasts on condition variable
+
+void spawn_func(struct spawn_args * sa) {
+    struct trap_frame tf;
+    int ret;
+
+    switch_mspace(current_process()->mtag);
+
+    ret = load_image(sa->exeio, sa->argc, sa->argv, &tf);
+    ioclose(sa->exeio);
+
+    // sa is gone once the parent runs again
+    sa->result = ret;
+    condition_broadcast(&sa->done);
+
+    if (ret < 0)
+        process_exit();
+
+    trap_frame_jump(&tf, get_scratch());
+}
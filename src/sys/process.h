@@ -46,6 +46,10 @@ extern int process_exec(struct io * exeio, int argc, char ** argv);
 extern int process_fork(const struct trap_frame * tfr);
 
 
+extern int process_spawn (
+    struct io * exeio, int argc, char ** argv, struct io * const * iotab);
+
+
 extern struct io * process_get_io(int fd); //added helper function
  
 
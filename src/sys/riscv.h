@@ -187,6 +187,18 @@ static inline void sfence_vma(void) {
     asm inline ("sfence.vma" ::: "memory");
 }
 
+// sfence_vma_page() flushes the translations of one address in one address space;
+// sfence_vma_asid() flushes every translation of one address space. Neither flushes
+// global mappings.
+
+static inline void sfence_vma_page(unsigned long vma, unsigned long asid) {
+    asm inline ("sfence.vma %0, %1" :: "r"(vma), "r"(asid) : "memory");
+}
+
+static inline void sfence_vma_asid(unsigned long asid) {
+    asm inline ("sfence.vma zero, %0" :: "r"(asid) : "memory");
+}
+
 static inline unsigned long long rdtime(void) {
 #if __riscv_xlen == 64
     unsigned long long time;
@@ -13,6 +13,7 @@
 #define SYSCALL_WAIT    3   // wait for a child to exit
 #define SYSCALL_PRINT   4   // print a message to the console
 #define SYSCALL_USLEEP  5   // sleep for some number of microseconds
+#define SYSCALL_SPAWN   6   // start an executable in a new child process
 
 #define SYSCALL_DEVOPEN 10  // open a device
 #define SYSCALL_FSOPEN  11  // open a file
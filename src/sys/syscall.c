@@ -30,8 +30,10 @@
 #include "ioimpl.h"
 #include "ktfs.h"
 #include "riscv.h"
+#include "string.h"
 
 #define MAX_PRINT_LEN 512  
+#define MAX_NAME_LEN 64 // device and file names, terminator included
 #define NEXT_RISCV_INSTRUCTION 4 //each instruction is 4 bytes wide
 
 // EXPORTED FUNCTION DECLARATIONS
@@ -51,6 +53,7 @@ static int sysfork(const struct trap_frame * tfr);
 static int syswait(int tid);
 static int sysprint(const char * msg);
 static int sysusleep(unsigned long us);
+static int sysspawn(int fd, int argc, char ** argv, const int * fdmap, int nfd);
 static int sysdevopen(int fd, const char * name, int instno);
 static int sysfsopen(int fd, const char * name);
 static int sysclose(int fd);
@@ -61,6 +64,8 @@ static int syspipe(int * wfdptr, int * rfdptr);
 static int sysfscreate(const char* name); 
 static int sysfsdelete(const char* name);
 
+static int copy_name(char * kname, const char * name);
+
 // EXPORTED FUNCTION DEFINITIONS
 //
 
@@ -129,6 +134,9 @@ int64_t syscall(const struct trap_frame * tfr) {
             return sysprint((const char *)tfr->a0);
         case(SYSCALL_USLEEP):
             return sysusleep((unsigned long)tfr->a0);
+        case(SYSCALL_SPAWN):
+            return sysspawn((int)tfr->a0, (int)tfr->a1, (char **)tfr->a2,
+                (const int *)tfr->a3, (int)tfr->a4);
         case(SYSCALL_DEVOPEN):
             return sysdevopen((int)tfr->a0, (const char *)tfr->a1, (int)tfr->a2);
         case(SYSCALL_FSOPEN):
@@ -202,13 +210,18 @@ int syswait(int tid) {
 // Side Effects: Writes to console output
 
 int sysprint(const char * msg) {
-    // validate_vstr returns 0 on success, or negative error (e.g., -EFAULT)
-    int rc = validate_vstr(msg, PTE_U | PTE_R);
-    if (rc)
-        return -rc;
+    char kmsg[MAX_PRINT_LEN];
+
+    // longer messages are cut short
+    long len = strncpy_from_user(kmsg, msg, sizeof(kmsg));
+    if (len < 0)
+        return len;
+    if (len == sizeof(kmsg))
+        len = sizeof(kmsg) - 1;
+    kmsg[len] = '\0';
 
     // Format: <thread_name:thread_num> msg
-    kprintf("<%s:%d> %s\n", running_thread_name(), running_thread(), msg);
+    kprintf("<%s:%d> %s\n", running_thread_name(), running_thread(), kmsg);
     return 0;
 }
 
@@ -224,6 +237,76 @@ int sysusleep(unsigned long us) {
     return 0;
 }
 
+// int sysspawn(int fd, int argc, char ** argv, const int * fdmap, int nfd)
+// Inputs: int fd - File descriptor of executable
+//         int argc - Argument count
+//         char **argv - Argument vector
+//         const int *fdmap - For each child fd, the caller's fd to give it or -1, or
+//                            NULL to give the child the caller's whole I/O table
+//         int nfd - Number of entries in fdmap
+// Outputs: int - Child thread ID or error
+// Description: Starts an executable in a new child process (see process_spawn).
+// The child cannot read the caller's memory, so argv is copied into a kernel page.
+// Side Effects: Allocates memory, updates process table, spawns thread
+int sysspawn(int fd, int argc, char ** argv, const int * fdmap, int nfd) {
+    struct io * iotab[PROCESS_IOMAX];
+    struct io * exeio = process_get_io(fd); // recovering io pointer
+    int kfdmap[PROCESS_IOMAX];
+    char ** kargv;
+    long len;
+    char * p;
+    int rc;
+    int i;
+
+    if (exeio == NULL)
+        return -EBADFD;
+    if (argc < 0 || PAGE_SIZE / sizeof(char *) - 1 <= (size_t)argc)
+        return -EINVAL;
+    if (nfd < 0 || PROCESS_IOMAX < nfd)
+        return -EINVAL;
+
+    // child fd i gets the caller's fd fdmap[i]
+    for (i = 0; i < PROCESS_IOMAX; i++)
+        iotab[i] = (fdmap == NULL) ? current_process()->iotab[i] : NULL;
+
+    if (fdmap != NULL) {
+        if (copy_from_user(kfdmap, fdmap, nfd * sizeof(int)) < 0)
+            return -EFAULT;
+        for (i = 0; i < nfd; i++) {
+            if (kfdmap[i] == -1)
+                continue;
+            iotab[i] = process_get_io(kfdmap[i]);
+            if (iotab[i] == NULL)
+                return -EBADFD;
+        }
+    }
+
+    // the pointers first, then the strings after them
+    kargv = alloc_phys_page();
+    p = (char *)(kargv + argc + 1);
+
+    if (copy_from_user(kargv, argv, argc * sizeof(char *)) < 0) {
+        free_phys_page(kargv);
+        return -EFAULT;
+    }
+
+    for (i = 0; i < argc; i++) {
+        len = strncpy_from_user(p, kargv[i], (char *)kargv + PAGE_SIZE - p);
+        if (len < 0 || len == (char *)kargv + PAGE_SIZE - p) {
+            free_phys_page(kargv);
+            return (len < 0) ? len : -EINVAL;
+        }
+        kargv[i] = p;
+        p += len + 1;
+    }
+    kargv[argc] = NULL;
+
+    // the child has its own copy of argv once process_spawn returns
+    rc = process_spawn(exeio, argc, kargv, iotab);
+    free_phys_page(kargv);
+    return rc;
+}
+
 // int sysdevopen(int fd, const char * name, int instno)
 // Inputs: int fd - File descriptor or -1 for automatic allocation
 //         const char *name - Name of the device
@@ -232,12 +315,13 @@ int sysusleep(unsigned long us) {
 // Description: Opens a device and associates it with a file descriptor
 // Side Effects: May allocate a new device I/O object
 int sysdevopen(int fd, const char * name, int instno) {
-    int rc = validate_vstr(name, PTE_U | PTE_R);
+    char kname[MAX_NAME_LEN];
+    int rc = copy_name(kname, name);
     if (rc)
-        return -rc;
+        return rc;
 
     struct io *io = NULL;
-    rc = open_device(name, instno, &io); // opening device
+    rc = open_device(kname, instno, &io); // opening device
     if (rc < 0)
         return rc;
 
@@ -251,12 +335,13 @@ int sysdevopen(int fd, const char * name, int instno) {
 // Description: Opens a file from KTFS and assigns to I/O table
 // Side Effects: May allocate and reference a filesystem I/O object
 int sysfsopen(int fd, const char * name) {
-    int rc = validate_vstr(name, PTE_U | PTE_R);
+    char kname[MAX_NAME_LEN];
+    int rc = copy_name(kname, name);
     if (rc)
-        return -rc;
+        return rc;
     
     struct io *io;
-    rc = fsopen(name, &io);
+    rc = fsopen(kname, &io);
     if (rc < 0)
         return rc;
 
@@ -291,9 +376,10 @@ long sysread(int fd, void * buf, size_t bufsz) {
     struct io * io = process_get_io(fd); // recovering io pointer
     if (io == NULL) return -EBADFD;
 
-    int rc = validate_vptr(buf, bufsz, PTE_U | PTE_R);
-    if (rc)
-        return -rc;
+    // the device copies straight into buf; faults in it are resolved as they
+    // would be for the process (see handle_smode_exception)
+    if (!user_range(buf, bufsz))
+        return -EFAULT;
 
     return io->intf->read(io, buf, bufsz); //calling from io abstraction
 }
@@ -309,9 +395,8 @@ long syswrite(int fd, const void * buf, size_t len) {
     struct io * io = process_get_io(fd); // recovering io pointer
     if (io == NULL) return -EBADFD;
 
-    int rc = validate_vptr(buf, len, PTE_U | PTE_W);
-    if (rc)
-        return -rc;
+    if (!user_range(buf, len))
+        return -EFAULT;
 
     // Handle small writes (< block size) via writeat so they don't get rejected
     int blksz = ioblksz(io);
@@ -336,14 +421,69 @@ long syswrite(int fd, const void * buf, size_t len) {
 // Inputs: int fd - File descriptor
 //         int cmd - IOCTL command
 //         void *arg - Argument for command
-// Outputs: int - Command-specific return or error
-// Description: Sends a control request to an I/O device
+// Outputs: int - Command-specific return or error, -EFAULT if arg is not user memory
+// Description: Sends a control request to an I/O device. The argument is copied into
+// a kernel buffer sized for cmd (see io.h) and copied back for commands that return
+// a result, so devices never touch user memory. Commands with no argument get NULL.
 // Side Effects: Device-specific behavior
 int sysioctl(int fd, int cmd, void * arg) {
     struct io * io = process_get_io(fd); // recovering io pointer
+    union {
+        unsigned long long ull[2];
+        unsigned long ul;
+        unsigned int ui;
+        struct blkstats stats;
+    } karg;
+    size_t size = 0;
+    int out = 0;
+    int result;
+
     if (io == NULL) return -EBADFD;
 
-    return io->intf->cntl(io, cmd, arg); //calling from io abstraction
+    switch (cmd) {
+    case IOCTL_GETBLKSZ: // ignored, but vioblk also stores the size through arg
+        size = sizeof(unsigned long);
+        out = 1;
+        break;
+    case IOCTL_GETEND:
+    case IOCTL_GETPOS:
+        size = sizeof(unsigned long long);
+        out = 1;
+        break;
+    case IOCTL_SETEND:
+    case IOCTL_SETPOS:
+    case IOCTL_PREALLOC:
+        size = sizeof(unsigned long long);
+        break;
+    case IOCTL_GETFRAG:
+        size = sizeof(unsigned int);
+        out = 1;
+        break;
+    case IOCTL_DISCARD:
+    case IOCTL_WRITEZEROES:
+        size = 2 * sizeof(unsigned long long);
+        break;
+    case IOCTL_GETSTATS:
+        size = sizeof(struct blkstats);
+        out = 1;
+        break;
+    default:
+        break;
+    }
+
+    if (size == 0 || arg == NULL)
+        return io->intf->cntl(io, cmd, NULL); //calling from io abstraction
+
+    // copied in for output commands too, so a device that ignores arg changes nothing
+    if (copy_from_user(&karg, arg, size) < 0)
+        return -EFAULT;
+
+    result = io->intf->cntl(io, cmd, &karg);
+
+    if (out && result >= 0 && copy_to_user(arg, &karg, size) < 0)
+        return -EFAULT;
+
+    return result;
 }
 
 // int sysfscreate(const char* name)
@@ -352,11 +492,12 @@ int sysioctl(int fd, int cmd, void * arg) {
 // Description: Creates a file in KTFS
 // Side Effects: Alters filesystem state
 int sysfscreate(const char* name) {
-    int rc = validate_vstr(name, PTE_U | PTE_R); //validating string
+    char kname[MAX_NAME_LEN];
+    int rc = copy_name(kname, name); //copying string
     if (rc)
-        return -rc;
+        return rc;
 
-    return fscreate(name);  // calling create from ktfs
+    return fscreate(kname);  // calling create from ktfs
 }
 
 // int sysfsdelete(const char* name)
@@ -365,11 +506,12 @@ int sysfscreate(const char* name) {
 // Description: Deletes a file in KTFS
 // Side Effects: Alters filesystem state
 int sysfsdelete(const char* name) {
-    int rc = validate_vstr(name, PTE_U | PTE_R); //validating string
+    char kname[MAX_NAME_LEN];
+    int rc = copy_name(kname, name); //copying string
     if (rc)
-        return -rc;
+        return rc;
 
-    return fsdelete(name);  // calling delete from ktfs
+    return fsdelete(kname);  // calling delete from ktfs
 }
 
 // int sysiodup(int oldfd, int newfd)
@@ -426,11 +568,31 @@ int syspipe(int *wfdptr, int *rfdptr) {
         return -EMFILE;
     }
 
+    if (copy_to_user(wfdptr, &wfd, sizeof(int)) < 0 ||
+        copy_to_user(rfdptr, &rfd, sizeof(int)) < 0)
+    {
+        ioclose(wio);
+        ioclose(rio);
+        return -EFAULT;
+    }
+
     proc->iotab[wfd] = wio;
     proc->iotab[rfd] = rio;
 
-    *wfdptr = wfd;
-    *rfdptr = rfd;
+    return 0;
+}
 
+// int copy_name(char * kname, const char * name)
+// Inputs: char *kname - Kernel buffer of MAX_NAME_LEN bytes
+//         const char *name - Null-terminated name in user memory
+// Outputs: int - 0 on success, -EINVAL if the name is too long, or -EFAULT
+// Description: Copies a device or file name from user memory
+// Side Effects: None
+int copy_name(char * kname, const char * name) {
+    long len = strncpy_from_user(kname, name, MAX_NAME_LEN);
+    if (len < 0)
+        return len;
+    if (len == MAX_NAME_LEN)
+        return -EINVAL;
     return 0;
-}
\ No newline at end of file
+}
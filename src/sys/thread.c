@@ -233,6 +233,10 @@ extern void _thread_startup(void);
 static struct thread main_thread;
 static struct thread idle_thread;
 
+// Threads other than main and idle are allocated from their own slab cache.
+static struct kmem_cache thread_cache =
+    KMEM_CACHE_INIT("thread", sizeof(struct thread));
+
 
 extern char _main_stack_lowest[]; // from start.s
 extern char _main_stack_anchor[]; // from start.s
@@ -574,7 +578,7 @@ void thread_reclaim(int tid) {
 
     thrtab[tid] = NULL;
     thr->proc = NULL; // added for process
-    kfree(thr);
+    kmem_cache_free(&thread_cache, thr);
 }
 
 
@@ -602,7 +606,8 @@ struct thread * create_thread(const char * name) {
     // Allocate a struct thread and a stack
 
 
-    thr = kcalloc(1, sizeof(struct thread));
+    thr = kmem_cache_alloc(&thread_cache);
+    memset(thr, 0, sizeof(struct thread));
    
     stack_page = alloc_phys_page();  // allocate one physical page // stack_page = kmalloc(STACK_SIZE);
     if (!stack_page) return NULL;
@@ -765,6 +770,12 @@ void idle_thread_func(void) {
 
         while (!tlempty(&ready_list))
             thread_yield();
+
+        // Nothing to run: clear pages ahead of time for alloc_zeroed_page, one at a
+        // time so that a thread made ready by an ISR does not wait long.
+
+        while (tlempty(&ready_list) && refill_zeroed_page())
+            continue;
        
         // No runnable threads. Sleep using the wfi instruction. Note that we
         // need to disable interrupts and check the runnable thread list one
@@ -0,0 +1,112 @@
+# usercopy.s - Copying to and from user memory
+#
+# Copyright (c) 2024-2025 University of Illinois
+# SPDX-License-identifier: NCSA
+#
+
+# Every instruction here that may touch user memory is listed in the exception
+# table, between _ex_table_start and _ex_table_end. Each entry is a pair of
+# doublewords: the address of the instruction and the address to resume at if it
+# faults. handle_smode_exception in excp.c looks the faulting sepc up there, so a
+# bad user pointer makes these functions return -EFAULT instead of panicking.
+
+        .section .rodata.ex_table, "a"
+        .balign 8
+        .global _ex_table_start
+_ex_table_start:
+
+# EX <instruction> emits the instruction and its exception table entry. All
+# entries resume at _user_fault; the functions below use no stack, so it can
+# return for them.
+
+        .macro  EX insn:vararg
+.Lex\@: \insn
+        .pushsection .rodata.ex_table, "a"
+        .balign 8
+        .dword  .Lex\@, _user_fault
+        .popsection
+        .endm
+
+        .text
+
+# long _user_copy(void * dst, const void * src, size_t n)
+#
+# Copies n bytes from src to dst, either of which may be in user memory. Returns 0,
+# or -EFAULT if an access faulted. When src and dst are equally aligned, the bulk
+# is copied a doubleword at a time.
+
+        .global _user_copy
+        .type   _user_copy, @function
+_user_copy:
+        xor     t0, a0, a1
+        andi    t0, t0, 7
+        bnez    t0, 3f          # alignments differ: bytes only
+
+1:      andi    t0, a0, 7       # bytes until dst and src are aligned
+        beqz    t0, 2f
+        beqz    a2, 4f
+EX      lbu     t1, 0(a1)
+EX      sb      t1, 0(a0)
+        addi    a0, a0, 1
+        addi    a1, a1, 1
+        addi    a2, a2, -1
+        j       1b
+
+2:      li      t2, 8           # doublewords
+        bltu    a2, t2, 3f
+EX      ld      t1, 0(a1)
+EX      sd      t1, 0(a0)
+        addi    a0, a0, 8
+        addi    a1, a1, 8
+        addi    a2, a2, -8
+        j       2b
+
+3:      beqz    a2, 4f          # remaining bytes
+EX      lbu     t1, 0(a1)
+EX      sb      t1, 0(a0)
+        addi    a0, a0, 1
+        addi    a1, a1, 1
+        addi    a2, a2, -1
+        j       3b
+
+4:      li      a0, 0
+        ret
+
+        .size   _user_copy, . - _user_copy
+
+# long _user_strncpy(char * dst, const char * src, size_t n)
+#
+# Copies a null-terminated string from user memory at src to dst, stopping after
+# the terminator or after n bytes. Returns the length of the string (without the
+# terminator) if it was copied whole, n if no terminator was found in n bytes, or
+# -EFAULT if an access faulted.
+
+        .global _user_strncpy
+        .type   _user_strncpy, @function
+_user_strncpy:
+        li      t2, 0           # bytes copied, terminator excluded
+1:      beq     t2, a2, 2f
+EX      lbu     t1, 0(a1)
+        sb      t1, 0(a0)
+        beqz    t1, 2f
+        addi    a0, a0, 1
+        addi    a1, a1, 1
+        addi    t2, t2, 1
+        j       1b
+
+2:      mv      a0, t2
+        ret
+
+        .size   _user_strncpy, . - _user_strncpy
+
+# Fault fixup for the functions above: return -EFAULT (error.h) to their caller.
+
+_user_fault:
+        li      a0, -18
+        ret
+
+        .section .rodata.ex_table, "a"
+        .global _ex_table_end
+_ex_table_end:
+
+        .end
@@ -70,6 +70,30 @@ struct io_term {
 #define IOCTL_SETEND    3
 #define IOCTL_GETPOS    4
 #define IOCTL_SETPOS    5
+#define IOCTL_GETFRAG   6
+#define IOCTL_DEFRAG    7
+#define IOCTL_PREALLOC  8
+#define IOCTL_FLUSH     9
+#define IOCTL_DISCARD   10
+#define IOCTL_WRITEZEROES 11
+#define IOCTL_GETSTATS  12
+
+// Block device statistics (IOCTL_GETSTATS), indexed by read (0) and write (1).
+// Times are timer ticks from submission to completion.
+
+#define BLKSTATS_HIST 16 // bucket i counts latencies below 2^i us; the last, the rest
+
+struct blkstats {
+    unsigned long long since;
+    unsigned long long ops[2];
+    unsigned long long bytes[2];
+    unsigned long long merged[2];
+    unsigned long long ticks[2];
+    unsigned long long hist[2][BLKSTATS_HIST];
+    unsigned long long other;
+    unsigned int depth;
+    unsigned int max_depth;
+};
 
 // refcount functions
 unsigned long iorefcnt(const struct io * io);
@@ -13,6 +13,7 @@
 extern void __attribute__ ((noreturn)) _exit(void);
 extern int _exec(int fd, int argc, char ** argv);
 extern int _fork(void);
+extern int _spawn(int fd, int argc, char ** argv, const int * fdmap, int nfd);
 extern int _wait(int tid);
 extern void _print(const char * msg);
 extern int _usleep(unsigned long us);